@@ -91,6 +91,7 @@ glm::vec3 trace_recursive_with_lens(RenderData & data, Ray const& ray, int depth
 		//glm::mat4 inverse_view_matrix = data.context.get_active_scene()->camera->get_inverse_view_matrix(data.camera_mode);
 		glm::vec3 world_new_origin;
 		// TODO DOF: sample random points on the lens
+		std::vector<Ray> lens_rays(data.context.params.dof_rays);
 		for ( int i = 0; i < data.context.params.dof_rays; i++){
 			Xi1 = data.tld->rand();
 			Xi2 = data.tld->rand();
@@ -102,10 +103,17 @@ glm::vec3 trace_recursive_with_lens(RenderData & data, Ray const& ray, int depth
 
 			// TODO DOF: generate ray from the sampled point on the
 			// lens through the common point in the focus plane
-			Ray new_ray = Ray(new_origin,focal_point);
+			lens_rays[i] = Ray(new_origin,focal_point);
+		}
+
+		// the lens rays of a pixel converge, trace their first hits as ray packets
+		int const first_hit = depth == 0
+			? trace_primary_packet(data, lens_rays.data(), int(lens_rays.size())) : -1;
 
-			// TODO DOF: start ray tracing with the new lens ray
-			contribution += trace_recursive(data, new_ray, depth);
+		// TODO DOF: start ray tracing with the new lens rays
+		for (size_t i = 0; i < lens_rays.size(); i++) {
+			data.primary_hit = first_hit < 0 ? -1 : first_hit + int(i);
+			contribution += trace_recursive(data, lens_rays[i], depth);
 		}
 		// TODO DOF: compute average contribution of all lens rays
 		contribution /= float(data.context.params.dof_rays);
@@ -42,6 +42,10 @@ glm::vec3 render_pixel(int x, int y, RaytracingContext const& context, RenderDat
 	std::vector<glm::vec2> samples;
 	int spp = data.context.params.spp;
 
+	// adaptive sampling asks for one sample at a time
+	if(data.context.params.adaptive_sampling)
+		spp = 1;
+
 	if(spp > 1) {
 		int grid_size = int(sqrtf(static_cast<float>(spp)));
 		if(data.context.params.stratified)
@@ -50,15 +54,24 @@ glm::vec3 render_pixel(int x, int y, RaytracingContext const& context, RenderDat
 			generate_random_samples(&samples, grid_size, grid_size, data.tld);
 		glm::vec3 accum(0.0f);
 
+		std::vector<Ray> rays(samples.size());
+		for(size_t i = 0; i < samples.size(); i++)
+			rays[i] = createPrimaryRay(data, float(x) + samples[i].x, float(y) + samples[i].y);
+
+		// the samples of a pixel are coherent, so trace their first hits
+		// as a ray packet (lens rays replace them with depth of field)
+		int const first_hit = data.context.params.dof ? -1
+			: trace_primary_packet(data, rays.data(), int(rays.size()));
+
 		for(size_t i = 0; i < samples.size(); i++) {
 			float fx = float(x) + samples[i].x;
 			float fy = float(y) + samples[i].y;
 
 			data.x = fx;
 			data.y = fy;
+			data.primary_hit = first_hit < 0 ? -1 : first_hit + int(i);
 
-			Ray ray = createPrimaryRay(data, fx, fy);
-			accum += trace_recursive_with_lens(data, ray, 0/*depth*/);
+			accum += trace_recursive_with_lens(data, rays[i], 0/*depth*/);
 		}
 
 		return accum / float(samples.size());
@@ -67,6 +80,13 @@ glm::vec3 render_pixel(int x, int y, RaytracingContext const& context, RenderDat
 		float fx = float(x) + 0.5f;
 		float fy = float(y) + 0.5f;
 
+		// progressive passes and adaptive sampling average jittered
+		// samples instead
+		if(data.context.params.progressive || data.context.params.adaptive_sampling) {
+			fx = float(x) + data.tld->rand();
+			fy = float(y) + data.tld->rand();
+		}
+
 		data.x = fx;
 		data.y = fy;
 
@@ -88,6 +108,8 @@ main(int argc, char const**argv)
 	context.add_scene(std::make_shared<MonkeyScene>(context.params));
 	context.add_scene(std::make_shared<SponzaScene>(context.params));
 	context.add_scene(std::make_shared<PoolTableScene>(context.params));
+	context.add_scene(std::make_shared<InstancingScene>(context.params));
+	context.add_scene(std::make_shared<SphereFlakeScene>(context.params));
 
 	return HostRender::run(context, render_pixel);
 }
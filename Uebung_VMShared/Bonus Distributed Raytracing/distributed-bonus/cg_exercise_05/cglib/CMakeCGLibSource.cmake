@@ -14,6 +14,7 @@ set(CGLIB_SOURCE_FILES
 	src/rt/host_render.cpp
 	src/rt/material.cpp
 	src/rt/object.cpp
+	src/rt/primitive_bvh.cpp
 	src/rt/raytracing_context.cpp
 	src/rt/raytracing_parameters.cpp
 	src/rt/renderer.cpp
@@ -24,6 +25,10 @@ set(CGLIB_SOURCE_FILES
 	src/rt/texture_mapping.cpp
 	src/core/obj_mesh.cpp
 	src/rt/bvh.cpp
+	src/rt/bvh_cache.cpp
+	src/rt/instance_group.cpp
+	src/rt/top_level_bvh.cpp
 	src/rt/transform.cpp
 	src/rt/triangle_soup.cpp
+	src/rt/wavefront_render.cpp
 )
@@ -0,0 +1,53 @@
+#pragma once
+
+#ifndef _MSC_VER
+#include <mm_malloc.h>	// include for _mm_malloc()
+#else
+#include <malloc.h>
+#endif
+
+#include <cstddef>
+#include <new>
+
+/*
+ * Allocator for standard containers that places the storage on an
+ * Alignment byte boundary, e.g. to start an array of nodes on a cache line.
+ */
+template <class T, std::size_t Alignment = 64>
+struct AlignedAllocator
+{
+	typedef T value_type;
+
+	template <class U>
+	struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator() {}
+
+	template <class U>
+	AlignedAllocator(AlignedAllocator<U, Alignment> const&) {}
+
+	T* allocate(std::size_t n)
+	{
+		void* ptr = _mm_malloc(n * sizeof(T), Alignment);
+		if (!ptr)
+			throw std::bad_alloc();
+		return static_cast<T*>(ptr);
+	}
+
+	void deallocate(T* ptr, std::size_t)
+	{
+		_mm_free(ptr);
+	}
+};
+
+template <class T, class U, std::size_t Alignment>
+inline bool operator==(AlignedAllocator<T, Alignment> const&, AlignedAllocator<U, Alignment> const&)
+{
+	return true;
+}
+
+template <class T, class U, std::size_t Alignment>
+inline bool operator!=(AlignedAllocator<T, Alignment> const&, AlignedAllocator<U, Alignment> const&)
+{
+	return false;
+}
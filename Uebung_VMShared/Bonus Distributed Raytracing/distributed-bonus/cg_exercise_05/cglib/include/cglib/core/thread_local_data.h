@@ -2,6 +2,8 @@
 
 #include <random>
 
+struct PrimaryHits;
+
 /*
  * Thread-local data.
  *
@@ -19,11 +21,19 @@ struct ThreadLocalData
 	
 	bool distributed_recursion = false;
 
+	// Index of the thread in its thread pool.
+	int thread_id = 0;
+
+	// First hits of ray packets for the pixels currently rendered by this
+	// thread, nullptr if ray packets are disabled.
+	PrimaryHits* primary_hits = nullptr;
+
 	ThreadLocalData() {}
 
 	virtual void initialize(int threadId) final
 	{
 		rng.seed(8890 + threadId);
+		thread_id = threadId;
 	}
 
 	inline float rand()
@@ -2,11 +2,17 @@
 
 /*
  * A very simple thread pool. It runs a given number of jobs concurrently with a fixed thread budget.
+ *
+ * The worker threads are started once and sleep while there is nothing to
+ * do. Every worker has its own queue of jobs, and a worker whose queue is
+ * empty steals jobs from the others.
  */
 
 #include <cglib/core/thread_local_data.h>
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -33,6 +39,11 @@ class ThreadPool
 			return m_jobsDone.load();
 		}
 
+		inline int num_threads() const
+		{
+			return static_cast<int>(m_threads.size());
+		}
+
 		template <class TLD = void>
 		void run(
 			// Number of instances to run.
@@ -46,15 +57,8 @@ class ThreadPool
             return (num_jobs() == 0 || float(jobs_done())/num_jobs() > 0.1);
         }
 
-		void
-		wait()
-		{
-			for(auto &i: m_threads) {
-				if(i->joinable()) {
-						i->join();
-				}
-			}
-		}
+		// Block until all jobs of the last run are done or dropped.
+		void wait();
 
 		void poll_exceptions()
 		{
@@ -75,23 +79,48 @@ class ThreadPool
 		bool kill_at_timeout(int timeout);
 
 	private:
+		// The jobs of one worker. The owner takes jobs from the front,
+		// other workers steal from the back.
+		struct WorkQueue
+		{
+			std::mutex      mutex;
+			std::deque<int> jobs;
+		};
+
 		void run_internal(
 			int num_jobs,
 			std::function<void(int, ThreadLocalData* tld, std::atomic<bool>&)> kernel,
 			std::function<void(int, std::unique_ptr<ThreadLocalData>& tld)> tldAlloc
 		);
 
+		void worker(int threadId);
+		bool pop_job(int threadId, int* jobId);
+		void run_job(int threadId, int jobId);
+		void finish_jobs(int count);
+		void drop_jobs();
+
 	private:
 		std::vector<std::unique_ptr<std::thread>>     m_threads;
+		std::vector<std::unique_ptr<WorkQueue>>       m_queues;
 		std::function<void(int, ThreadLocalData*, std::atomic<bool>&)>    m_kernel;
 		std::vector<std::unique_ptr<ThreadLocalData>> m_tld;
 		std::atomic<int>                              m_numJobs;
-		std::atomic<int>                              m_currentJob;
 		std::atomic<int>                              m_jobsDone;
+		std::atomic<int>                              m_jobsLeft; // queued or running
 		std::atomic<bool>                             m_terminate;
 		std::atomic<bool>                             m_hasException;
 		std::vector<std::string>                      m_exceptionMsg;
 		std::mutex                                    m_exceptionMutex;
+
+		// Guards waking and counting the workers. m_wake is signaled when
+		// a new run starts, m_idle when the last job is done or the last
+		// worker goes back to sleep.
+		std::mutex                                    m_mutex;
+		std::condition_variable                       m_wake;
+		std::condition_variable                       m_idle;
+		unsigned                                      m_generation;
+		int                                           m_numWorking;
+		bool                                          m_shutdown;
 };
 
 template <class TLD>
@@ -15,6 +15,25 @@ struct AABB
 		this->max = glm::max(this->max, v + glm::vec3(1e-4f));
 	}
 
+	void extend(const AABB &other)
+	{
+		this->min = glm::min(this->min, other.min);
+		this->max = glm::max(this->max, other.max);
+	}
+
+	glm::vec3 center() const
+	{
+		return 0.5f * (this->min + this->max);
+	}
+
+	float surface_area() const
+	{
+		if (!is_valid())
+			return 0.0f;
+		const glm::vec3 d = this->max - this->min;
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
 	bool
 	intersect(const Ray &ray, float &t_min, float &t_max) const
 	{
@@ -4,12 +4,88 @@
 #include <cglib/rt/object.h>
 #include <cglib/rt/epsilon.h>
 
+#include <cglib/core/aligned_allocator.h>
+
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <cstdint>
 
 class Intersection;
 class TriangleSoup;
+class ThreadPool;
+
+/*
+ * Strategies for choosing the split of a BVH node during construction.
+ * - BVH_BUILD_SAH:    binned surface area heuristic, chooses axis, split
+ *                     position and leaf size by estimated traversal cost.
+ * - BVH_BUILD_MEDIAN: object median along an axis that rotates with depth.
+ * - BVH_BUILD_SBVH:   binned SAH that may also split space, clipping the
+ *                     triangles that straddle the split plane and referencing
+ *                     them in both children (Stich et al., "Spatial Splits in
+ *                     Bounding Volume Hierarchies"). Builds slower and uses
+ *                     more memory, but leaves overlap less.
+ * - BVH_BUILD_LBVH:   linear BVH, sorts the triangles along a Morton curve
+ *                     and splits where the highest bit of the codes changes
+ *                     (Lauterbach et al., "Fast BVH Construction on GPUs").
+ *                     The fastest builder, at the price of tree quality.
+ */
+enum BVHBuildMode {
+	BVH_BUILD_SAH,
+	BVH_BUILD_MEDIAN,
+	BVH_BUILD_SBVH,
+	BVH_BUILD_LBVH,
+	BVH_BUILD_MODE_COUNT
+};
+
+extern const char* bvh_build_mode_names[BVH_BUILD_MODE_COUNT];
+
+/*
+ * Branching factor of the tree used for traversal.
+ * - BVH_BINARY: the binary tree in flat_nodes, children are tested one by one.
+ * - BVH_WIDE_4: the binary tree collapsed into nodes with up to 4 children,
+ *               which are tested against the ray with one SSE slab test.
+ * - BVH_WIDE_8: nodes with up to 8 children, tested with one AVX slab test
+ *               if the compiler targets AVX and with two SSE tests otherwise.
+ * - BVH_QUANTIZED_4, BVH_QUANTIZED_8:
+ *               like BVH_WIDE_4 and BVH_WIDE_8, but the child bounds are
+ *               stored in 8 bits relative to the bounds of the node, which
+ *               halves the size of a node.
+ */
+enum BVHNodeWidth {
+	BVH_BINARY,
+	BVH_WIDE_4,
+	BVH_WIDE_8,
+	BVH_QUANTIZED_4,
+	BVH_QUANTIZED_8,
+	BVH_NODE_WIDTH_COUNT
+};
+
+extern const char* bvh_node_width_names[BVH_NODE_WIDTH_COUNT];
+
+/*
+ * Work done by BVH traversals. Rays and hits are counted once per ray traced
+ * through the TopLevelBVH of a scene, however many objects the ray visits.
+ * A ray packet visiting a node and the children of a wide node tested
+ * together count as one visited node, ray triangle tests are counted per
+ * ray.
+ */
+struct BVHTraversalCounters
+{
+	uint64_t rays             = 0;
+	uint64_t nodes_visited    = 0;
+	uint64_t triangles_tested = 0;
+	uint64_t hits             = 0;
+
+	BVHTraversalCounters& operator+=(BVHTraversalCounters const& other)
+	{
+		rays             += other.rays;
+		nodes_visited    += other.nodes_visited;
+		triangles_tested += other.triangles_tested;
+		hits             += other.hits;
+		return *this;
+	}
+};
 
 class BVH : public Object
 {
@@ -21,6 +97,62 @@ public:
 	 */
 	enum { MAX_TRIANGLES_IN_LEAF = 4 };
 
+	/*
+	 * The size of the node stack used during traversal, and the depth of
+	 * the deepest node the builders create, so that the stack never
+	 * overflows. Close to MAX_DEPTH, nodes are split at the object median,
+	 * and nodes at MAX_DEPTH become leaves however many triangles they hold.
+	 */
+	enum { TRAVERSAL_STACK_SIZE = 64, MAX_DEPTH = TRAVERSAL_STACK_SIZE - 1 };
+
+	/*
+	 * Whether a node at the given depth has to be split at the object
+	 * median so that the subtree over count items, with at most
+	 * max_in_leaf items per leaf, still ends at MAX_DEPTH.
+	 */
+	static bool near_depth_limit(int depth, int count, int max_in_leaf = MAX_TRIANGLES_IN_LEAF);
+
+	/*
+	 * Parameters of the binned SAH builder. Nodes with more than
+	 * MAX_TRIANGLES_IN_LEAF triangles are split whenever that is cheaper
+	 * than intersecting all of their triangles, but a leaf never holds more
+	 * than SAH_MAX_TRIANGLES_IN_LEAF triangles.
+	 */
+	enum { SAH_NUM_BINS = 16, SAH_MAX_TRIANGLES_IN_LEAF = 16 };
+
+	/*
+	 * Relative costs of one traversal step and one ray-triangle test used
+	 * to evaluate the surface area heuristic.
+	 */
+	static const float SAH_TRAVERSAL_COST;
+	static const float SAH_INTERSECTION_COST;
+
+	/*
+	 * Parameters of the spatial split builder. Spatial splits are only tried
+	 * where the children of the best object split overlap by more than
+	 * SBVH_OVERLAP_THRESHOLD times the surface area of the root, and the
+	 * number of references may grow by at most SBVH_MAX_DUPLICATION times the
+	 * number of triangles.
+	 */
+	static const float SBVH_OVERLAP_THRESHOLD;
+	static const float SBVH_MAX_DUPLICATION;
+
+	/*
+	 * Parameters of the parallel build. Subtrees with at most
+	 * PARALLEL_BUILD_JOB_TRIANGLES triangles are built as one thread pool job,
+	 * larger nodes are binned and partitioned by all threads in chunks of
+	 * PARALLEL_BUILD_CHUNK triangles. The resulting tree does not depend on
+	 * the number of threads.
+	 */
+	enum { PARALLEL_BUILD_JOB_TRIANGLES = 1 << 12, PARALLEL_BUILD_CHUNK = 1 << 14 };
+
+	/*
+	 * Parameters of packet traversal. Up to MAX_PACKET_SIZE rays traverse
+	 * the tree together; once fewer than PACKET_MIN_ACTIVE_RAYS of them hit
+	 * a node, its subtree is traversed by each of those rays alone.
+	 */
+	enum { MAX_PACKET_SIZE = 16, PACKET_MIN_ACTIVE_RAYS = 2 };
+
 	/*
 	 * A BVH node.
 	 *
@@ -37,30 +169,289 @@ public:
 		int num_triangles = 0;
 	};
 
+	/*
+	 * A subtree that is built as one job during a parallel build.
+	 */
+	struct BuildJob {
+		int node_idx;            /* placeholder node in the top levels of the tree */
+		int first_triangle_idx;
+		int num_triangles;
+		int depth;
+		std::vector<Node> nodes; /* the subtree, rooted at nodes[0] */
+	};
+
+	/*
+	 * A triangle during a spatial split build, with the bounds of the part
+	 * of it that lies in the current node.
+	 */
+	struct Reference {
+		AABB aabb;
+		int  triangle;
+	};
+
+	/*
+	 * Shape and size of the tree, see compute_stats.
+	 * - leaf_sizes  number of leaves by their number of triangles, the last
+	 *               entry also counts all larger leaves.
+	 */
+	struct Stats {
+		int    num_nodes       = 0;
+		int    num_leaves      = 0;
+		int    num_references  = 0;
+		int    max_depth       = 0;
+		float  mean_leaf_depth = 0.0f;
+		int    leaf_sizes[SAH_MAX_TRIANGLES_IN_LEAF + 1] = {};
+		float  sah_cost        = 0.0f;
+		size_t memory_size     = 0;
+	};
+
+	/*
+	 * Counters of the calling thread that traversals add to, or nullptr if
+	 * traversals are not counted. Every render thread points this at its
+	 * own counters, so counting needs no synchronization.
+	 */
+	static thread_local BVHTraversalCounters *traversal_counters;
+
 	/*
 	 * The triangle soup for which this BVH is built.
 	 */
 	const TriangleSoup &triangle_soup;
 
 	/*
-	 * Indices into triangle_soup. Will be reordered during the build phase.
+	 * Indices into triangle_soup. Will be reordered during the build phase,
+	 * afterwards the triangles of the leaves of flat_nodes follow each other
+	 * in the order of the leaves. With BVH_BUILD_SBVH, a triangle may appear
+	 * in more than one leaf.
 	 */
 	std::vector<int> triangle_indices;
 
 	/*
-	 * The nodes contained in this BVH.
+	 * The nodes of the tree during construction. flatten releases them, the
+	 * finished tree is only kept in flat_nodes.
 	 */
 	std::vector<Node> nodes;
 
+	/*
+	 * A node of the flattened tree that is used for traversal.
+	 *
+	 * Flat nodes are stored in depth-first order, so the left child of an
+	 * inner node is the node right after it. A flat node is 32 bytes and the
+	 * array starts on a cache line, so a node never straddles two lines.
+	 * - offset         inner node: index of the right child,
+	 *                  leaf:       index of the first block in triangle_blocks.
+	 * - num_triangles  0 for inner nodes.
+	 */
+	struct FlatNode {
+		AABB aabb;
+		int offset        = -1;
+		int num_triangles = 0;
+	};
+
+	/*
+	 * The flattened nodes, built from nodes after construction and used for
+	 * traversal, refitting and statistics. Empty if the triangle soup is
+	 * empty, and freed once the tree is collapsed into quantized nodes.
+	 */
+	std::vector<FlatNode, AlignedAllocator<FlatNode, 64>> flat_nodes;
+
+	/*
+	 * Four triangles of a leaf, prepared for intersection in SSE lanes: the
+	 * first vertex and both edges as structure of arrays, and the index of
+	 * each triangle in triangle_soup. The lanes after the last triangle of
+	 * a leaf are padding with triangle_id -1.
+	 */
+	struct TriangleBlock {
+		float v0[3][4];
+		float edge1[3][4];
+		float edge2[3][4];
+		int   triangle_id[4];
+	};
+
+	/*
+	 * The triangles of all leaves, in the order of the leaves in flat_nodes.
+	 * Every leaf starts a new block.
+	 */
+	std::vector<TriangleBlock, AlignedAllocator<TriangleBlock, 64>> triangle_blocks;
+
+	/*
+	 * A node of the collapsed N-wide tree.
+	 *
+	 * The bounds of all children are stored as structure of arrays, so that
+	 * one SIMD slab test covers N children. Unused child slots have inverted
+	 * bounds, which are never hit.
+	 * - offset         inner child: index of the child node,
+	 *                  leaf child:  index of the first block in triangle_blocks,
+	 *                  unused slot: -1.
+	 * - num_triangles  0 for inner children and unused slots.
+	 */
+	template <int N>
+	struct WideNode {
+		float bounds_min[3][N];
+		float bounds_max[3][N];
+		int   offset[N];
+		int   num_triangles[N];
+	};
+
+	/*
+	 * The collapsed nodes, the root is the first node. Only the array that
+	 * belongs to node_width is filled, and it is empty if the triangle soup
+	 * is empty.
+	 */
+	std::vector<WideNode<4>, AlignedAllocator<WideNode<4>, 64>> wide4_nodes;
+	std::vector<WideNode<8>, AlignedAllocator<WideNode<8>, 64>> wide8_nodes;
+
+	/*
+	 * A WideNode with compressed child bounds.
+	 *
+	 * Along axis a, the bounds of child i are
+	 *     origin[a] + bounds_min[a][i] * 2^exponent[a]  and
+	 *     origin[a] + bounds_max[a][i] * 2^exponent[a],
+	 * rounded outwards during quantization, so that they always contain the
+	 * exact bounds. Unused child slots have bounds_min 255 and bounds_max 0.
+	 */
+	template <int N>
+	struct alignas(64) QuantizedNode {
+		float   origin[3];
+		int8_t  exponent[3];
+		uint8_t bounds_min[3][N];
+		uint8_t bounds_max[3][N];
+		uint8_t num_triangles[N];
+		int     offset[N];
+	};
+
+	/*
+	 * The quantized nodes, filled like wide4_nodes and wide8_nodes.
+	 */
+	std::vector<QuantizedNode<4>, AlignedAllocator<QuantizedNode<4>, 64>> quantized4_nodes;
+	std::vector<QuantizedNode<8>, AlignedAllocator<QuantizedNode<8>, 64>> quantized8_nodes;
+
+	/*
+	 * The strategy used to build this BVH.
+	 */
+	BVHBuildMode build_mode;
+
+	/*
+	 * The branching factor of the tree used by intersect.
+	 */
+	BVHNodeWidth node_width;
+
+	/*
+	 * Wall clock time of the last (re)build in milliseconds.
+	 */
+	double build_time_ms = 0.0;
+
+	/*
+	 * SAH cost of the tree right after the last (re)build, see sah_cost.
+	 */
+	float build_sah_cost = 0.0f;
+
+	/*
+	 * Statistics of the current tree, computed whenever it is built, refit
+	 * or collapsed to another node width.
+	 */
+	Stats stats;
+
 	/* 
 	 * Construct (and build) a new BVH for the given triangle soup.
 	 */
-	BVH(const TriangleSoup &triangle_soup_);
+	BVH(const TriangleSoup &triangle_soup_, BVHBuildMode build_mode_ = BVH_BUILD_SAH,
+			BVHNodeWidth node_width_ = BVH_BINARY);
+
+	/*
+	 * Construct a BVH from a tree that was built before, e.g. one mapped
+	 * from a cache file. The num_references triangle indices and the
+	 * num_nodes flat nodes are copied and must be the result of a build with
+	 * build_mode_ for triangle_soup_; the leaf offsets are recomputed.
+	 */
+	BVH(const TriangleSoup &triangle_soup_, BVHBuildMode build_mode_, BVHNodeWidth node_width_,
+			int const* triangle_indices_, size_t num_references,
+			FlatNode const* flat_nodes_, size_t num_nodes);
+
+	/*
+	 * Bytes used by the finished tree: the flattened and collapsed nodes,
+	 * the triangle blocks and the triangle indices.
+	 */
+	size_t memory_size() const;
+
+	/*
+	 * Throw away the current tree and build it again with the given strategy.
+	 */
+	void rebuild(BVHBuildMode build_mode_, BVHNodeWidth node_width_);
+
+	/*
+	 * Recompute the bounds of all nodes bottom-up after the vertices of
+	 * triangle_soup were moved, keeping the topology of the tree. Returns
+	 * false once the SAH cost of the refitted tree exceeds max_sah_growth
+	 * times the cost right after the last build; the tree is still correct
+	 * then, but should be rebuilt. Quantized trees cannot be refit and
+	 * always return false. Bounds of objects change, so a TopLevelBVH
+	 * containing this BVH must be built again afterwards.
+	 */
+	bool refit(float max_sah_growth = 1.5f);
+
+	/*
+	 * Expected cost of a ray that hits the root under the surface area
+	 * heuristic: the traversal and intersection costs of all nodes,
+	 * weighted by the surface area of each node relative to the root.
+	 * 0 without flat_nodes, stats keeps the cost of a quantized tree.
+	 */
+	float sah_cost() const;
+
+	/*
+	 * Walk the tree and collect its statistics. Use the stats member
+	 * instead of calling this for every frame.
+	 */
+	Stats compute_stats() const;
+
+	/*
+	 * Collapse the current tree into nodes of the given width, without
+	 * rebuilding it. A quantized tree has no flat_nodes left to collapse,
+	 * so switching away from it rebuilds the tree.
+	 */
+	void set_node_width(BVHNodeWidth node_width_);
     
 	/*
-	 * Intersect the given ray with this bvh.
+	 * Intersect the given ray with this bvh. isect may be nullptr.
 	 */
     bool intersect(Ray const& ray, Intersection* isect) const override;
+
+	/*
+	 * Find the nearest triangle without computing any shading data, and
+	 * build the intersection for it.
+	 */
+	bool intersect_hit(Ray const& ray, HitRecord* hit) const override;
+	void fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const override;
+
+	/*
+	 * Check whether the ray hits any triangle closer than t_max. Traversal
+	 * stops at the first such triangle and no intersection is filled in.
+	 */
+	bool occluded(Ray const& ray, float t_max) const override;
+
+	/*
+	 * Like intersect_hit, fill_intersection and occluded, for a copy of
+	 * this mesh placed with the given transforms instead of the transforms
+	 * of this object.
+	 */
+	bool intersect_instance(Ray const& ray, HitRecord* hit,
+			glm::mat4 const& world_to_object, glm::mat4 const& object_to_world) const;
+	void fill_instance_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect,
+			glm::mat4 const& world_to_object, glm::mat4 const& object_to_world) const;
+	bool occluded_instance(Ray const& ray, float t_max,
+			glm::mat4 const& world_to_object, glm::mat4 const& object_to_world) const;
+
+	/*
+	 * The bounds of the root node, empty if the triangle soup is empty.
+	 */
+	bool get_local_bounds(AABB* aabb) const override;
+
+	/*
+	 * Intersect num_rays coherent rays with this bvh, traversing the tree
+	 * once for every MAX_PACKET_SIZE rays. found[i] and hits[i] are set as
+	 * if intersect_hit(rays[i], &hits[i]) had been called, except that ties
+	 * between triangles at the same distance may be broken differently.
+	 */
+	void intersect_packet(Ray const rays[], int num_rays, HitRecord hits[], bool found[]) const;
     
 	/*
 	 * For the given intersection, compute additional information needed
@@ -69,21 +460,151 @@ public:
     virtual void compute_shading_info(Intersection* isect) override;
     virtual void compute_shading_info(const Ray rays[4], Intersection* isect) override;
 
+	/*
+	 * The material of the given triangle.
+	 */
+	Material const& get_material(uint32_t triangle) const;
+
 	/*
 	 * Sanity checks for the BVH structure. Currently unused, but feel
 	 * free to implement your own checks in this method during testing.
 	 */
 	void sanity_checks();
 
-	void build_bvh(int node_idx, int first_triangle_idx, int num_triangles, int depth);
+	/*
+	 * Build the subtree rooted at out[node_idx] over the given range of
+	 * triangle_indices. If jobs is given, subtrees that are small enough are
+	 * not built but recorded as jobs; if thread_pool is given, large nodes
+	 * are split using all of its threads.
+	 */
+	void build_bvh(std::vector<Node> &out, int node_idx, int first_triangle_idx, int num_triangles, int depth,
+			std::vector<BuildJob> *jobs = nullptr, ThreadPool *thread_pool = nullptr);
 
 	/*
-	 * Used for debug visualization. Maps the number of AABBs that can be
-	 * encountered along the given ray to a color.
+	 * Build the subtree rooted at out[node_idx] over the given references
+	 * with spatial splits, appending the triangles of its leaves to
+	 * triangle_indices. At most duplication_budget more references are
+	 * created, the budget is decreased by the number used.
+	 */
+	void build_sbvh(std::vector<Node> &out, int node_idx, std::vector<Reference> &&refs, int depth,
+			float root_area, int &duplication_budget);
+
+	/*
+	 * Build the whole tree with the linear builder. Morton codes are
+	 * computed and radix sorted in chunks by the threads of thread_pool if
+	 * it is given, the bounds of the nodes are fitted afterwards.
+	 */
+	void build_lbvh(ThreadPool *thread_pool = nullptr);
+
+	/*
+	 * Used for debug visualization. Maps the number of AABBs of the tree
+	 * of node_width that can be encountered along the given ray to a color.
 	 */
 	glm::vec3 intersect_count(const Ray &ray, int idx, int depth);
 
 private:
-	bool intersect_local(Ray const& ray, Intersection* isect) const;
+	struct RayPacket;
+
+	/*
+	 * Find the nearest triangle hit by a ray in object space.
+	 */
+	bool intersect_local(Ray const& ray, float &min_dist, glm::vec3 &bary, int &nearest_triangle) const;
+
+	/*
+	 * The world space position of the point with the given barycentric
+	 * coordinates on a triangle, the same as fill_intersection computes.
+	 */
+	glm::vec3 world_position(int triangle, glm::vec3 const& bary, glm::mat4 const& object_to_world) const;
+	void intersect_packet_local(RayPacket &packet) const;
+
+	/*
+	 * Traverse the binary or the wide tree. With any_hit set, traversal
+	 * stops at the first triangle closer than min_dist and returns true
+	 * only if there is one; otherwise the nearest hit is found.
+	 */
+	template <bool any_hit>
+	bool intersect_binary(Ray const& ray, int root, float &min_dist, glm::vec3 &bary, int &nearest_triangle) const;
+	template <int N, bool any_hit, class WideNodes>
+	bool intersect_wide(WideNodes const& wide_nodes, Ray const& ray,
+			float &min_dist, glm::vec3 &bary, int &nearest_triangle) const;
+
+	/*
+	 * Intersect the ray with the triangles of a leaf and update the nearest
+	 * hit. Returns true if any triangle was hit, or with any_hit set, as soon
+	 * as a triangle closer than min_dist is hit.
+	 */
+	template <bool any_hit>
+	bool intersect_triangles(Ray const& ray, int first_block, int num_triangles,
+			float &min_dist, glm::vec3 &bary, int &nearest_triangle) const;
+
+	/*
+	 * Reorder triangle_indices in [first_triangle_idx, first_triangle_idx + num_triangles)
+	 * and return the number of triangles that go into the left child, or 0 if
+	 * the node should become a leaf.
+	 */
+	int split_median(int first_triangle_idx, int num_triangles, int depth);
+	int split_sah(int first_triangle_idx, int num_triangles, AABB const& aabb, ThreadPool *thread_pool);
+
+	/*
+	 * Emit the subtree rooted at nodes[node_idx] over the range of
+	 * triangle_indices whose Morton codes are in codes, splitting it where
+	 * the highest differing bit changes.
+	 */
+	void emit_lbvh(int node_idx, int first_triangle_idx, int num_triangles, int depth,
+			std::vector<uint32_t> const& codes);
+
+	/*
+	 * Compute the bounds of all nodes from the triangles of the leaves,
+	 * children before their parents.
+	 */
+	void fit_bounds(ThreadPool *thread_pool);
+
+	/*
+	 * Copy the subtree rooted at src[src_idx] (or at the root of the job that
+	 * replaced it) to nodes[dst_idx], allocating children in the same order
+	 * as a single-threaded build would.
+	 */
+	void assemble(std::vector<Node> const& src, int src_idx, int dst_idx,
+			std::vector<BuildJob> const& jobs, std::vector<int> const& job_of_node);
+
+	/*
+	 * Store nodes in depth-first order in flat_nodes and the triangles of
+	 * their leaves in triangle_blocks, then release nodes.
+	 */
+	void flatten();
+
+	/*
+	 * Copy the vertices of the triangles of all leaves of flat_nodes into
+	 * triangle_blocks and point the leaves at their first block.
+	 */
+	void fill_triangle_blocks();
+
+	/*
+	 * Collapse flat_nodes into wide_nodes by repeatedly replacing the inner child
+	 * with the largest surface area by its two children.
+	 */
+	template <int N, class WideNodes>
+	void collapse(WideNodes &wide_nodes) const;
+	template <int N, class WideNodes>
+	void collapse_node(WideNodes &wide_nodes, int node_idx, int wide_idx) const;
+
+	/*
+	 * Collapse flat_nodes like collapse and quantize the child bounds of
+	 * every node.
+	 */
+	template <int N, class QuantizedNodes>
+	void collapse_quantized(QuantizedNodes &quantized_nodes) const;
+
+	/*
+	 * Bounds of every triangle in triangle_soup. Only valid during construction.
+	 */
+	std::vector<AABB> triangle_aabbs;
 };
 
+static_assert(sizeof(BVH::FlatNode) == 32, "BVH::FlatNode must fill half a cache line");
+static_assert(sizeof(BVH::WideNode<4>) == 128, "BVH::WideNode<4> must fill two cache lines");
+static_assert(sizeof(BVH::WideNode<8>) == 256, "BVH::WideNode<8> must fill four cache lines");
+static_assert(sizeof(BVH::QuantizedNode<4>) == 64, "BVH::QuantizedNode<4> must fill one cache line");
+static_assert(sizeof(BVH::QuantizedNode<8>) == 128, "BVH::QuantizedNode<8> must fill two cache lines");
+static_assert(sizeof(BVH::TriangleBlock) == 160, "BVH::TriangleBlock must keep its arrays 16-byte aligned");
+
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cglib/rt/bvh.h>
+#include <cglib/rt/texture.h>
+
+#include <memory>
+#include <string>
+
+class TriangleSoup;
+
+/*
+ * Load the triangle soup of an OBJ file and its BVH.
+ *
+ * Both are read from the cache file obj_path + ".bvhcache" if it was
+ * written for the same build mode and the contents of the OBJ and MTL
+ * files still hash to what they did then, which skips parsing and
+ * building. Otherwise the OBJ file is parsed, the BVH is built and the
+ * cache file is (re)written. The soup is returned in *soup and must outlive
+ * the BVH.
+ */
+std::unique_ptr<BVH> load_obj_bvh(
+		std::string const& obj_path,
+		TextureContainer *textures,
+		BVHBuildMode build_mode,
+		BVHNodeWidth node_width,
+		std::shared_ptr<TriangleSoup> *soup);
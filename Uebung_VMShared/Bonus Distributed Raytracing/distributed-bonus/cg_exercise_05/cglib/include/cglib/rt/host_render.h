@@ -14,9 +14,6 @@
 #include <chrono>
 #include <functional>
 #include <iostream>
-#include <mutex>
-
-static std::mutex mutex;
 
 struct RenderData;
 
@@ -42,10 +39,43 @@ class HostRender
 	private:
 		typedef std::function<glm::vec3(int, int, RaytracingContext const&, ThreadLocalData*)> PixelFuncRaw;
 		static void generate_tile_idx(int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx);
+		/*
+		 * Cover the image with tiles along a Hilbert curve, so that tiles
+		 * rendered at the same time are close and share cached scene data.
+		 * A tile is as large as possible, up to max_tile_size, while at
+		 * least TILES_PER_THREAD tiles of its size per thread are left,
+		 * which keeps all threads busy until the end of the frame. Tiles
+		 * are stored as (x0, y0, x1, y1).
+		 */
+		enum { TILES_PER_THREAD = 4 };
+		static void generate_tiles_hilbert(int width, int height, int min_tile_size, int max_tile_size,
+			int num_threads, std::vector<glm::ivec4>* tiles);
 		static int run_interactive(RaytracingContext& context, PixelFuncRaw const& render_pixel, 
 			std::function<void()> const& render_overlay = []() {} );
 		static int run_noninteractive(RaytracingContext& context, 
 			PixelFuncRaw const& render_pixel,
 			int kill_timeout_seconds);
-		static void launch(Image* fb, ThreadPool& thread_pool, RaytracingContext const* context, std::vector<glm::ivec2>* tile_idx, PixelFuncRaw render_pixel);
+		/*
+		 * Receives the final color of pixel (x, y) of a tile.
+		 */
+		typedef std::function<void(int, int, glm::vec3 const&)> PixelStore;
+		/*
+		 * Render the pixels [x0, x1) x [y0, y1) with adaptive sampling and
+		 * pass their colors to store. Returns false if rendering was
+		 * terminated.
+		 */
+		static bool render_tile_adaptive(RaytracingContext const& context, ThreadLocalData* tld,
+			int x0, int y0, int x1, int y1, PixelFuncRaw const& render_pixel, PixelStore const& store,
+			std::atomic<bool> const& terminate);
+		/*
+		 * Render a frame into fb. If accum is given, the frame is the
+		 * progressive pass with the given index: its colors are added to
+		 * accum, whose alpha counts the passes, and fb shows their mean.
+		 * Pass 0 clears accum, fb keeps its pixels until they are written.
+		 * Tiles never overlap, so they write straight into the images
+		 * without a lock. A pixel may be read while it is written, which
+		 * only shows up in the preview until the tile is counted as done.
+		 */
+		static void launch(Image* fb, ThreadPool& thread_pool, RaytracingContext const* context, std::vector<glm::ivec4>* tiles, PixelFuncRaw render_pixel,
+			Image* accum = nullptr, int pass = 0);
 };
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cglib/rt/object.h>
+#include <cglib/rt/top_level_bvh.h>
+
+#include <memory>
+#include <vector>
+
+class BVH;
+
+/*
+ * Many copies of a few triangle meshes.
+ *
+ * Every mesh has one BVH, which is shared by all of its instances. An
+ * instance only stores its transforms, the mesh and an optional material
+ * that replaces the materials of the mesh, so memory grows with the number
+ * of unique meshes instead of the number of instances. Rays find the
+ * instances through a tree over their world space bounds, which is built
+ * like the TopLevelBVH of a scene.
+ *
+ * Instances are placed in world space, the transform of the group itself
+ * is not used.
+ */
+class InstanceGroup : public Object
+{
+public:
+	struct Instance {
+		glm::mat4 world_to_object;
+		glm::mat4 object_to_world;
+		int mesh;
+		int material; /* index into materials, -1 for the mesh's materials */
+	};
+
+	/*
+	 * Add a mesh or an override material and return its index.
+	 */
+	int add_mesh(std::shared_ptr<BVH> mesh);
+	int add_material(std::shared_ptr<Material> material_);
+
+	/*
+	 * Add an instance of meshes[mesh]. build must be called before the
+	 * group is intersected.
+	 */
+	void add_instance(int mesh, glm::mat4 const& object_to_world, int material_ = -1);
+
+	/*
+	 * Rebuild the tree over the instances. Must be called again whenever
+	 * instances are added or moved.
+	 */
+	void build();
+
+	bool intersect(Ray const& ray, Intersection* isect) const override;
+	bool intersect_hit(Ray const& ray, HitRecord* hit) const override;
+	void fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const override;
+	bool occluded(Ray const& ray, float t_max) const override;
+
+	/*
+	 * The bounds of all instances.
+	 */
+	bool get_local_bounds(AABB* aabb) const override;
+
+	/*
+	 * Evaluate the material of the instance that was hit, or its override.
+	 */
+	void compute_shading_info(Intersection* isect) override;
+	void compute_shading_info(const Ray rays[4], Intersection* isect) override;
+
+	std::vector<std::shared_ptr<BVH>> meshes;
+	std::vector<std::shared_ptr<Material>> materials;
+	std::vector<Instance> instances;
+
+private:
+	/*
+	 * Intersect the ray with instances[idx] and keep the hit if it is nearer
+	 * than the current one, or as near and added earlier.
+	 */
+	void intersect_instance(int idx, Ray const& ray, HitRecord* hit, int &nearest) const;
+
+	std::vector<TopLevelBVH::Node> nodes;
+	std::vector<AABB> instance_bounds;
+	std::vector<int> leaf_instances;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cglib/rt/aabb.h>
 #include <cglib/rt/ray.h>
 #include <cglib/rt/intersection.h>
 #include <cglib/rt/intersection_tests.h>
@@ -8,6 +9,34 @@ class Intersectable
 {
 public:
     virtual bool intersect(Ray const& ray, Intersection* isect) const = 0;
+
+    /*
+     * Like intersect, but only compute the distance t of the hit, which
+     * must lie at ray.origin + t * ray.direction.
+     */
+    virtual bool intersect_distance(Ray const& ray, float* t) const
+    {
+        Intersection isect;
+        if (!intersect(ray, &isect))
+            return false;
+        *t = isect.t;
+        return true;
+    }
+
+    /*
+     * Fill in the intersection of the hit at distance t that
+     * intersect_distance found for the same ray, without intersecting
+     * again where the geometry allows it.
+     */
+    virtual void fill_intersection(Ray const& ray, float t, Intersection* isect) const
+    {
+        intersect(ray, isect);
+    }
+
+    /*
+     * Compute the bounds of this geometry. Returns false if it is unbounded.
+     */
+    virtual bool get_bounds(AABB* aabb) const { return false; }
 };
 
 class Sphere : public Intersectable
@@ -34,6 +63,26 @@ public:
         return false;
     }
 
+    bool intersect_distance(Ray const& ray, float* t) const
+    {
+        return intersect_sphere(ray.origin, ray.direction, center, radius, t);
+    }
+
+    void fill_intersection(Ray const& ray, float t, Intersection* isect) const
+    {
+        isect->t = t;
+        isect->position  = ray.origin + t * ray.direction;
+        isect->normal    = glm::normalize(isect->position - center);
+        isect->geometric_normal = isect->normal;
+    }
+
+    bool get_bounds(AABB* aabb) const
+    {
+        aabb->extend(center - glm::vec3(radius));
+        aabb->extend(center + glm::vec3(radius));
+        return true;
+    }
+
 private:
     const glm::vec3 center = glm::vec3(0.0f);
     const float radius;
@@ -63,6 +112,19 @@ public:
         return false;
     }
 
+    bool intersect_distance(Ray const& ray, float* t) const
+    {
+        return intersect_plane(ray.origin, ray.direction, center, normal, t);
+    }
+
+    void fill_intersection(Ray const& ray, float t, Intersection* isect) const
+    {
+        isect->t = t;
+        isect->position = ray.origin + t * ray.direction;
+        isect->geometric_normal = normal;
+        isect->normal = normal;
+    }
+
 protected:
     const glm::vec3 center = glm::vec3(0.0f);
     const glm::vec3 normal = glm::vec3(0.0f);
@@ -110,6 +172,32 @@ public:
         return false;
     }
 
+    bool intersect_distance(Ray const& ray, float* t) const
+    {
+        if (!intersect_plane(ray.origin, ray.direction, center, normal, t))
+            return false;
+        const glm::vec3 d = ray.origin + *t * ray.direction - p;
+        const float u = glm::dot(d, e0) / (len_e0_sq);
+        const float v = glm::dot(d, e1) / (len_e1_sq);
+        return !(u < 0.f || u > 1.f || v < 0.f || v > 1.f);
+    }
+
+    void fill_intersection(Ray const& ray, float t, Intersection* isect) const
+    {
+        Plane::fill_intersection(ray, t, isect);
+        const glm::vec3 d = isect->position - p;
+        isect->uv = glm::vec2(glm::dot(d, e0) / (len_e0_sq), glm::dot(d, e1) / (len_e1_sq));
+    }
+
+    bool get_bounds(AABB* aabb) const
+    {
+        aabb->extend(p);
+        aabb->extend(p + e0);
+        aabb->extend(p + e1);
+        aabb->extend(p + e0 + e1);
+        return true;
+    }
+
 private:
     const glm::vec3 e0 = glm::vec3(0.0f);
     const glm::vec3 e1 = glm::vec3(0.0f);
@@ -16,6 +16,7 @@ public:
         uv(0.f), 
         dudv(0.f),
         primitive_id(0),
+        instance_id(0),
         t(std::numeric_limits<float>::max())
     {}
 
@@ -34,5 +35,27 @@ public:
     glm::vec2 uv = glm::vec2(0.0f);                   // uv texture coordinates at the intersection point
     glm::vec2 dudv = glm::vec2(0.0f);                 // side lengths of the pixel footprint's AABB in uv space (for mipmap filter)
     uint32_t primitive_id;          // only used for triangle meshes
+    uint32_t instance_id;           // only used for instanced meshes
     float t;
 };
+
+/*
+ * The nearest hit found while tracing a ray, without any shading data.
+ * Candidate hits are compared and copied as hit records, the full
+ * Intersection is built from the record of the nearest hit only, with
+ * Object::fill_intersection.
+ */
+struct HitRecord
+{
+	float t = std::numeric_limits<float>::max();
+	uint32_t primitive_id = 0;
+	uint32_t instance_id = 0;
+	int object = -1;                 // index of the object in the TopLevelBVH
+	glm::vec2 bary = glm::vec2(0.f); // barycentric coordinates of vertices 1 and 2 for triangles
+	float t_local = 0.f;             // distance along the object space ray for analytic objects
+
+	glm::vec3 barycentrics() const
+	{
+		return glm::vec3(1.f - bary.x - bary.y, bary.x, bary.y);
+	}
+};
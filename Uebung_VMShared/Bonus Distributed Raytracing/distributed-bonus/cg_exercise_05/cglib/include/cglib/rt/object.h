@@ -20,6 +20,45 @@ public:
 
     virtual bool intersect(Ray const& ray, Intersection* isect) const;
 
+	/*
+	 * Find the nearest hit closer than hit->t and store it in hit. Used
+	 * while searching for the nearest object, only the object that wins
+	 * fills in the full intersection with fill_intersection. The default
+	 * intersects geo and leaves the rest to fill_intersection.
+	 */
+	virtual bool intersect_hit(Ray const& ray, HitRecord* hit) const;
+
+	/*
+	 * Overwrite isect with the intersection described by a hit found by
+	 * intersect_hit for the same ray.
+	 */
+	virtual void fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const;
+
+	/*
+	 * intersect_hit, fill_intersection and occluded for an object whose
+	 * geo is exactly of type Geometry, without virtual calls. TopLevelBVH
+	 * finds the type once in build and calls these from its traversal.
+	 */
+	template <class Geometry>
+	bool intersect_hit_as(Ray const& ray, HitRecord* hit) const;
+	template <class Geometry>
+	void fill_intersection_as(Ray const& ray, HitRecord const& hit, Intersection* isect) const;
+	template <class Geometry>
+	bool occluded_as(Ray const& ray, float t_max) const;
+
+	/*
+	 * Check whether the ray hits this object closer than t_max. Used for
+	 * shadow rays, where only the existence of a hit matters.
+	 */
+	virtual bool occluded(Ray const& ray, float t_max) const;
+
+	/*
+	 * Compute the bounds of this object in object space or in world space.
+	 * Returns false if the object is unbounded.
+	 */
+	virtual bool get_local_bounds(AABB* aabb) const;
+	bool get_world_bounds(AABB* aabb) const;
+
     virtual void compute_shading_info(Intersection* isect);
 
     virtual void compute_shading_info(const Ray rays[4], Intersection* isect);
@@ -48,8 +87,60 @@ public:
 	glm::mat4 transform_world_to_object        = glm::mat4(1.0f);
 	glm::mat4 transform_object_to_world_normal = glm::mat4(1.0f);
 	glm::mat4 transform_world_to_object_normal = glm::mat4(1.0f);
+
+private:
+	/*
+	 * Store the hit at distance t_local along ray_local in hit if it is
+	 * nearer than hit->t.
+	 */
+	bool record_hit(Ray const& ray, Ray const& ray_local, float t_local, HitRecord* hit) const;
+
+	/*
+	 * Move the intersection that geo filled in for hit from object space
+	 * to world space, in place.
+	 */
+	void local_to_world(HitRecord const& hit, Intersection* isect) const;
 };
 
+template <class Geometry>
+bool Object::
+intersect_hit_as(Ray const& ray, HitRecord* hit) const
+{
+	const Ray ray_local = transform_ray(ray, transform_world_to_object);
+	float t_local;
+	if (!static_cast<Geometry const&>(*geo).Geometry::intersect_distance(ray_local, &t_local))
+		return false;
+	return record_hit(ray, ray_local, t_local, hit);
+}
+
+template <class Geometry>
+void Object::
+fill_intersection_as(Ray const& ray, HitRecord const& hit, Intersection* isect) const
+{
+	const Ray ray_local = transform_ray(ray, transform_world_to_object);
+	*isect = Intersection();
+	static_cast<Geometry const&>(*geo).Geometry::fill_intersection(ray_local, hit.t_local, isect);
+	local_to_world(hit, isect);
+}
+
+template <class Geometry>
+bool Object::
+occluded_as(Ray const& ray, float t_max) const
+{
+	HitRecord hit;
+	hit.t = t_max;
+	return intersect_hit_as<Geometry>(ray, &hit);
+}
+
+/*
+ * The uvs at the given positions and the side lengths of the bounds in uv
+ * space of the texel footprint of the four rays, for the given texture
+ * mapping. Used by Object and by objects that shade several kinds of
+ * primitives.
+ */
+void get_intersection_uvs(TextureMapping const& mapping, glm::vec3 const positions[4], Intersection const& isect, glm::vec2 uvs[4]);
+glm::vec2 compute_uv_aabb_size(TextureMapping const& mapping, const Ray rays[4], Intersection const& isect);
+
 std::unique_ptr<Object> create_sphere(
 		glm::vec3 const& center,
 		float radius,
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cglib/rt/object.h>
+
+#include <memory>
+#include <vector>
+
+class TriangleSoup;
+
+/*
+ * A BVH over triangles, analytic spheres and quads.
+ *
+ * The primitives of every leaf are grouped by type, so a leaf is
+ * intersected with one loop per type and without virtual calls. This
+ * gives scenes with thousands of spheres, such as a sphere flake, the same
+ * logarithmic traversal as a triangle mesh.
+ *
+ * Primitives are placed in world space, the transform of the object itself
+ * is not used. After build, the primitives of every type are stored in the
+ * order of the leaves.
+ */
+class PrimitiveBVH : public Object
+{
+public:
+	enum PrimitiveType {
+		PRIMITIVE_TRIANGLE,
+		PRIMITIVE_SPHERE,
+		PRIMITIVE_QUAD,
+		PRIMITIVE_TYPE_COUNT
+	};
+
+	/*
+	 * The maximum number of primitives in a leaf and the number of bins
+	 * used to find the SAH split.
+	 */
+	enum { MAX_PRIMITIVES_IN_LEAF = 4 };
+	enum { NUM_BINS = 16 };
+
+	/*
+	 * The triangle with index triangle in soups[soup], with a copy of its
+	 * vertices for the intersection test.
+	 */
+	struct TrianglePrimitive {
+		glm::vec3 v0, v1, v2;
+		int soup;
+		int triangle;
+		int material;
+	};
+
+	/*
+	 * A sphere, textured like create_sphere.
+	 */
+	struct SpherePrimitive {
+		glm::vec3 center;
+		float radius;
+		glm::vec2 scale_uv;
+		int material;
+	};
+
+	/*
+	 * The parallelogram p + u * e0 + v * e1 with u, v in [0, 1], textured
+	 * like create_quad.
+	 */
+	struct QuadPrimitive {
+		glm::vec3 p, e0, e1, normal;
+		glm::vec2 scale_uv;
+		int material;
+	};
+
+	/*
+	 * A node of the tree, stored in depth-first order.
+	 * - offset  inner node: index of the right child, the left child is the
+	 *                       node right after it,
+	 *           leaf:       -1.
+	 * - first, count  leaves only: the range of the primitives of each type.
+	 */
+	struct Node {
+		AABB aabb;
+		int offset = -1;
+		int first[PRIMITIVE_TYPE_COUNT] = { 0, 0, 0 };
+		int count[PRIMITIVE_TYPE_COUNT] = { 0, 0, 0 };
+
+		bool is_leaf() const { return offset < 0; }
+	};
+
+	/*
+	 * Add a material and return its index.
+	 */
+	int add_material(std::shared_ptr<Material> material_);
+
+	/*
+	 * Add all triangles of soup with copies of its materials. The soup must
+	 * outlive this object.
+	 */
+	void add_triangles(TriangleSoup const& soup);
+
+	void add_sphere(glm::vec3 const& center, float radius, int material_,
+			glm::vec2 const& scale_uv = glm::vec2(1.f));
+	void add_quad(glm::vec3 const& center, glm::vec3 const& normal,
+			glm::vec3 const& e0, glm::vec3 const& e1, int material_,
+			glm::vec2 const& scale_uv = glm::vec2(1.f));
+
+	/*
+	 * Rebuild the tree with binned SAH. Must be called again whenever
+	 * primitives are added.
+	 */
+	void build();
+
+	bool intersect(Ray const& ray, Intersection* isect) const override;
+	bool intersect_hit(Ray const& ray, HitRecord* hit) const override;
+	void fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const override;
+	bool occluded(Ray const& ray, float t_max) const override;
+	bool get_local_bounds(AABB* aabb) const override;
+
+	/*
+	 * Compute the texture coordinates, the tangent space and the material
+	 * of the primitive that was hit.
+	 */
+	void compute_shading_info(Intersection* isect) override;
+	void compute_shading_info(const Ray rays[4], Intersection* isect) override;
+
+	std::vector<std::shared_ptr<Material>> materials;
+	std::vector<TrianglePrimitive> triangles;
+	std::vector<SpherePrimitive> spheres;
+	std::vector<QuadPrimitive> quads;
+	std::vector<Node> nodes;
+
+private:
+	struct Reference {
+		AABB aabb;
+		int type;
+		int index;
+	};
+
+	/*
+	 * The nearest primitive hit so far.
+	 */
+	struct Hit {
+		float t;
+		int type = -1;
+		int index;
+		glm::vec3 bary = glm::vec3(0.f);
+	};
+
+	/*
+	 * Build the subtree for refs[first, first + count) into nodes[node_idx]
+	 * at the given depth and append the primitives of its leaves, taken
+	 * from the src arrays, to triangles, spheres and quads. Like the
+	 * triangle BVH, it uses the SAH costs of BVH and stops at BVH::MAX_DEPTH.
+	 */
+	void build_node(std::vector<Reference> &refs, int node_idx, int first, int count, int depth,
+			std::vector<TrianglePrimitive> const& src_triangles,
+			std::vector<SpherePrimitive> const& src_spheres,
+			std::vector<QuadPrimitive> const& src_quads);
+
+	/*
+	 * Traverse the tree with TopLevelBVH::traverse. With any_hit set,
+	 * traversal stops at the first primitive closer than hit.t.
+	 */
+	template <bool any_hit>
+	bool traverse(Ray const& ray, Hit &hit) const;
+
+	template <bool any_hit>
+	bool intersect_leaf(Node const& n, Ray const& ray, Hit &hit) const;
+
+	/*
+	 * Decode primitive_id of an intersection into a type and an index.
+	 */
+	PrimitiveType get_primitive(uint32_t primitive_id, int *index) const;
+
+	/*
+	 * Shade the intersection. The texel footprint is computed only if the
+	 * four corner rays are given.
+	 */
+	void shade(Intersection* isect, const Ray *rays);
+
+	std::vector<TriangleSoup const*> soups;
+};
@@ -15,6 +15,24 @@ struct RaytracingContext
 
     RaytracingParameters params;
 
+	/*
+	 * BVH traversal work of the last frame that was rendered completely.
+	 */
+	BVHTraversalCounters traversal_counters;
+
+	/*
+	 * Number of progressive passes averaged in the displayed image.
+	 */
+	int accumulated_passes = 0;
+
+	/*
+	 * Size of the rendered image relative to the image size of params.
+	 * Below 1 for the previews of the frame time budget mode, which are
+	 * rendered at preview_scale.
+	 */
+	float render_scale  = 1.f;
+	float preview_scale = 1.f;
+
 	Scene *get_active_scene() const { return scenes[params.active_scene].get(); }
 	void add_scene(std::shared_ptr<Scene> scene);
 
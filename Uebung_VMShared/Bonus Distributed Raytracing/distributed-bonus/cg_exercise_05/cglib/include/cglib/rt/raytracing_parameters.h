@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cglib/rt/texture.h>
+#include <cglib/rt/bvh.h>
 #include <cglib/rt/epsilon.h>
 
 #include <cglib/core/parameters.h>
@@ -24,6 +25,8 @@ class RaytracingParameters : public Parameters
 
 		TextureFilterMode get_tex_filter_mode() const;
 		TextureWrapMode get_tex_wrap_mode() const;
+		BVHBuildMode get_bvh_build_mode() const;
+		BVHNodeWidth get_bvh_node_width() const;
 
 		enum RenderMode {
 			RECURSIVE,
@@ -34,6 +37,8 @@ class RaytracingParameters : public Parameters
 			DUDV,
 			BVH_TIME,
 			AABB_INTERSECT_COUNT,
+			SAMPLE_COUNT,
+			WAVEFRONT,
 			RENDER_MODE_COUNT
 		};
 
@@ -42,6 +47,45 @@ class RaytracingParameters : public Parameters
 			"du dv",
 			"BVH Traversal Time",
 			"AABB Intersection Count",
+			"Adaptive Samples",
+			"Wavefront",
+		};
+
+		/*
+		 * Trace the first hits of blocks of NxN pixels as ray packets.
+		 */
+		enum RayPacketMode {
+			PACKETS_OFF,
+			PACKETS_2X2,
+			PACKETS_4X4,
+			RAY_PACKET_MODE_COUNT
+		};
+
+		const char* ray_packet_mode_names[RAY_PACKET_MODE_COUNT] = {
+			"Off", "2x2", "4x4",
+		};
+
+		/*
+		 * Side length of the pixel blocks traced as one packet, 1 if ray
+		 * packets are disabled.
+		 */
+		int get_packet_block_size() const;
+
+		/*
+		 * The order and size of the render tiles.
+		 * - TILES_HILBERT  tiles along a Hilbert curve, up to 4x tile_size
+		 *                  at the start of a frame and down to tile_size/4
+		 *                  at its end,
+		 * - TILES_SPIRAL   tiles of tile_size in a spiral from the center.
+		 */
+		enum TileOrder {
+			TILES_HILBERT,
+			TILES_SPIRAL,
+			TILE_ORDER_COUNT
+		};
+
+		const char* tile_order_names[TILE_ORDER_COUNT] = {
+			"Hilbert Curve", "Spiral from Center",
 		};
 
 		int active_scene = 0;
@@ -68,8 +112,39 @@ class RaytracingParameters : public Parameters
 		bool transform_objects = true;
 		int spp = 1; // number of samples per pixel
 
+		/*
+		 * In interactive mode, keep adding passes of spp jittered samples
+		 * per pixel to the image while nothing changes, up to max_passes.
+		 */
+		bool progressive = false;
+		int max_passes   = 1024;
+
+		/*
+		 * Render every tile with spp samples per pixel on average: first
+		 * adaptive_min_spp jittered samples per pixel, then one sample at
+		 * a time for the pixel with the largest relative error, until the
+		 * budget is spent or all errors are below adaptive_error.
+		 */
+		bool adaptive_sampling = false;
+		int adaptive_min_spp   = 4;
+		float adaptive_error   = 0.01f;
+
+		/*
+		 * In interactive mode, render every change first as a preview at
+		 * the resolution for which it takes about frame_budget_ms, and
+		 * show it scaled up until the full image replaces it.
+		 */
+		bool frame_budget     = false;
+		float frame_budget_ms = 50.f;
+
 		int num_triangles = 5;
 
+		/*
+		 * Twist of the monkey in radians per unit of height. Changing it
+		 * deforms the mesh and refits its BVH.
+		 */
+		float monkey_twist = 0.f;
+
 		bool indirect        = false;
 		bool ao              = false;
 		bool dof             = false;
@@ -86,6 +161,12 @@ class RaytracingParameters : public Parameters
 		int tex_filter_mode = TextureFilterMode::TRILINEAR;
 		int tex_wrap_mode = TextureWrapMode::REPEAT;
 
+		int bvh_build_mode = BVHBuildMode::BVH_BUILD_SAH;
+		int bvh_node_width = BVHNodeWidth::BVH_BINARY;
+
+		int ray_packet_mode = PACKETS_OFF;
+		int tile_order      = TILES_HILBERT;
+
 
 	private:
 };
@@ -1,10 +1,52 @@
 #pragma once
 
 #include <cglib/rt/intersection.h>
+#include <cglib/rt/ray.h>
 #include <cglib/core/camera.h>
 
 struct ThreadLocalData;
 struct RaytracingContext;
+class Object;
+
+/*
+ * First hits of primary rays that were traced together as ray packets,
+ * see trace_primary_packet, in the order of the rays. trace_recursive
+ * takes the hit at RenderData::primary_hit instead of tracing the ray on
+ * its own.
+ *
+ * While the pixels of a block traced by trace_pixel_block are rendered,
+ * pixel is the index of the current pixel in the block, and the hits of
+ * the block are stored per camera, block_pixels apart.
+ */
+struct PrimaryHits
+{
+	enum { CAPACITY = 64 };
+
+	HitRecord hits[CAPACITY];
+	Object*   objects[CAPACITY]; /* nullptr if the ray hit nothing */
+	int       size = 0;
+
+	int block_pixels = 0;
+	int pixel        = -1;
+
+	void clear()
+	{
+		size         = 0;
+		block_pixels = 0;
+		pixel        = -1;
+	}
+
+	/*
+	 * Index of the hit of the center ray of the current pixel as seen by
+	 * the given camera, or -1 if it was not traced.
+	 */
+	int pixel_hit(Camera::Mode mode) const
+	{
+		if(pixel < 0)
+			return -1;
+		return mode == Camera::StereoRight ? pixel + block_pixels : pixel;
+	}
+};
 
 /*
  * Rendering data that will be passed to the raytracer for each pixel
@@ -25,4 +67,8 @@ struct RenderData
 	float x = 0.0f;	// x-Coordinate of (Sub-)Pixel
 	float y = 0.0f;	// y-Coordinate of (Sub-)Pixel
 	Camera::Mode camera_mode = Camera::Mono;
+
+	// Index of the first hit of the next primary ray in tld->primary_hits,
+	// or -1 if it was not traced as part of a packet. Reset once used.
+	int primary_hit = -1;
 };
@@ -36,6 +36,7 @@ float fresnel(glm::vec3 const& v, glm::vec3 const& n, float eta);
 
 /*
  * creates a ray starting from the camera position through the (sub-)pixel location (x,y)
+ * of the image rendered at context.render_scale
  */
 Ray createPrimaryRay(
 	RenderData &data,
@@ -71,6 +72,19 @@ bool shoot_ray(
 	const Ray corner_rays[4],
 	Intersection* isect);
 
+/*
+ * Trace the first hits of the given primary rays as ray packets and store
+ * them one after the other in data.tld->primary_hits. Returns the index of
+ * the hit of rays[0], so that the hit of rays[i] is used by trace_recursive
+ * once data.primary_hit is set to that index plus i. Returns -1 if ray
+ * packets are disabled. Rays that do not fit into the remaining capacity
+ * replace the older hits; rays beyond the capacity are not traced.
+ */
+int trace_primary_packet(
+	RenderData &data,
+	Ray const rays[],
+	int num_rays);
+
 /*
  *  Loops over all lights and evaluates a simple ambient lighting model
  *
@@ -166,6 +180,14 @@ glm::vec3 handle_transmissive_material(
 	glm::vec3 const& V,					// view vector (already normalized)
 	glm::vec3 const& eta_of_channel);	// relative refraction index of red, green and blue color channel
 
+/*
+ * The radiance of the environment map in direction dir (normalized), black
+ * if the scene has none.
+ */
+glm::vec3 env_map_lookup(
+	RenderData &data,
+	glm::vec3 const& dir);
+
 /*
  * Call this function to start recursive ray tracing through a lens
  */
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cglib/rt/texture.h>
+#include <cglib/rt/top_level_bvh.h>
 
 #include <vector>
 #include <memory>
@@ -8,6 +9,7 @@
 class Camera;
 class Light;
 class AreaLight;
+class BVH;
 class Object;
 class RaytracingParameters;
 class TriangleSoup;
@@ -35,6 +37,12 @@ public:
 	std::vector<std::shared_ptr<TriangleSoup>> soups;
 	std::vector<std::unique_ptr<Light>> area_lights;
 
+	/*
+	 * Acceleration structure over objects, rebuilt at the end of
+	 * init_scene and refresh_scene.
+	 */
+	TopLevelBVH tlas;
+
     virtual ~Scene();
 
 	virtual void init_scene(RaytracingParameters const& params) {} 
@@ -43,6 +51,19 @@ public:
 	virtual void set_active_camera();
 
 	virtual const char *get_name() { return "unknown"; }
+
+	/*
+	 * The BVHs of the meshes in objects, including the meshes shared by the
+	 * instances of an InstanceGroup.
+	 */
+	std::vector<BVH*> get_bvhs() const;
+
+protected:
+	/*
+	 * Rebuild every BVH of get_bvhs whose build mode differs from params,
+	 * and collapse those whose node width differs.
+	 */
+	void update_bvhs(RaytracingParameters const& params);
 };
 
 
@@ -111,6 +132,17 @@ public:
 	void init_scene(RaytracingParameters const& params);
     void refresh_scene(RaytracingParameters const& params);
 	void init_camera(RaytracingParameters& params);
+
+private:
+	/*
+	 * Twist the monkey about its vertical axis by twist_ radians per unit
+	 * of height, refitting its BVH instead of rebuilding it while the tree
+	 * stays good enough.
+	 */
+	void twist_monkey(float twist_);
+
+	std::vector<glm::vec3> rest_vertices, rest_normals;
+	float twist = 0.f;
 };
 
 class SponzaScene : public Scene
@@ -137,3 +169,31 @@ public:
 	void init_camera(RaytracingParameters& params);
 };
 
+/*
+ * A field of monkeys that all share the BVH of one mesh.
+ */
+class InstancingScene : public Scene
+{
+public:
+	SCENE_NAME(Instances)
+	InstancingScene(RaytracingParameters& params);
+
+	void init_scene(RaytracingParameters const& params);
+	void refresh_scene(RaytracingParameters const& params);
+	void init_camera(RaytracingParameters& params);
+};
+
+/*
+ * A sphere flake next to a monkey, in one BVH over spheres, quads and
+ * triangles.
+ */
+class SphereFlakeScene : public Scene
+{
+public:
+	SCENE_NAME(SphereFlake)
+	SphereFlakeScene(RaytracingParameters& params);
+
+	void init_scene(RaytracingParameters const& params);
+	void refresh_scene(RaytracingParameters const& params);
+	void init_camera(RaytracingParameters& params);
+};
@@ -36,17 +36,37 @@ class Texture
 public:
 	virtual ~Texture() {}
 	virtual glm::vec4 evaluate(glm::vec2 const& uv, glm::vec2 const& dudv = glm::vec2(0.f)) const = 0;
+
+	/*
+	 * The same as evaluate, but constant and image textures are evaluated
+	 * without a virtual call. Used for the materials of every hit.
+	 */
+	glm::vec4 lookup(glm::vec2 const& uv, glm::vec2 const& dudv) const;
+
+protected:
+	enum Kind {
+		TEXTURE_CONST,
+		TEXTURE_IMAGE,
+		TEXTURE_OTHER
+	};
+
+	explicit Texture(Kind kind_ = TEXTURE_OTHER) :
+		kind(kind_)
+	{}
+
+private:
+	Kind kind;
 };
 
 class ConstTexture : public Texture
 {
 public:
     ConstTexture(glm::vec3 const& value_) :
-        Texture(),
+        Texture(TEXTURE_CONST),
         value(value_)
     {}
 
-	glm::vec4 evaluate(glm::vec2 const& /*uv*/, glm::vec2 const& /*dudv*/) const override
+	glm::vec4 evaluate(glm::vec2 const& /*uv*/, glm::vec2 const& /*dudv*/) const final
     {
         return glm::vec4(value, 0.0f);
     }
@@ -68,7 +88,7 @@ public:
         TextureFilterMode filter_mode,
         TextureWrapMode wrap_mode);
 
-	glm::vec4 evaluate(glm::vec2 const& uv, glm::vec2 const& dudv) const override;
+	glm::vec4 evaluate(glm::vec2 const& uv, glm::vec2 const& dudv) const final;
     glm::vec4 evaluate_nearest(int level, glm::vec2 const& uv) const;
     glm::vec4 evaluate_bilinear(int level, glm::vec2 const& uv) const;
     glm::vec4 evaluate_trilinear(glm::vec2 const& uv, glm::vec2 const& dudv) const;
@@ -90,5 +110,18 @@ private:
 	std::vector<std::shared_ptr<Image>> mip_levels; // the different mip map textures
 };
 
+inline glm::vec4 Texture::
+lookup(glm::vec2 const& uv, glm::vec2 const& dudv) const
+{
+	switch (kind) {
+	case TEXTURE_CONST:
+		return static_cast<ConstTexture const*>(this)->ConstTexture::evaluate(uv, dudv);
+	case TEXTURE_IMAGE:
+		return static_cast<ImageTexture const*>(this)->ImageTexture::evaluate(uv, dudv);
+	default:
+		return evaluate(uv, dudv);
+	}
+}
+
 typedef std::unordered_map<std::string, std::shared_ptr<ImageTexture>> TextureContainer;
 
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <cglib/rt/aabb.h>
+
+#include <cglib/core/assert.h>
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+class Object;
+class BVH;
+class Ray;
+class Intersection;
+struct HitRecord;
+
+/*
+ * A BVH over the world space bounds of the objects of a scene.
+ *
+ * Rays only visit the objects whose bounds they cross. Objects without
+ * bounds, such as infinite planes, are kept in a separate list and tested
+ * by every ray. The results are the same as testing all objects in their
+ * order in the scene: if two objects are hit at the same distance, the
+ * one that comes first in the scene wins.
+ */
+class TopLevelBVH
+{
+public:
+	/*
+	 * The maximum number of objects in a leaf.
+	 */
+	enum { MAX_OBJECTS_IN_LEAF = 2 };
+
+	/*
+	 * The size of the node stack used during traversal.
+	 */
+	enum { TRAVERSAL_STACK_SIZE = 64 };
+
+	/*
+	 * A node of the tree, stored in depth-first order like BVH::FlatNode.
+	 * - offset       inner node: index of the right child, the left child
+	 *                            is the node right after it,
+	 *                leaf:       index of the first entry in leaf_objects.
+	 * - num_objects  0 for inner nodes.
+	 */
+	struct Node {
+		AABB aabb;
+		int offset      = -1;
+		int num_objects = 0;
+
+		bool is_leaf() const { return num_objects > 0; }
+	};
+
+	/*
+	 * Throw away the current tree and build it for the given objects. Must
+	 * be called again whenever objects are added, removed or transformed.
+	 *
+	 * This also compiles the scene for traversal: the concrete type of
+	 * every object, and of the geometry of plain objects, is looked up
+	 * once here, so that rays call the intersection routines of the known
+	 * types directly instead of through virtual functions.
+	 */
+	void build(std::vector<std::unique_ptr<Object>> const& objects);
+
+	/*
+	 * Find the nearest object hit closer than hit->t and update hit,
+	 * including hit->object, if there is one.
+	 */
+	bool intersect(Ray const& ray, HitRecord* hit) const;
+
+	/*
+	 * Like intersect, but fill in the full intersection of the nearest hit
+	 * and set *object.
+	 */
+	bool intersect(Ray const& ray, Intersection* isect, Object** object) const;
+
+	/*
+	 * Check whether any object is hit closer than t_max.
+	 */
+	bool occluded(Ray const& ray, float t_max) const;
+
+	/*
+	 * Like intersect, for num_rays rays at once. Meshes are intersected
+	 * with BVH::intersect_packet.
+	 */
+	void intersect_packet(Ray const rays[], int num_rays, HitRecord hits[]) const;
+
+	/*
+	 * The object of a hit, nullptr if nothing was hit.
+	 */
+	Object* get_object(HitRecord const& hit) const;
+
+	/*
+	 * Build the full intersection for a hit found by intersect.
+	 */
+	void fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const;
+
+	/*
+	 * The objects that are triangle meshes, in the order of the scene.
+	 */
+	std::vector<BVH*> const& get_meshes() const { return meshes; }
+
+	/*
+	 * The number of objects the tree was built for.
+	 */
+	int num_objects() const { return int(scene_objects.size()); }
+
+	/*
+	 * Build a tree over the given bounds into out. leaf_items holds
+	 * indices into bounds and is reordered so that every leaf refers to a
+	 * range of it. Also used for the instances of an InstanceGroup.
+	 */
+	static void build_tree(std::vector<AABB> const& bounds, std::vector<int> &leaf_items,
+			std::vector<Node> &out);
+
+	/*
+	 * Call visit_leaf(node) for the leaves of tree whose bounds the ray
+	 * enters closer than t_max, the nearer child first. tree is stored in
+	 * depth-first order like Node, which TreeNode must resemble in aabb,
+	 * offset and is_leaf(). t_max is read again for every node, so it may
+	 * be the distance of the nearest hit, which visit_leaf lowers. Returns
+	 * true as soon as visit_leaf does. div is 1 / ray.direction. Every
+	 * node visited is counted in nodes_visited, if given. Also used by
+	 * InstanceGroup and PrimitiveBVH.
+	 */
+	template <class TreeNode, class VisitLeaf>
+	static bool traverse(std::vector<TreeNode> const& tree, Ray const& ray, glm::vec3 const& div,
+			float const& t_max, VisitLeaf const& visit_leaf, uint64_t* nodes_visited = nullptr);
+
+private:
+	/*
+	 * The types that traversal dispatches on. Plain objects are told apart
+	 * by the type of their geometry, everything else is called through
+	 * its virtual functions.
+	 */
+	enum ObjectKind {
+		OBJECT_MESH,
+		OBJECT_INSTANCE_GROUP,
+		OBJECT_PRIMITIVE_BVH,
+		OBJECT_SPHERE,
+		OBJECT_PLANE,
+		OBJECT_QUAD,
+		OBJECT_OTHER
+	};
+
+	static ObjectKind get_kind(Object const& object);
+
+	/*
+	 * Intersect scene_objects[idx] according to its kind.
+	 */
+	bool intersect_hit(int idx, Ray const& ray, HitRecord* hit) const;
+	bool occluded(int idx, Ray const& ray, float t_max) const;
+
+	/*
+	 * Check whether any object is hit closer than t_max, like occluded but
+	 * without counting the ray.
+	 */
+	bool find_occluder(Ray const& ray, float t_max) const;
+
+	/*
+	 * Build the subtree for leaf_items[first, first + count) into
+	 * out[node_idx].
+	 */
+	static void build_node(std::vector<AABB> const& bounds, std::vector<int> &leaf_items,
+			std::vector<Node> &out, int node_idx, int first, int count);
+
+	/*
+	 * Intersect the ray with scene_objects[idx] and keep the hit if it is
+	 * nearer than the current one, or as near and earlier in the scene.
+	 */
+	void intersect_object(int idx, Ray const& ray, HitRecord* hit) const;
+
+	/*
+	 * Keep candidate, a hit with scene_objects[idx], under the same rule.
+	 */
+	static void keep_nearer(int idx, HitRecord const& candidate, HitRecord* hit);
+
+	std::vector<Node> nodes;
+
+	/*
+	 * The objects in the order of the scene, their world space bounds, and
+	 * the indices of the bounded objects in the order of the leaves.
+	 */
+	std::vector<Object*> scene_objects;
+	std::vector<ObjectKind> object_kinds;
+	std::vector<AABB> object_bounds;
+	std::vector<int> leaf_objects;
+	std::vector<BVH*> meshes;
+
+	/*
+	 * Indices of the objects without bounds.
+	 */
+	std::vector<int> unbounded_objects;
+};
+
+template <class TreeNode, class VisitLeaf>
+bool TopLevelBVH::
+traverse(std::vector<TreeNode> const& tree, Ray const& ray, glm::vec3 const& div,
+		float const& t_max, VisitLeaf const& visit_leaf, uint64_t* nodes_visited)
+{
+	if (tree.empty())
+		return false;
+
+	int stack[TRAVERSAL_STACK_SIZE];
+	int stack_size = 0;
+
+	float t_min = 0.0f;
+	float t_max_root = t_max;
+	if (tree[0].aabb.intersect(ray, t_min, t_max_root, div))
+		stack[stack_size++] = 0;
+
+	while (stack_size > 0) {
+		int const idx = stack[--stack_size];
+		TreeNode const& n = tree[idx];
+		if (nodes_visited)
+			(*nodes_visited)++;
+		if (n.is_leaf()) {
+			if (visit_leaf(n))
+				return true;
+			continue;
+		}
+
+		int const left  = idx + 1;
+		int const right = n.offset;
+		float t_min_l = 0.0f, t_max_l = t_max;
+		float t_min_r = 0.0f, t_max_r = t_max;
+		bool const il = tree[left ].aabb.intersect(ray, t_min_l, t_max_l, div);
+		bool const ir = tree[right].aabb.intersect(ray, t_min_r, t_max_r, div);
+		if (il && ir) { /* visit the nearer child first */
+			stack[stack_size++] = t_min_l < t_min_r ? right : left;
+			stack[stack_size++] = t_min_l < t_min_r ? left : right;
+		}
+		else if (il || ir) {
+			stack[stack_size++] = il ? left : right;
+		}
+		cg_assert(stack_size <= TRAVERSAL_STACK_SIZE);
+	}
+	return false;
+}
@@ -7,18 +7,32 @@
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <string>
 
 class Material;
 class Intersection;
 class ImageTexture;
+class Ray;
 
 class TriangleSoup
 {
 public:
+	/*
+	 * The properties of a material as read from an MTL file. Texture paths
+	 * are empty if the material has no texture map.
+	 */
+	struct MaterialInfo {
+		std::string map_kd, map_ks;
+		glm::vec3 diffuse  = glm::vec3(0.0f);
+		glm::vec3 specular = glm::vec3(0.0f);
+		float shininess    = 0.0f;
+	};
+
 	std::vector<glm::vec3> vertices, normals;
 	std::vector<glm::vec2> tex_coordinates;
     std::vector<int> material_ids;
     std::vector<Material> materials;
+	std::vector<MaterialInfo> material_infos; /* empty if not loaded from an OBJ file */
 	int num_triangles = 0;
 
 	TriangleSoup();
@@ -31,6 +45,18 @@ public:
 
 	TriangleSoup(const std::string &obj_path, TextureContainer *textures);
 
+	/*
+	 * Replace materials by materials created from material_infos, loading
+	 * their textures into textures if it is given.
+	 */
+	void create_materials(TextureContainer *textures);
+
     void fill_intersection(Intersection* isect, int triangle_id, float min_dist, glm::vec3 const& bary) const;
+
+	/*
+	 * The side lengths of the bounds of the uvs where the four rays cross
+	 * the plane of the given triangle.
+	 */
+	glm::vec2 compute_uv_footprint(const Ray rays[4], int triangle_id) const;
 };
 
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+class RaytracingParameters;
+struct RaytracingContext;
+struct ThreadLocalData;
+
+/*
+ * A wavefront version of the recursive ray tracer.
+ *
+ * Instead of following one ray at a time through trace_recursive, a tile
+ * is rendered one generation of rays at a time: all rays of a generation
+ * are intersected, their hits are sorted by object and shaded in that
+ * order, and shading emits the reflection and transmission rays of the
+ * next generation. Every ray carries the weight with which its radiance
+ * adds to its pixel. Shading matches trace_recursive, and direct
+ * illumination is computed by evaluate_illumination, so the images agree
+ * with the recursive mode up to rounding and random samples.
+ */
+class WavefrontRender
+{
+	public:
+		/*
+		 * Depth of field and stereo rendering start in the pixel kernel,
+		 * which has no wavefront version. With them, the pixels are
+		 * rendered recursively.
+		 */
+		static bool supports(RaytracingParameters const& params);
+
+		/*
+		 * Receives the final color of pixel (x, y).
+		 */
+		typedef std::function<void(int, int, glm::vec3 const&)> PixelStore;
+
+		/*
+		 * Render the pixels [x0, x1) x [y0, y1) and pass their colors to
+		 * store. Returns false if rendering was terminated.
+		 */
+		static bool render_tile(RaytracingContext const& context, ThreadLocalData* tld,
+			int x0, int y0, int x1, int y1, PixelStore const& store, std::atomic<bool> const& terminate);
+
+	private:
+		/*
+		 * The rays of one generation, in structure of arrays layout.
+		 * - weights  factor of the radiance along the ray in its pixel,
+		 * - samples  image position of the pixel sample the ray belongs to,
+		 * - pixels   index of that pixel in the tile.
+		 */
+		struct RayQueue
+		{
+			std::vector<glm::vec3> origins;
+			std::vector<glm::vec3> directions;
+			std::vector<glm::vec3> weights;
+			std::vector<glm::vec2> samples;
+			std::vector<int>       pixels;
+
+			int size() const { return int(pixels.size()); }
+			void clear();
+			void push(glm::vec3 const& origin, glm::vec3 const& direction,
+					glm::vec3 const& weight, glm::vec2 const& sample, int pixel);
+		};
+
+		/*
+		 * Queue the ray from P in direction dir for the generation after
+		 * depth, unless that is deeper than max_depth or weight is zero.
+		 * Like evaluate_reflection, the ray starts ray_epsilon away from P.
+		 */
+		static void spawn(RayQueue* next, RaytracingParameters const& params, int depth,
+				glm::vec3 const& P, glm::vec3 const& dir, glm::vec3 const& weight,
+				glm::vec2 const& sample, int pixel);
+
+		/*
+		 * Queue the rays of handle_transmissive_material_single_ior.
+		 */
+		static void spawn_transmission(RayQueue* next, RaytracingParameters const& params, int depth,
+				glm::vec3 const& P, glm::vec3 const& N, glm::vec3 const& V, float eta,
+				glm::vec3 const& weight, glm::vec2 const& sample, int pixel);
+};
@@ -1,12 +1,14 @@
 #include <cglib/core/thread_pool.h>
-#include <cglib/core/timer.h>
 
 #include <cglib/core/assert.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <sstream>
 
 ThreadPool::ThreadPool(unsigned max_threads) :
-	m_numJobs(0), m_hasException(false)
+	m_numJobs(0), m_jobsDone(0), m_jobsLeft(0), m_hasException(false),
+	m_generation(0), m_numWorking(0), m_shutdown(false)
 {
 	using std::cout;
 	using std::endl;
@@ -15,11 +17,22 @@ ThreadPool::ThreadPool(unsigned max_threads) :
 	{
 		max_threads = std::thread::hardware_concurrency();
 	}
+	max_threads = std::max(max_threads, 1u);
 
 	cout << "[ThreadPool] " << "Using " << max_threads << " worker threads" << endl;
 	m_threads.resize(max_threads);
+	m_queues.resize(max_threads);
 	m_tld.resize(max_threads);
 	m_terminate.store(true);
+
+	for (int i = 0; i < static_cast<int>(max_threads); ++i)
+	{
+		m_queues[i].reset(new WorkQueue());
+	}
+	for (int i = 0; i < static_cast<int>(max_threads); ++i)
+	{
+		m_threads[i].reset(new std::thread(&ThreadPool::worker, this, i));
+	}
 }
 
 // -----------------------------------------------------------------------------
@@ -27,6 +40,18 @@ ThreadPool::ThreadPool(unsigned max_threads) :
 ThreadPool::~ThreadPool()
 {
 	terminate();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shutdown = true;
+	}
+	m_wake.notify_all();
+	for (auto& t : m_threads)
+	{
+		if (t && t->joinable())
+		{
+			t->join();
+		}
+	}
 }
 
 // -----------------------------------------------------------------------------
@@ -40,81 +65,190 @@ void ThreadPool::run_internal(
 	cg_assert(num_jobs >= 0);
 	terminate();
 
-	// Set up data for jobs.
-	m_currentJob.store(0);
-	m_kernel = kernel;
-	m_numJobs.store(num_jobs);
-	m_jobsDone.store(0);
-	m_terminate.store(false);
-	m_hasException.store(false);
-	m_exceptionMsg.clear();
+	{
+		// Workers only start on jobs while holding m_mutex, so none of
+		// them can see the queues half filled.
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_idle.wait(lock, [&] { return m_numWorking == 0; });
 
-	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+		// Set up data for jobs.
+		m_kernel = kernel;
+		m_numJobs.store(num_jobs);
+		m_jobsDone.store(0);
+		m_jobsLeft.store(num_jobs);
+		m_hasException.store(false);
+		m_exceptionMsg.clear();
+
+		for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+		{
+			tldAlloc(i, m_tld[i]);
+		}
+
+		// Deal the jobs round robin, so that every worker takes them in
+		// about the order in which they were given.
+		int const num_queues = static_cast<int>(m_queues.size());
+		for (int jobId = 0; jobId < num_jobs; ++jobId)
+		{
+			m_queues[jobId % num_queues]->jobs.push_back(jobId);
+		}
+
+		m_terminate.store(false);
+		++m_generation;
+	}
+	m_wake.notify_all();
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::worker(int threadId)
+{
+	unsigned generation = 0;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
 	{
-		tldAlloc(i, m_tld[i]);
+		m_wake.wait(lock, [&] { return m_shutdown || m_generation != generation; });
+		if (m_shutdown)
+		{
+			return;
+		}
+		generation = m_generation;
+		++m_numWorking;
+		lock.unlock();
+
+		int jobId;
+		while (pop_job(threadId, &jobId))
+		{
+			run_job(threadId, jobId);
+			finish_jobs(1);
+		}
+
+		lock.lock();
+		if (--m_numWorking == 0)
+		{
+			m_idle.notify_all();
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+bool ThreadPool::pop_job(int threadId, int* jobId)
+{
+	if (m_terminate.load())
+	{
+		return false;
+	}
+
+	int const num_queues = static_cast<int>(m_queues.size());
+	{
+		WorkQueue& own = *m_queues[threadId];
+		std::lock_guard<std::mutex> guard(own.mutex);
+		if (!own.jobs.empty())
+		{
+			*jobId = own.jobs.front();
+			own.jobs.pop_front();
+			return true;
+		}
 	}
 
-	auto thread_func = [&](int threadId) 
+	for (int i = 1; i < num_queues; ++i)
 	{
-		while (true)
+		WorkQueue& victim = *m_queues[(threadId + i) % num_queues];
+		std::lock_guard<std::mutex> guard(victim.mutex);
+		if (!victim.jobs.empty())
 		{
-			int const jobId = m_currentJob++;
-			if (jobId >= m_numJobs.load())
-			{
-				return;
-			}
-
-			try 
-			{
-				m_kernel(jobId, m_tld[threadId].get(), m_terminate);
-			} catch (std::exception const& e)
-			{
-				std::lock_guard<std::mutex> guard(m_exceptionMutex);
-				m_hasException.store(true);
-				std::ostringstream os;
-				os << "Thread " << std::this_thread::get_id() << ": " << e.what();
-				m_exceptionMsg.push_back(os.str());
-				m_numJobs.store(0);
-				m_terminate.store(true);
-			} catch(...)
-			{
-				std::lock_guard<std::mutex> guard(m_exceptionMutex);
-				m_hasException.store(true);
-				std::ostringstream os;
-				os << "Thread " << std::this_thread::get_id() << ": " << "unknown exception caught";
-				m_exceptionMsg.push_back(os.str());
-				m_numJobs.store(0);
-				m_terminate.store(true);
-			}
-			m_jobsDone++;
-			std::this_thread::yield();
+			*jobId = victim.jobs.back();
+			victim.jobs.pop_back();
+			return true;
 		}
+	}
+	return false;
+}
 
-		m_tld[threadId].reset();
-	};
+// -----------------------------------------------------------------------------
 
-	// Launch threads.
-	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+void ThreadPool::run_job(int threadId, int jobId)
+{
+	try 
+	{
+		m_kernel(jobId, m_tld[threadId].get(), m_terminate);
+	} catch (std::exception const& e)
+	{
+		std::lock_guard<std::mutex> guard(m_exceptionMutex);
+		m_hasException.store(true);
+		std::ostringstream os;
+		os << "Thread " << std::this_thread::get_id() << ": " << e.what();
+		m_exceptionMsg.push_back(os.str());
+		m_numJobs.store(0);
+		m_terminate.store(true);
+	} catch(...)
+	{
+		std::lock_guard<std::mutex> guard(m_exceptionMutex);
+		m_hasException.store(true);
+		std::ostringstream os;
+		os << "Thread " << std::this_thread::get_id() << ": " << "unknown exception caught";
+		m_exceptionMsg.push_back(os.str());
+		m_numJobs.store(0);
+		m_terminate.store(true);
+	}
+	m_jobsDone++;
+
+	if (m_terminate.load())
 	{
-		m_threads[i].reset(new std::thread(thread_func, i));
+		drop_jobs();
 	}
 }
 
 // -----------------------------------------------------------------------------
 
+void ThreadPool::finish_jobs(int count)
+{
+	if (count > 0 && (m_jobsLeft -= count) == 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_idle.notify_all();
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::drop_jobs()
+{
+	for (auto& queue : m_queues)
+	{
+		int dropped;
+		{
+			std::lock_guard<std::mutex> guard(queue->mutex);
+			dropped = static_cast<int>(queue->jobs.size());
+			queue->jobs.clear();
+		}
+		finish_jobs(dropped);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_idle.wait(lock, [&] { return m_jobsLeft.load() == 0; });
+}
+
+// -----------------------------------------------------------------------------
+
 void ThreadPool::terminate() 
 {
 	m_numJobs.store(0);
 	m_terminate.store(true);
-	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+	drop_jobs();
+
+	// Running jobs see m_terminate and return early. The workers are
+	// not joined, they go back to sleep.
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_idle.wait(lock, [&] { return m_numWorking == 0; });
+	for (auto& tld : m_tld)
 	{
-		auto& t = m_threads[i];
-		if (t && t->joinable())
-		{
-			t->join();
-		}
-		t.reset();
-		m_tld[i].reset();
+		tld.reset();
 	}
 }
 
@@ -136,6 +270,7 @@ void ThreadPool::force_kill()
 		{
 			int const result = pthread_kill(t->native_handle(), SIGTERM);
 			cg_assert((result == 0) && bool("Cannot kill thread."));
+			t->detach();
 		}
 		t.reset();
 		m_tld[i].reset();
@@ -153,25 +288,15 @@ void ThreadPool::force_kill()
 
 bool ThreadPool::kill_at_timeout(int timeout)
 {
-    Timer timer;
-    timer.start();
-	bool terminated = false;
-
-	while (timer.getElapsedTimeInSec() < timeout)
 	{
-		if (jobs_done() >= num_jobs())
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_idle.wait_for(lock, std::chrono::seconds(timeout),
+				[&] { return m_jobsLeft.load() == 0; }))
 		{
-			terminated = true;
-			break;
+			return false;
 		}
-		std::this_thread::yield();
 	}
 
-	if (!terminated)
-	{
-		force_kill();
-		return true;
-	}
-
-	return false;
+	force_kill();
+	return true;
 }
@@ -4,119 +4,1549 @@
 #include <cglib/rt/intersection.h>
 #include <cglib/rt/triangle_soup.h>
 #include <cglib/rt/interpolate.h>
+#include <cglib/rt/raytracing_context.h>
 
 #include <cglib/core/camera.h>
+#include <cglib/core/thread_pool.h>
+#include <cglib/core/timer.h>
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include <immintrin.h>
+
+const char* bvh_build_mode_names[BVH_BUILD_MODE_COUNT] = {
+	"Binned SAH",
+	"Object Median",
+	"Spatial Split SAH",
+	"Linear (Morton)"
+};
+
+const char* bvh_node_width_names[BVH_NODE_WIDTH_COUNT] = {
+	"Binary",
+	"4-wide",
+	"8-wide",
+	"4-wide, 8-bit bounds",
+	"8-wide, 8-bit bounds"
+};
+
+const float BVH::SAH_TRAVERSAL_COST    = 1.0f;
+const float BVH::SAH_INTERSECTION_COST = 1.0f;
+
+const float BVH::SBVH_OVERLAP_THRESHOLD = 1e-5f;
+const float BVH::SBVH_MAX_DUPLICATION   = 0.5f;
+
+static int
+num_chunks(int n)
+{
+	return std::max(1, (n + BVH::PARALLEL_BUILD_CHUNK - 1) / BVH::PARALLEL_BUILD_CHUNK);
+}
+
+/*
+ * Call func(chunk, begin, end) for consecutive chunks of [0, n). The chunks
+ * are processed by the threads of thread_pool if it is given, and in order
+ * on the calling thread otherwise.
+ */
+template <class Func>
+static void
+for_each_chunk(ThreadPool *thread_pool, int n, Func const& func)
+{
+	int const chunks = num_chunks(n);
+	if(!thread_pool || chunks == 1) {
+		for(int c = 0; c < chunks; c++)
+			func(c, c * BVH::PARALLEL_BUILD_CHUNK, std::min(n, (c + 1) * BVH::PARALLEL_BUILD_CHUNK));
+		return;
+	}
+
+	thread_pool->run(chunks, [&](int c, ThreadLocalData*, std::atomic<bool>&) {
+			func(c, c * BVH::PARALLEL_BUILD_CHUNK, std::min(n, (c + 1) * BVH::PARALLEL_BUILD_CHUNK));
+		});
+	thread_pool->wait();
+	thread_pool->poll_exceptions();
+}
+
+/*
+ * A median split halves the items, so a subtree that is split by the
+ * builders' heuristics as long as this is false never exceeds MAX_DEPTH.
+ */
+bool BVH::
+near_depth_limit(int depth, int count, int max_in_leaf)
+{
+	int levels = 0;
+	for(int n = count; n > max_in_leaf; n = (n + 1) / 2)
+		levels++;
+	return depth + levels >= MAX_DEPTH;
+}
+
+/*
+ * Accumulate [0, n) into value, where func(v, begin, end) adds a range to v
+ * and merge(v, w) adds w to v. With a thread pool, every chunk is
+ * accumulated into a copy of value and the copies are merged in order;
+ * otherwise the whole range is added to value at once, which needs no
+ * scratch memory.
+ */
+template <class T, class Func, class Merge>
+static void
+reduce_chunks(ThreadPool *thread_pool, int n, T &value, Func const& func, Merge const& merge)
+{
+	int const chunks = num_chunks(n);
+	if(!thread_pool || chunks == 1) {
+		func(value, 0, n);
+		return;
+	}
+
+	std::vector<T> chunk_values(chunks, value);
+	for_each_chunk(thread_pool, n, [&](int c, int begin, int end) {
+			func(chunk_values[c], begin, end);
+		});
+	for(auto const& v: chunk_values)
+		merge(value, v);
+}
+
+static void
+merge_aabb(AABB &a, AABB const& b)
+{
+	a.extend(b);
+}
+
+/*
+ * Spread the lower 10 bits of x so that there are two zero bits between
+ * each of them.
+ */
+static uint32_t
+expand_bits(uint32_t x)
+{
+	x = (x | (x << 16)) & 0x030000ffu;
+	x = (x | (x <<  8)) & 0x0300f00fu;
+	x = (x | (x <<  4)) & 0x030c30c3u;
+	x = (x | (x <<  2)) & 0x09249249u;
+	return x;
+}
+
+/*
+ * 30 bit Morton code of a point in the unit cube.
+ */
+static uint32_t
+morton_code(glm::vec3 const& p)
+{
+	glm::uvec3 const q = glm::uvec3(glm::clamp(p * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f)));
+	return (expand_bits(q.x) << 2) | (expand_bits(q.y) << 1) | expand_bits(q.z);
+}
+
+/*
+ * Sort keys and values by the lower 32 bits of the keys with a stable least
+ * significant digit radix sort, one byte per pass. Every pass counts the
+ * digits of each chunk and then scatters the chunks independently.
+ */
+static void
+radix_sort(ThreadPool *thread_pool, std::vector<uint32_t> &keys, std::vector<int> &values)
+{
+	enum { RADIX_BITS = 8, RADIX = 1 << RADIX_BITS };
+
+	int const n = static_cast<int>(keys.size());
+	int const chunks = num_chunks(n);
+	std::vector<uint32_t> keys_tmp(n);
+	std::vector<int> values_tmp(n);
+	std::vector<int> offsets(chunks * RADIX);
+	for(int shift = 0; shift < 32; shift += RADIX_BITS) {
+		std::fill(offsets.begin(), offsets.end(), 0);
+		for_each_chunk(thread_pool, n, [&](int c, int begin, int end) {
+				for(int i = begin; i < end; i++)
+					offsets[c * RADIX + ((keys[i] >> shift) & (RADIX - 1))]++;
+			});
+
+		/* exclusive prefix sum in the order digit, chunk */
+		int sum = 0;
+		for(int d = 0; d < RADIX; d++) {
+			for(int c = 0; c < chunks; c++) {
+				int const count = offsets[c * RADIX + d];
+				offsets[c * RADIX + d] = sum;
+				sum += count;
+			}
+		}
+
+		for_each_chunk(thread_pool, n, [&](int c, int begin, int end) {
+				int *offset = &offsets[c * RADIX];
+				for(int i = begin; i < end; i++) {
+					int const j = offset[(keys[i] >> shift) & (RADIX - 1)]++;
+					keys_tmp[j]   = keys[i];
+					values_tmp[j] = values[i];
+				}
+			});
+		keys.swap(keys_tmp);
+		values.swap(values_tmp);
+	}
+}
+
+/*
+ * The worker threads shared by all builds, started by the first parallel
+ * build and restarted only when the number of threads changes. Builds run
+ * one at a time on the thread that refreshes the scene.
+ */
+static ThreadPool*
+build_thread_pool(int num_threads)
+{
+	static std::unique_ptr<ThreadPool> thread_pool;
+	if(!thread_pool || thread_pool->num_threads() != num_threads)
+		thread_pool.reset(new ThreadPool(num_threads));
+	return thread_pool.get();
+}
+
+thread_local BVHTraversalCounters *BVH::traversal_counters = nullptr;
+
+BVH::
+BVH(const TriangleSoup &triangle_soup_, BVHBuildMode build_mode_, BVHNodeWidth node_width_)
+	: triangle_soup(triangle_soup_)
+	, build_mode(build_mode_)
+	, node_width(node_width_)
+{
+	rebuild(build_mode_, node_width_);
+}
 
 BVH::
-BVH(const TriangleSoup &triangle_soup_)
+BVH(const TriangleSoup &triangle_soup_, BVHBuildMode build_mode_, BVHNodeWidth node_width_,
+		int const* triangle_indices_, size_t num_references,
+		FlatNode const* flat_nodes_, size_t num_nodes)
 	: triangle_soup(triangle_soup_)
-	, triangle_indices(triangle_soup_.num_triangles)
-	, nodes(1)
+	, triangle_indices(triangle_indices_, triangle_indices_ + num_references)
+	, flat_nodes(flat_nodes_, flat_nodes_ + num_nodes)
+	, build_mode(build_mode_)
+	, node_width(node_width_)
+{
+	cg_assert(int(triangle_indices.size()) >= triangle_soup.num_triangles);
+
+	Timer timer;
+	timer.start();
+
+	fill_triangle_blocks();
+	set_node_width(node_width_);
+	build_sah_cost = stats.sah_cost;
+
+	timer.stop();
+	build_time_ms = timer.getElapsedTimeInMilliSec();
+}
+
+void BVH::
+rebuild(BVHBuildMode build_mode_, BVHNodeWidth node_width_)
+{
+	Timer timer;
+	timer.start();
+
+	build_mode = build_mode_;
+	int const num_triangles = triangle_soup.num_triangles;
+
+	/* only use worker threads if there is more than one job worth of work */
+	int const num_threads = RaytracingContext::get_active()
+		? RaytracingContext::get_active()->params.num_threads
+		: int(std::thread::hardware_concurrency());
+	ThreadPool *thread_pool = nullptr;
+	if(num_threads > 1 && num_triangles > PARALLEL_BUILD_JOB_TRIANGLES && build_mode != BVH_BUILD_SBVH)
+		thread_pool = build_thread_pool(num_threads);
+
+	triangle_indices.resize(num_triangles);
+	triangle_aabbs.resize(num_triangles);
+	for_each_chunk(thread_pool, num_triangles, [&](int, int begin, int end) {
+			for(int i = begin; i < end; i++) {
+				triangle_indices[i] = i;
+				triangle_aabbs[i] = AABB();
+				for(int j = 0; j < 3; j++)
+					triangle_aabbs[i].extend(triangle_soup.vertices[i * 3 + j]);
+			}
+		});
+
+	nodes.assign(1, Node());
+	nodes.reserve(num_triangles * 2);
+	if(build_mode == BVH_BUILD_SBVH) {
+		/* serial, the triangle ranges of subtrees are not known in advance */
+		std::vector<Reference> refs(num_triangles);
+		AABB root;
+		for(int i = 0; i < num_triangles; i++) {
+			refs[i].aabb     = triangle_aabbs[i];
+			refs[i].triangle = i;
+			root.extend(triangle_aabbs[i]);
+		}
+		triangle_indices.clear();
+		int duplication_budget = int(SBVH_MAX_DUPLICATION * float(num_triangles));
+		if(num_triangles > 0)
+			build_sbvh(nodes, 0, std::move(refs), 0, root.surface_area(), duplication_budget);
+		std::vector<int>(triangle_indices).swap(triangle_indices);
+	}
+	else if(build_mode == BVH_BUILD_LBVH) {
+		if(num_triangles > 0)
+			build_lbvh(thread_pool);
+	}
+	else if(!thread_pool) {
+		build_bvh(nodes, 0, 0, num_triangles, 0);
+	}
+	else {
+		/* build the top levels and collect the remaining subtrees as jobs */
+		std::vector<Node> top(1);
+		std::vector<BuildJob> jobs;
+		build_bvh(top, 0, 0, num_triangles, 0, &jobs, thread_pool);
+
+		thread_pool->run(static_cast<int>(jobs.size()),
+			[&](int j, ThreadLocalData*, std::atomic<bool>&) {
+				BuildJob &job = jobs[j];
+				job.nodes.assign(1, Node());
+				job.nodes.reserve(job.num_triangles * 2);
+				build_bvh(job.nodes, 0, job.first_triangle_idx, job.num_triangles, job.depth);
+			});
+		thread_pool->wait();
+		thread_pool->poll_exceptions();
+
+		std::vector<int> job_of_node(top.size(), -1);
+		for(size_t j = 0; j < jobs.size(); j++)
+			job_of_node[jobs[j].node_idx] = static_cast<int>(j);
+		assemble(top, 0, 0, jobs, job_of_node);
+	}
+
+	std::vector<AABB>().swap(triangle_aabbs);
+	sanity_checks();
+
+	flatten();
+	set_node_width(node_width_);
+	build_sah_cost = stats.sah_cost;
+
+	timer.stop();
+	build_time_ms = timer.getElapsedTimeInMilliSec();
+}
+
+bool BVH::
+refit(float max_sah_growth)
+{
+	if(flat_nodes.empty())
+		return triangle_soup.num_triangles == 0;
+
+	/* the triangle blocks hold copies of the vertices */
+	fill_triangle_blocks();
+
+	/* children are always stored after their parent */
+	for(int i = static_cast<int>(flat_nodes.size()) - 1; i >= 0; i--) {
+		FlatNode &n = flat_nodes[i];
+		n.aabb = AABB();
+		if(n.num_triangles == 0) {
+			cg_assert(n.offset > i);
+			n.aabb.extend(flat_nodes[i + 1].aabb);
+			n.aabb.extend(flat_nodes[n.offset].aabb);
+			continue;
+		}
+		for(int j = 0; j < n.num_triangles; j++) {
+			int const x = triangle_blocks[n.offset + j / 4].triangle_id[j % 4];
+			for(int k = 0; k < 3; k++)
+				n.aabb.extend(triangle_soup.vertices[x * 3 + k]);
+		}
+	}
+
+	set_node_width(node_width);
+	return stats.sah_cost <= max_sah_growth * build_sah_cost;
+}
+
+void BVH::
+fit_bounds(ThreadPool *thread_pool)
+{
+	int const num_nodes = static_cast<int>(nodes.size());
+	for_each_chunk(thread_pool, num_nodes, [&](int, int begin, int end) {
+			for(int i = begin; i < end; i++) {
+				Node &n = nodes[i];
+				n.aabb = AABB();
+				if(n.left >= 0)
+					continue;
+				for(int j = n.triangle_idx; j < n.triangle_idx + n.num_triangles; j++) {
+					for(int k = 0; k < 3; k++)
+						n.aabb.extend(triangle_soup.vertices[triangle_indices[j] * 3 + k]);
+				}
+			}
+		});
+
+	/* children are always stored after their parent */
+	for(int i = num_nodes - 1; i >= 0; i--) {
+		Node &n = nodes[i];
+		if(n.left < 0)
+			continue;
+		cg_assert(n.left > i && n.right > i);
+		n.aabb.extend(nodes[n.left].aabb);
+		n.aabb.extend(nodes[n.right].aabb);
+	}
+}
+
+float BVH::
+sah_cost() const
+{
+	if(flat_nodes.empty())
+		return 0.0f;
+	float const root_area = flat_nodes[0].aabb.surface_area();
+	if(!(root_area > 0.0f))
+		return 0.0f;
+
+	float cost = 0.0f;
+	for(auto const& n: flat_nodes) {
+		cost += n.aabb.surface_area() / root_area * (n.num_triangles > 0
+			? SAH_INTERSECTION_COST * float(n.num_triangles)
+			: SAH_TRAVERSAL_COST);
+	}
+	return cost;
+}
+
+BVH::Stats BVH::
+compute_stats() const
+{
+	Stats s;
+	s.num_nodes      = static_cast<int>(flat_nodes.size());
+	s.num_references = static_cast<int>(triangle_indices.size());
+	s.sah_cost       = sah_cost();
+	s.memory_size    = memory_size();
+	if(flat_nodes.empty())
+		return s;
+
+	struct Entry { int node; int depth; };
+	std::vector<Entry> stack(1, Entry { 0, 0 });
+	double depth_sum = 0.0;
+	while(!stack.empty()) {
+		Entry const e = stack.back();
+		stack.pop_back();
+		FlatNode const& n = flat_nodes[e.node];
+		s.max_depth = std::max(s.max_depth, e.depth);
+		if(n.num_triangles > 0) {
+			s.num_leaves++;
+			s.leaf_sizes[std::min(n.num_triangles, int(SAH_MAX_TRIANGLES_IN_LEAF))]++;
+			depth_sum += e.depth;
+		}
+		else {
+			stack.push_back(Entry { e.node + 1, e.depth + 1 });
+			stack.push_back(Entry { n.offset,   e.depth + 1 });
+		}
+	}
+	s.mean_leaf_depth = float(depth_sum / s.num_leaves);
+	return s;
+}
+
+size_t BVH::
+memory_size() const
+{
+	return flat_nodes.size()      * sizeof(FlatNode)
+	     + wide4_nodes.size()     * sizeof(WideNode<4>)
+	     + wide8_nodes.size()     * sizeof(WideNode<8>)
+	     + quantized4_nodes.size() * sizeof(QuantizedNode<4>)
+	     + quantized8_nodes.size() * sizeof(QuantizedNode<8>)
+	     + triangle_blocks.size() * sizeof(TriangleBlock)
+	     + triangle_indices.size() * sizeof(int);
+}
+
+void BVH::
+set_node_width(BVHNodeWidth node_width_)
+{
+	/* quantized trees keep no binary nodes to collapse */
+	if(flat_nodes.empty() && triangle_soup.num_triangles > 0) {
+		rebuild(build_mode, node_width_);
+		return;
+	}
+
+	node_width = node_width_;
+	wide4_nodes.clear();
+	wide8_nodes.clear();
+	quantized4_nodes.clear();
+	quantized8_nodes.clear();
+	if(node_width == BVH_WIDE_4)
+		collapse<4>(wide4_nodes);
+	else if(node_width == BVH_WIDE_8)
+		collapse<8>(wide8_nodes);
+	else if(node_width == BVH_QUANTIZED_4)
+		collapse_quantized<4>(quantized4_nodes);
+	else if(node_width == BVH_QUANTIZED_8)
+		collapse_quantized<8>(quantized8_nodes);
+	stats = compute_stats();
+
+	/* the quantized nodes are all that is needed for traversal */
+	if(node_width == BVH_QUANTIZED_4 || node_width == BVH_QUANTIZED_8) {
+		flat_nodes.clear();
+		flat_nodes.shrink_to_fit();
+		stats.memory_size = memory_size();
+	}
+}
+
+/*
+ * A quantized bound, computed exactly like during traversal. The product
+ * is exact, so the result does not depend on contraction into an FMA.
+ */
+static inline float
+dequantize(float origin, int q, float scale)
+{
+	return origin + float(q) * scale;
+}
+
+/*
+ * Quantize the child bounds of w relative to the bounds of all children.
+ * The scale of an axis is the smallest power of two that covers them in
+ * 255 steps, lower bounds are rounded down and upper bounds up.
+ */
+template <int N>
+static void
+quantize_node(BVH::WideNode<N> const& w, BVH::QuantizedNode<N> &q)
+{
+	for(int a = 0; a < 3; a++) {
+		float lo =  FLT_MAX;
+		float hi = -FLT_MAX;
+		for(int i = 0; i < N; i++) {
+			if(w.offset[i] < 0)
+				continue;
+			lo = std::min(lo, w.bounds_min[a][i]);
+			hi = std::max(hi, w.bounds_max[a][i]);
+		}
+		cg_assert(lo <= hi);
+
+		int e = -126;
+		if(hi > lo) {
+			std::frexp((hi - lo) / 255.0f, &e);
+			e = std::max(e, -126);
+		}
+		while(dequantize(lo, 255, std::ldexp(1.0f, e)) < hi)
+			e++;
+		cg_assert(e <= 127);
+		float const scale = std::ldexp(1.0f, e);
+		q.origin[a]   = lo;
+		q.exponent[a] = static_cast<int8_t>(e);
+
+		for(int i = 0; i < N; i++) {
+			if(w.offset[i] < 0) {
+				q.bounds_min[a][i] = 255;
+				q.bounds_max[a][i] = 0;
+				continue;
+			}
+			int q_min = std::max(0, std::min(255, int(std::floor((w.bounds_min[a][i] - lo) / scale))));
+			while(q_min > 0 && dequantize(lo, q_min, scale) > w.bounds_min[a][i])
+				q_min--;
+			int q_max = std::max(0, std::min(255, int(std::ceil((w.bounds_max[a][i] - lo) / scale))));
+			while(q_max < 255 && dequantize(lo, q_max, scale) < w.bounds_max[a][i])
+				q_max++;
+			q.bounds_min[a][i] = static_cast<uint8_t>(q_min);
+			q.bounds_max[a][i] = static_cast<uint8_t>(q_max);
+		}
+	}
+
+	for(int i = 0; i < N; i++) {
+		cg_assert(w.num_triangles[i] < 256);
+		q.num_triangles[i] = static_cast<uint8_t>(w.num_triangles[i]);
+		q.offset[i]        = w.offset[i];
+	}
+}
+
+/*
+ * The union of the dequantized child bounds of a quantized node.
+ */
+template <int N>
+static AABB
+quantized_bounds(BVH::QuantizedNode<N> const& q)
+{
+	AABB aabb;
+	for(int i = 0; i < N; i++) {
+		if(q.offset[i] < 0)
+			continue;
+		glm::vec3 lo, hi;
+		for(int a = 0; a < 3; a++) {
+			float const scale = std::ldexp(1.0f, q.exponent[a]);
+			lo[a] = dequantize(q.origin[a], q.bounds_min[a][i], scale);
+			hi[a] = dequantize(q.origin[a], q.bounds_max[a][i], scale);
+		}
+		aabb.extend(lo);
+		aabb.extend(hi);
+	}
+	return aabb;
+}
+
+template <int N, class QuantizedNodes>
+void BVH::
+collapse_quantized(QuantizedNodes &quantized_nodes) const
+{
+	std::vector<WideNode<N>, AlignedAllocator<WideNode<N>, 64>> wide_nodes;
+	collapse<N>(wide_nodes);
+	quantized_nodes.resize(wide_nodes.size());
+	for(size_t i = 0; i < wide_nodes.size(); i++)
+		quantize_node<N>(wide_nodes[i], quantized_nodes[i]);
+}
+
+template <int N, class WideNodes>
+void BVH::
+collapse(WideNodes &wide_nodes) const
+{
+	wide_nodes.clear();
+	if(triangle_soup.num_triangles == 0)
+		return;
+	wide_nodes.resize(1);
+	collapse_node<N>(wide_nodes, 0, 0);
+}
+
+template <int N, class WideNodes>
+void BVH::
+collapse_node(WideNodes &wide_nodes, int node_idx, int wide_idx) const
+{
+	/* open the inner child with the largest surface area until N are found */
+	int children[N];
+	int num_children = 1;
+	children[0] = node_idx;
+	while(num_children < N) {
+		int best = -1;
+		float best_area = -1.0f;
+		for(int i = 0; i < num_children; i++) {
+			FlatNode const& c = flat_nodes[children[i]];
+			if(c.num_triangles == 0 && c.aabb.surface_area() > best_area) {
+				best = i;
+				best_area = c.aabb.surface_area();
+			}
+		}
+		if(best < 0)
+			break;
+		int const left  = children[best] + 1;
+		int const right = flat_nodes[children[best]].offset;
+		for(int i = num_children; i > best + 1; i--)
+			children[i] = children[i - 1];
+		children[best]     = left;
+		children[best + 1] = right;
+		num_children++;
+	}
+
+	int child_wide_idx[N];
+	for(int i = 0; i < N; i++) {
+		child_wide_idx[i] = -1;
+		WideNode<N> &w = wide_nodes[wide_idx];
+		if(i >= num_children) {
+			for(int a = 0; a < 3; a++) {
+				w.bounds_min[a][i] =  FLT_MAX;
+				w.bounds_max[a][i] = -FLT_MAX;
+			}
+			w.offset[i]        = -1;
+			w.num_triangles[i] = 0;
+			continue;
+		}
+
+		FlatNode const& c = flat_nodes[children[i]];
+		for(int a = 0; a < 3; a++) {
+			w.bounds_min[a][i] = c.aabb.min[a];
+			w.bounds_max[a][i] = c.aabb.max[a];
+		}
+		if(c.num_triangles > 0) {
+			w.offset[i]        = c.offset;
+			w.num_triangles[i] = c.num_triangles;
+		}
+		else {
+			child_wide_idx[i] = static_cast<int>(wide_nodes.size());
+			wide_nodes.emplace_back();
+			wide_nodes[wide_idx].offset[i]        = child_wide_idx[i];
+			wide_nodes[wide_idx].num_triangles[i] = 0;
+		}
+	}
+
+	for(int i = 0; i < num_children; i++) {
+		if(child_wide_idx[i] >= 0)
+			collapse_node<N>(wide_nodes, children[i], child_wide_idx[i]);
+	}
+}
+
+void BVH::
+assemble(std::vector<Node> const& src, int src_idx, int dst_idx,
+		std::vector<BuildJob> const& jobs, std::vector<int> const& job_of_node)
+{
+	int const job = src_idx < int(job_of_node.size()) ? job_of_node[src_idx] : -1;
+	if(job >= 0) {
+		static const std::vector<int> no_jobs;
+		assemble(jobs[job].nodes, 0, dst_idx, jobs, no_jobs);
+		return;
+	}
+
+	Node const& n = src[src_idx];
+	nodes[dst_idx] = n;
+	if(n.left < 0)
+		return;
+
+	int const num_nodes = static_cast<int>(nodes.size());
+	nodes[dst_idx].left  = num_nodes + 0;
+	nodes[dst_idx].right = num_nodes + 1;
+	nodes.push_back(Node());
+	nodes.push_back(Node());
+	assemble(src, n.left,  num_nodes + 0, jobs, job_of_node);
+	assemble(src, n.right, num_nodes + 1, jobs, job_of_node);
+}
+
+void BVH::
+flatten()
+{
+	flat_nodes.clear();
+	if(triangle_soup.num_triangles == 0) {
+		std::vector<Node>().swap(nodes);
+		triangle_blocks.clear();
+		return;
+	}
+	flat_nodes.resize(nodes.size());
+
+	/*
+	 * pre-order traversal, the left child is visited right after its parent;
+	 * triangle_indices is reordered like the leaves
+	 */
+	struct Entry { int node; int parent; int depth; };
+	std::vector<Entry> stack(1, Entry { 0, -1, 0 });
+	std::vector<int> leaf_indices;
+	leaf_indices.reserve(triangle_indices.size());
+	int num_flat = 0;
+	while(!stack.empty()) {
+		Entry const e = stack.back();
+		stack.pop_back();
+		cg_assert(e.depth <= MAX_DEPTH);
+
+		int const idx = num_flat++;
+		if(e.parent >= 0)
+			flat_nodes[e.parent].offset = idx;
+
+		Node const& n = nodes[e.node];
+		FlatNode &f = flat_nodes[idx];
+		f.aabb = n.aabb;
+		if(n.left < 0) {
+			f.num_triangles = n.num_triangles;
+			leaf_indices.insert(leaf_indices.end(), triangle_indices.begin() + n.triangle_idx,
+					triangle_indices.begin() + n.triangle_idx + n.num_triangles);
+		}
+		else {
+			f.num_triangles = 0;
+			stack.push_back(Entry { n.right, idx, e.depth + 1 });
+			stack.push_back(Entry { n.left,  -1,  e.depth + 1 });
+		}
+	}
+	cg_assert(num_flat == int(nodes.size()));
+	cg_assert(leaf_indices.size() == triangle_indices.size());
+
+	triangle_indices.swap(leaf_indices);
+	std::vector<Node>().swap(nodes);
+	fill_triangle_blocks();
+}
+
+void BVH::
+fill_triangle_blocks()
+{
+	triangle_blocks.clear();
+	int first = 0;
+	for(FlatNode &f: flat_nodes) {
+		if(f.num_triangles == 0)
+			continue;
+		f.offset = static_cast<int>(triangle_blocks.size());
+		for(int i = 0; i < f.num_triangles; i += 4) {
+			TriangleBlock b;
+			for(int l = 0; l < 4; l++) {
+				int const x = i + l < f.num_triangles ? triangle_indices[first + i + l] : -1;
+				glm::vec3 v0(0.0f), edge1(0.0f), edge2(0.0f);
+				if(x >= 0) {
+					v0    = triangle_soup.vertices[x * 3 + 0];
+					edge1 = triangle_soup.vertices[x * 3 + 1] - v0;
+					edge2 = triangle_soup.vertices[x * 3 + 2] - v0;
+				}
+				for(int a = 0; a < 3; a++) {
+					b.v0[a][l]    = v0[a];
+					b.edge1[a][l] = edge1[a];
+					b.edge2[a][l] = edge2[a];
+				}
+				b.triangle_id[l] = x;
+			}
+			triangle_blocks.push_back(b);
+		}
+		first += f.num_triangles;
+	}
+	cg_assert(first == int(triangle_indices.size()));
+}
+
+template <bool any_hit>
+bool BVH::
+intersect_triangles(Ray const& ray, int first_block, int num_triangles,
+		float &min_dist, glm::vec3 &bary, int &nearest_triangle) const
+{
+	__m128 const zero = _mm_setzero_ps();
+	__m128 const one  = _mm_set1_ps(1.0f);
+	__m128 const dx = _mm_set1_ps(ray.direction.x);
+	__m128 const dy = _mm_set1_ps(ray.direction.y);
+	__m128 const dz = _mm_set1_ps(ray.direction.z);
+
+	if(traversal_counters)
+		traversal_counters->triangles_tested += num_triangles;
+
+	/* the same arithmetic as intersect_triangle, for four triangles at once */
+	bool hit = false;
+	for(int i = 0; i < num_triangles; i += 4) {
+		TriangleBlock const& b = triangle_blocks[first_block + i / 4];
+		__m128 const e1x = _mm_load_ps(b.edge1[0]), e1y = _mm_load_ps(b.edge1[1]), e1z = _mm_load_ps(b.edge1[2]);
+		__m128 const e2x = _mm_load_ps(b.edge2[0]), e2y = _mm_load_ps(b.edge2[1]), e2z = _mm_load_ps(b.edge2[2]);
+
+		/* pvec = cross(direction, edge2) */
+		__m128 const px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+		__m128 const py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+		__m128 const pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+
+		__m128 const det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 const inv_det = _mm_div_ps(one, det);
+
+		__m128 const tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(b.v0[0]));
+		__m128 const ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(b.v0[1]));
+		__m128 const tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(b.v0[2]));
+
+		__m128 const alpha = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+		/* qvec = cross(tvec, edge1) */
+		__m128 const qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+		__m128 const qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(e1z, tx));
+		__m128 const qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(e1x, ty));
+
+		__m128 const beta = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+		__m128 const t    = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+		__m128 hits = _mm_and_ps(_mm_cmple_ps(zero, alpha), _mm_cmpngt_ps(alpha, one));
+		hits = _mm_and_ps(hits, _mm_cmple_ps(zero, beta));
+		hits = _mm_and_ps(hits, _mm_cmpngt_ps(_mm_add_ps(alpha, beta), one));
+		hits = _mm_and_ps(hits, _mm_cmpnle_ps(t, zero));
+
+		int const valid = num_triangles - i >= 4 ? 0xf : (1 << (num_triangles - i)) - 1;
+		int const lanes = _mm_movemask_ps(hits) & valid;
+		if(!lanes)
+			continue;
+
+		alignas(16) float alpha_[4], beta_[4], t_[4];
+		_mm_store_ps(alpha_, alpha);
+		_mm_store_ps(beta_, beta);
+		_mm_store_ps(t_, t);
+		for(int l = 0; l < 4; l++) {
+			if(!(lanes & (1 << l)))
+				continue;
+			if(any_hit && !(t_[l] < min_dist))
+				continue;
+			hit = true;
+			/* a triangle referenced by several leaves is hit at the same t again */
+			if(b.triangle_id[l] == nearest_triangle)
+				continue;
+			if(t_[l] < min_dist || nearest_triangle == -1) {
+				min_dist = t_[l];
+				bary = glm::vec3(1.f - alpha_[l] - beta_[l], alpha_[l], beta_[l]);
+				cg_assert(b.triangle_id[l] >= 0);
+				nearest_triangle = b.triangle_id[l];
+				if(any_hit)
+					return true;
+			}
+		}
+	}
+	return hit;
+}
+
+bool BVH::
+intersect_local(Ray const& ray, float &min_dist, glm::vec3 &bary, int &nearest_triangle) const
+{
+	bool hit = false;
+	switch(node_width) {
+	case BVH_WIDE_4:
+		hit = intersect_wide<4, false>(wide4_nodes, ray, min_dist, bary, nearest_triangle);
+		break;
+	case BVH_WIDE_8:
+		hit = intersect_wide<8, false>(wide8_nodes, ray, min_dist, bary, nearest_triangle);
+		break;
+	case BVH_QUANTIZED_4:
+		hit = intersect_wide<4, false>(quantized4_nodes, ray, min_dist, bary, nearest_triangle);
+		break;
+	case BVH_QUANTIZED_8:
+		hit = intersect_wide<8, false>(quantized8_nodes, ray, min_dist, bary, nearest_triangle);
+		break;
+	default:
+		hit = intersect_binary<false>(ray, 0, min_dist, bary, nearest_triangle);
+		break;
+	}
+
+	return hit;
+}
+
+template <bool any_hit>
+bool BVH::
+intersect_binary(Ray const& ray, int root, float &min_dist, glm::vec3 &bary, int &nearest_triangle) const
+{
+	if(flat_nodes.empty())
+		return false;
+
+	int stack[TRAVERSAL_STACK_SIZE];
+	int stack_size = 0;
+
+	bool hit = false;
+	BVHTraversalCounters *const counters = traversal_counters;
+	
+	glm::vec3 div = 1.0f / ray.direction;
+
+	{ /* push root node on stack if hit */
+		float t_min = 0.0;
+		float t_max = min_dist;
+		if(flat_nodes[root].aabb.intersect(ray, t_min, t_max, div))
+			stack[stack_size++] = root;
+	}
+
+	while(stack_size > 0) {
+		int const idx = stack[--stack_size];
+		const FlatNode &n = flat_nodes[idx];
+		if(counters)
+			counters->nodes_visited++;
+		if(n.num_triangles > 0) { /* leaf node, intersect triangles */
+			hit |= intersect_triangles<any_hit>(ray, n.offset, n.num_triangles, min_dist, bary, nearest_triangle);
+			if(any_hit && hit)
+				return true;
+		}
+		else {
+			int const left  = idx + 1;
+			int const right = n.offset;
+
+			float t_min_l = 0;
+			float t_max_l = min_dist;
+			float t_min_r = 0;
+			float t_max_r = min_dist;
+
+			bool il = flat_nodes[left ].aabb.intersect(ray, t_min_l, t_max_l, div);
+			bool ir = flat_nodes[right].aabb.intersect(ray, t_min_r, t_max_r, div);
+			if(!il && !ir) { /* no child hit, do nothing */
+			}
+			else if(il ^ ir) { /* only one child hit */
+				stack[stack_size++] = il ? left : right;
+			}
+			else { /* both children hit, order by first aabb intersection */
+				if(t_min_l < t_min_r) {
+					stack[stack_size++] = right;
+					stack[stack_size++] = left;
+				}
+				else {
+					stack[stack_size++] = left;
+					stack[stack_size++] = right;
+				}
+			}
+		}
+	}
+
+	return hit;
+}
+
+/*
+ * A ray prepared for slab tests against the children of a wide node.
+ * Entering planes are the minimum bounds on axes where the ray direction
+ * is positive and the maximum bounds otherwise.
+ */
+struct WideRay {
+	__m128 origin[3];
+	__m128 div[3];
+#ifdef __AVX__
+	__m256 origin8[3];
+	__m256 div8[3];
+#endif
+	bool negative[3];
+
+	WideRay(Ray const& ray)
+	{
+		glm::vec3 const div_ = 1.0f / ray.direction;
+		for(int a = 0; a < 3; a++) {
+			origin[a]   = _mm_set1_ps(ray.origin[a]);
+			div[a]      = _mm_set1_ps(div_[a]);
+#ifdef __AVX__
+			origin8[a]  = _mm256_set1_ps(ray.origin[a]);
+			div8[a]     = _mm256_set1_ps(div_[a]);
+#endif
+			negative[a] = div_[a] < 0.0f;
+		}
+	}
+};
+
+/*
+ * Slab test against the four children of node starting at child first.
+ * Returns the mask of the children hit in [0, t_max] and stores their
+ * entry distances in t_near. A NaN from a ray that lies in a bounding
+ * plane does not cull the child.
+ */
+template <int N>
+static inline int
+intersect_children_sse(BVH::WideNode<N> const& n, int first, WideRay const& r, float t_max, float *t_near)
+{
+	__m128 t_enter = _mm_setzero_ps();
+	__m128 t_exit  = _mm_set1_ps(t_max);
+	for(int a = 0; a < 3; a++) {
+		float const *enter_plane = r.negative[a] ? n.bounds_max[a] : n.bounds_min[a];
+		float const *exit_plane  = r.negative[a] ? n.bounds_min[a] : n.bounds_max[a];
+		__m128 const t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(enter_plane + first), r.origin[a]), r.div[a]);
+		__m128 const t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(exit_plane  + first), r.origin[a]), r.div[a]);
+		t_enter = _mm_max_ps(t0, t_enter);
+		t_exit  = _mm_min_ps(t1, t_exit);
+	}
+	_mm_storeu_ps(t_near, t_enter);
+	return _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit));
+}
+
+template <int N>
+static inline int
+intersect_children(BVH::WideNode<N> const& n, WideRay const& r, float t_max, float *t_near)
+{
+	int mask = 0;
+	for(int first = 0; first < N; first += 4)
+		mask |= intersect_children_sse(n, first, r, t_max, t_near + first) << first;
+	return mask;
+}
+
+#ifdef __AVX__
+template <>
+inline int
+intersect_children<8>(BVH::WideNode<8> const& n, WideRay const& r, float t_max, float *t_near)
+{
+	__m256 t_enter = _mm256_setzero_ps();
+	__m256 t_exit  = _mm256_set1_ps(t_max);
+	for(int a = 0; a < 3; a++) {
+		float const *enter_plane = r.negative[a] ? n.bounds_max[a] : n.bounds_min[a];
+		float const *exit_plane  = r.negative[a] ? n.bounds_min[a] : n.bounds_max[a];
+		__m256 const t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(enter_plane), r.origin8[a]), r.div8[a]);
+		__m256 const t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(exit_plane),  r.origin8[a]), r.div8[a]);
+		t_enter = _mm256_max_ps(t0, t_enter);
+		t_exit  = _mm256_min_ps(t1, t_exit);
+	}
+	_mm256_storeu_ps(t_near, t_enter);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ));
+}
+#endif
+
+/*
+ * The bounds of four children of a quantized node along one axis.
+ */
+static inline __m128
+dequantize_sse(uint8_t const *q, __m128 origin, __m128 scale)
+{
+	int bits;
+	std::memcpy(&bits, q, sizeof(bits));
+	__m128i const zero = _mm_setzero_si128();
+	__m128i const v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero), zero);
+	return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+}
+
+/*
+ * Slab test against the four children of a quantized node starting at child
+ * first, like intersect_children_sse for a WideNode.
+ */
+template <int N>
+static inline int
+intersect_quantized_children_sse(BVH::QuantizedNode<N> const& n, int first, WideRay const& r, float t_max, float *t_near)
+{
+	__m128 t_enter = _mm_setzero_ps();
+	__m128 t_exit  = _mm_set1_ps(t_max);
+	for(int a = 0; a < 3; a++) {
+		__m128 const origin = _mm_set1_ps(n.origin[a]);
+		__m128 const scale  = _mm_castsi128_ps(_mm_set1_epi32((n.exponent[a] + 127) << 23));
+		__m128 const lo = dequantize_sse(n.bounds_min[a] + first, origin, scale);
+		__m128 const hi = dequantize_sse(n.bounds_max[a] + first, origin, scale);
+		__m128 const t0 = _mm_mul_ps(_mm_sub_ps(r.negative[a] ? hi : lo, r.origin[a]), r.div[a]);
+		__m128 const t1 = _mm_mul_ps(_mm_sub_ps(r.negative[a] ? lo : hi, r.origin[a]), r.div[a]);
+		t_enter = _mm_max_ps(t0, t_enter);
+		t_exit  = _mm_min_ps(t1, t_exit);
+	}
+	_mm_storeu_ps(t_near, t_enter);
+	return _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit));
+}
+
+template <int N>
+static inline int
+intersect_children(BVH::QuantizedNode<N> const& n, WideRay const& r, float t_max, float *t_near)
+{
+	int mask = 0;
+	for(int first = 0; first < N; first += 4)
+		mask |= intersect_quantized_children_sse(n, first, r, t_max, t_near + first) << first;
+	return mask;
+}
+
+template <int N, bool any_hit, class WideNodes>
+bool BVH::
+intersect_wide(WideNodes const& wide_nodes, Ray const& ray,
+		float &min_dist, glm::vec3 &bary, int &nearest_triangle) const
+{
+	if(wide_nodes.empty())
+		return false;
+
+	/* a stack entry is either a wide node or a leaf child */
+	struct Entry {
+		int   offset;
+		int   num_triangles;
+		float t_near;
+	};
+	Entry stack[TRAVERSAL_STACK_SIZE * N];
+	int stack_size = 0;
+	stack[stack_size++] = Entry { 0, 0, 0.0f };
+
+	WideRay const r(ray);
+	bool hit = false;
+	BVHTraversalCounters *const counters = traversal_counters;
+
+	while(stack_size > 0) {
+		Entry const e = stack[--stack_size];
+		if(e.t_near > min_dist) /* a closer hit was found since the push */
+			continue;
+		if(e.num_triangles > 0) {
+			hit |= intersect_triangles<any_hit>(ray, e.offset, e.num_triangles, min_dist, bary, nearest_triangle);
+			if(any_hit && hit)
+				return true;
+			continue;
+		}
+
+		auto const& n = wide_nodes[e.offset];
+		if(counters)
+			counters->nodes_visited++;
+		float t_near[N];
+		int const mask = intersect_children(n, r, min_dist, t_near);
+
+		/* push the children hit, sorted such that the nearest is on top */
+		int const first = stack_size;
+		for(int i = 0; i < N; i++) {
+			if(!(mask & (1 << i)))
+				continue;
+			Entry const c { n.offset[i], n.num_triangles[i], t_near[i] };
+			int j = stack_size++;
+			for(; j > first && stack[j - 1].t_near < c.t_near; j--)
+				stack[j] = stack[j - 1];
+			stack[j] = c;
+		}
+		cg_assert(stack_size <= TRAVERSAL_STACK_SIZE * N);
+	}
+
+	return hit;
+}
+
+bool BVH::
+intersect(Ray const& ray, Intersection* isect) const
+{
+	HitRecord hit;
+	if (!intersect_hit(ray, &hit))
+		return false;
+	if (isect)
+		fill_intersection(ray, hit, isect);
+	return true;
+}
+
+bool BVH::
+intersect_hit(Ray const& ray, HitRecord* hit) const
+{
+	return intersect_instance(ray, hit, transform_world_to_object, transform_object_to_world);
+}
+
+void BVH::
+fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const
+{
+	fill_instance_intersection(ray, hit, isect, transform_world_to_object, transform_object_to_world);
+}
+
+bool BVH::
+occluded(Ray const& ray, float t_max) const
+{
+	return occluded_instance(ray, t_max, transform_world_to_object, transform_object_to_world);
+}
+
+glm::vec3 BVH::
+world_position(int triangle, glm::vec3 const& bary, glm::mat4 const& object_to_world) const
+{
+	return transform_position(object_to_world, interpolate_barycentric(
+			triangle_soup.vertices[3 * triangle + 0],
+			triangle_soup.vertices[3 * triangle + 1],
+			triangle_soup.vertices[3 * triangle + 2],
+			bary));
+}
+
+bool BVH::
+intersect_instance(Ray const& ray, HitRecord* hit,
+		glm::mat4 const& world_to_object, glm::mat4 const& object_to_world) const
 {
-	nodes.reserve(triangle_soup.num_triangles * 2);
-	for(int i = 0; i < triangle_soup.num_triangles; i++)
-		triangle_indices[i] = i;
-	build_bvh(0, 0, triangle_soup.num_triangles, 0);
+	cg_assert(hit);
+	// transform ray in object space
+	const Ray ray_local = transform_ray(ray, world_to_object);
 
-	sanity_checks();
+	/* search no farther than hit->t, scaled and widened like in
+	 * occluded_instance, the hit is checked in world space below */
+	float const scale = glm::length(glm::vec3(world_to_object * glm::vec4(ray.direction, 0.f)));
+	float min_dist = hit->t * scale * 1.0001f;
+	glm::vec3 bary(0.f);
+	int nearest_triangle = -1;
+	if (!intersect_local(ray_local, min_dist, bary, nearest_triangle))
+		return false;
+
+	/* the distance is measured in world space, from the same position as
+	 * fill_instance_intersection computes */
+	glm::vec3 const position = world_position(nearest_triangle, bary, object_to_world);
+	float const t = glm::length(ray.origin - position);
+	if (!(t < hit->t))
+		return false;
+	hit->t = t;
+	hit->primitive_id = uint32_t(nearest_triangle);
+	hit->instance_id = 0;
+	hit->bary = glm::vec2(bary.y, bary.z);
+	return true;
+}
+
+void BVH::
+fill_instance_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect,
+		glm::mat4 const& world_to_object, glm::mat4 const& object_to_world) const
+{
+	cg_assert(isect);
+	Intersection isect_local;
+	triangle_soup.fill_intersection(&isect_local, int(hit.primitive_id), hit.t, hit.barycentrics());
+	*isect = transform_intersection(isect_local,
+		object_to_world, glm::transpose(world_to_object));
+	isect->t = glm::length(ray.origin-isect->position);
 }
 
 bool BVH::
-intersect_local(Ray const& ray, Intersection* isect) const
+occluded_instance(Ray const& ray, float t_max,
+		glm::mat4 const& world_to_object, glm::mat4 const& object_to_world) const
 {
-	int stack[64];
-	int stack_size = 0;
+	const Ray ray_local = transform_ray(ray, world_to_object);
 
-	float min_dist = std::numeric_limits<float>::max();
+	/* distances along the normalized local ray are scaled by the transform,
+	 * the bound is widened slightly and every hit checked in world space */
+	float const scale = glm::length(glm::vec3(world_to_object * glm::vec4(ray.direction, 0.f)));
+	float min_dist = t_max * scale * 1.0001f;
 	glm::vec3 bary(0.f);
-	bool hit = false;
 	int nearest_triangle = -1;
-	
-	glm::vec3 div = 1.0f / ray.direction;
 
-	{ /* push root node on stack if hit */
-		float t_min = 0.0;
-		if(nodes[0].aabb.intersect(ray, t_min, min_dist, div))
-			stack[stack_size++] = 0;
+	bool hit = false;
+	switch(node_width) {
+	case BVH_WIDE_4:
+		hit = intersect_wide<4, true>(wide4_nodes, ray_local, min_dist, bary, nearest_triangle);
+		break;
+	case BVH_WIDE_8:
+		hit = intersect_wide<8, true>(wide8_nodes, ray_local, min_dist, bary, nearest_triangle);
+		break;
+	case BVH_QUANTIZED_4:
+		hit = intersect_wide<4, true>(quantized4_nodes, ray_local, min_dist, bary, nearest_triangle);
+		break;
+	case BVH_QUANTIZED_8:
+		hit = intersect_wide<8, true>(quantized8_nodes, ray_local, min_dist, bary, nearest_triangle);
+		break;
+	default:
+		hit = intersect_binary<true>(ray_local, 0, min_dist, bary, nearest_triangle);
+		break;
 	}
+	if(!hit)
+		return false;
 
-	while(stack_size > 0) {
-		const Node &n = nodes[stack[--stack_size]];
-		if(n.left < 0) { /* leaf node, intersect triangles */
-			for(int i = 0; i < n.num_triangles; i++) {
-				int x = triangle_indices[n.triangle_idx + i];
-				float dist;
-				glm::vec3 b = glm::vec3(0.0f);
-				if(intersect_triangle(ray.origin, ray.direction,
-						triangle_soup.vertices[x * 3 + 0],
-						triangle_soup.vertices[x * 3 + 1],
-						triangle_soup.vertices[x * 3 + 2], 
-						b, dist)) {
-					hit = true;
-					if(dist < min_dist || nearest_triangle == -1) {
-						min_dist = dist;
-						bary = b;
-						cg_assert(x >= 0);
-						nearest_triangle = x;
-					}
-				}
+	glm::vec3 const position = world_position(nearest_triangle, bary, object_to_world);
+	if(glm::length(ray.origin - position) < t_max)
+		return true;
+
+	/* the hit lies within the widened bound only, decide by the nearest hit */
+	HitRecord nearest;
+	nearest.t = t_max;
+	return intersect_instance(ray, &nearest, world_to_object, object_to_world);
+}
+
+bool BVH::
+get_local_bounds(AABB* aabb) const
+{
+	if(!flat_nodes.empty())
+		*aabb = flat_nodes[0].aabb;
+	else if(!quantized4_nodes.empty())
+		*aabb = quantized_bounds(quantized4_nodes[0]);
+	else if(!quantized8_nodes.empty())
+		*aabb = quantized_bounds(quantized8_nodes[0]);
+	return true;
+}
+
+/*
+ * Rays of a packet in object space, stored as structure of arrays. Lanes
+ * beyond size are padding with a negative min_dist, which are never hit.
+ */
+struct BVH::RayPacket {
+	int size;
+	Ray const* rays;
+	alignas(16) float origin[3][MAX_PACKET_SIZE];
+	alignas(16) float direction[3][MAX_PACKET_SIZE];
+	alignas(16) float div[3][MAX_PACKET_SIZE];
+	alignas(16) float min_dist[MAX_PACKET_SIZE];
+	glm::vec3 bary[MAX_PACKET_SIZE];
+	int nearest_triangle[MAX_PACKET_SIZE];
+
+	/*
+	 * Intervals that contain the origins and reciprocal directions of all
+	 * rays. Only used for culling if the rays agree in the sign of every
+	 * direction component.
+	 */
+	bool      coherent;
+	glm::vec3 origin_min, origin_max;
+	glm::vec3 div_min, div_max;
+
+	/* sum of all directions, used to order the children of a node */
+	glm::vec3 direction_sum;
+
+	RayPacket(Ray const local_rays[], int num_rays)
+		: size(num_rays)
+		, rays(local_rays)
+	{
+		cg_assert(num_rays > 0 && num_rays <= MAX_PACKET_SIZE);
+		coherent = true;
+		origin_min = div_min = glm::vec3( FLT_MAX);
+		origin_max = div_max = glm::vec3(-FLT_MAX);
+		direction_sum = glm::vec3(0.0f);
+		for(int i = 0; i < MAX_PACKET_SIZE; i++) {
+			Ray const& ray = local_rays[std::min(i, num_rays - 1)];
+			glm::vec3 const d = 1.0f / ray.direction;
+			for(int a = 0; a < 3; a++) {
+				origin[a][i]    = ray.origin[a];
+				direction[a][i] = ray.direction[a];
+				div[a][i]       = d[a];
 			}
+			min_dist[i]         = i < num_rays ? std::numeric_limits<float>::max() : -1.0f;
+			bary[i]             = glm::vec3(0.0f);
+			nearest_triangle[i] = -1;
+			if(i >= num_rays)
+				continue;
+
+			origin_min = glm::min(origin_min, ray.origin);
+			origin_max = glm::max(origin_max, ray.origin);
+			div_min    = glm::min(div_min, d);
+			div_max    = glm::max(div_max, d);
+			direction_sum += ray.direction;
 		}
-		else {
-			float t_min_l = 0;
-			float t_max_l = min_dist;
-			float t_min_r = 0;
-			float t_max_r = min_dist;
+		for(int a = 0; a < 3; a++) {
+			coherent &= (div_min[a] > 0.0f || div_max[a] < 0.0f)
+				&& std::isfinite(div_min[a]) && std::isfinite(div_max[a]);
+		}
+	}
 
-			bool il = nodes[n.left ].aabb.intersect(ray, t_min_l, t_max_l, div);
-			bool ir = nodes[n.right].aabb.intersect(ray, t_min_r, t_max_r, div);
-			if(!il && !ir) { /* no child hit, do nothing */
-			}
-			else if(il ^ ir) { /* only one child hit */
-				stack[stack_size++] = il ? n.left : n.right;
+	/*
+	 * True if the box is certainly missed by all rays. Interval arithmetic
+	 * on the slab test, see e.g. Boulos et al., "Geometric and Arithmetic
+	 * Culling Methods for Entire Ray Packets".
+	 */
+	bool
+	culls(AABB const& aabb) const
+	{
+		if(!coherent)
+			return false;
+
+		float t_enter = 0.0f;
+		float t_exit  = -1.0f;
+		for(int i = 0; i < size; i++)
+			t_exit = std::max(t_exit, min_dist[i]);
+		for(int a = 0; a < 3; a++) {
+			bool const negative = div_max[a] < 0.0f;
+			float const enter_plane = negative ? aabb.max[a] : aabb.min[a];
+			float const exit_plane  = negative ? aabb.min[a] : aabb.max[a];
+
+			float const e0 = enter_plane - origin_max[a];
+			float const e1 = enter_plane - origin_min[a];
+			t_enter = std::max(t_enter, std::min(
+					std::min(e0 * div_min[a], e0 * div_max[a]),
+					std::min(e1 * div_min[a], e1 * div_max[a])));
+
+			float const x0 = exit_plane - origin_max[a];
+			float const x1 = exit_plane - origin_min[a];
+			t_exit = std::min(t_exit, std::max(
+					std::max(x0 * div_min[a], x0 * div_max[a]),
+					std::max(x1 * div_min[a], x1 * div_max[a])));
+		}
+		return t_enter > t_exit;
+	}
+
+	/*
+	 * Slab test of all rays against the box. Computes the same as
+	 * AABB::intersect with t_min = 0 and t_max = min_dist for every lane and
+	 * returns the mask of rays that hit.
+	 */
+	int
+	intersect(AABB const& aabb) const
+	{
+		int mask = 0;
+		for(int first = 0; first < size; first += 4) {
+			__m128 t_min = _mm_setzero_ps();
+			__m128 t_max = _mm_load_ps(min_dist + first);
+			__m128 t_min2[3], t_max2[3];
+			for(int a = 0; a < 3; a++) {
+				__m128 const o  = _mm_load_ps(origin[a] + first);
+				__m128 const d  = _mm_load_ps(div[a] + first);
+				__m128 const t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabb.min[a]), o), d);
+				__m128 const t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabb.max[a]), o), d);
+				/* operand order reproduces glm::min and glm::max for NaNs */
+				t_min2[a] = _mm_min_ps(t2, t1);
+				t_max2[a] = _mm_max_ps(t2, t1);
 			}
-			else { /* both children hit, order by first aabb intersection */
-				if(t_min_l < t_min_r) {
-					stack[stack_size++] = n.right;
-					stack[stack_size++] = n.left;
-				}
-				else {
-					stack[stack_size++] = n.left;
-					stack[stack_size++] = n.right;
+			t_min = _mm_max_ps(_mm_max_ps(t_min, t_min2[2]), _mm_max_ps(t_min2[1], t_min2[0]));
+			t_max = _mm_min_ps(_mm_min_ps(t_max, t_max2[2]), _mm_min_ps(t_max2[1], t_max2[0]));
+			mask |= _mm_movemask_ps(_mm_cmple_ps(t_min, t_max)) << first;
+		}
+		return mask;
+	}
+
+	/*
+	 * Intersect the rays in mask with triangle x, computing the same as
+	 * intersect_triangle for every lane, and keep the nearest hits.
+	 */
+	void
+	intersect_triangle(int mask, int x, glm::vec3 const& v0, glm::vec3 const& edge1, glm::vec3 const& edge2)
+	{
+		__m128 const zero = _mm_setzero_ps();
+		__m128 const one  = _mm_set1_ps(1.0f);
+
+		for(int first = 0; first < size; first += 4) {
+			if(!((mask >> first) & 0xf))
+				continue;
+
+			__m128 const dx = _mm_load_ps(direction[0] + first);
+			__m128 const dy = _mm_load_ps(direction[1] + first);
+			__m128 const dz = _mm_load_ps(direction[2] + first);
+			__m128 const e1x = _mm_set1_ps(edge1.x), e1y = _mm_set1_ps(edge1.y), e1z = _mm_set1_ps(edge1.z);
+			__m128 const e2x = _mm_set1_ps(edge2.x), e2y = _mm_set1_ps(edge2.y), e2z = _mm_set1_ps(edge2.z);
+
+			/* pvec = cross(direction, edge2) */
+			__m128 const px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+			__m128 const py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+			__m128 const pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+
+			__m128 const det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+			__m128 const inv_det = _mm_div_ps(one, det);
+
+			__m128 const tx = _mm_sub_ps(_mm_load_ps(origin[0] + first), _mm_set1_ps(v0.x));
+			__m128 const ty = _mm_sub_ps(_mm_load_ps(origin[1] + first), _mm_set1_ps(v0.y));
+			__m128 const tz = _mm_sub_ps(_mm_load_ps(origin[2] + first), _mm_set1_ps(v0.z));
+
+			__m128 const alpha = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+			/* qvec = cross(tvec, edge1) */
+			__m128 const qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+			__m128 const qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(e1z, tx));
+			__m128 const qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(e1x, ty));
+
+			__m128 const beta = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+			__m128 const t    = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+			__m128 hit = _mm_and_ps(_mm_cmple_ps(zero, alpha), _mm_cmpngt_ps(alpha, one));
+			hit = _mm_and_ps(hit, _mm_cmple_ps(zero, beta));
+			hit = _mm_and_ps(hit, _mm_cmpngt_ps(_mm_add_ps(alpha, beta), one));
+			hit = _mm_and_ps(hit, _mm_cmpnle_ps(t, zero));
+
+			int lanes = _mm_movemask_ps(hit) & (mask >> first) & 0xf;
+			if(!lanes)
+				continue;
+
+			alignas(16) float alpha_[4], beta_[4], t_[4];
+			_mm_store_ps(alpha_, alpha);
+			_mm_store_ps(beta_, beta);
+			_mm_store_ps(t_, t);
+			for(int l = 0; l < 4; l++) {
+				int const i = first + l;
+				if(!(lanes & (1 << l)) || nearest_triangle[i] == x)
+					continue;
+				if(t_[l] < min_dist[i] || nearest_triangle[i] == -1) {
+					min_dist[i]         = t_[l];
+					bary[i]             = glm::vec3(1.f - alpha_[l] - beta_[l], alpha_[l], beta_[l]);
+					nearest_triangle[i] = x;
 				}
 			}
 		}
 	}
+};
+
+void BVH::
+intersect_packet(Ray const rays[], int num_rays, HitRecord hits[], bool found[]) const
+{
+	for(int first = 0; first < num_rays; first += MAX_PACKET_SIZE) {
+		int const size = std::min(num_rays - first, int(MAX_PACKET_SIZE));
+
+		Ray rays_local[MAX_PACKET_SIZE];
+		for(int i = 0; i < size; i++)
+			rays_local[i] = transform_ray(rays[first + i], transform_world_to_object);
+
+		RayPacket packet(rays_local, size);
+		if(!flat_nodes.empty())
+			intersect_packet_local(packet);
+		else {
+			/* quantized trees have no binary nodes, trace the rays one by one */
+			for(int i = 0; i < size; i++)
+				intersect_local(rays_local[i], packet.min_dist[i], packet.bary[i], packet.nearest_triangle[i]);
+		}
 
-	if (isect && hit) {
-		triangle_soup.fill_intersection(isect, nearest_triangle, min_dist, bary);
+		for(int i = 0; i < size; i++) {
+			Ray const& ray = rays[first + i];
+			int const x = packet.nearest_triangle[i];
+			found[first + i] = x >= 0;
+			if(x < 0)
+				continue;
+
+			glm::vec3 const& bary = packet.bary[i];
+			glm::vec3 const position = world_position(x, bary, transform_object_to_world);
+			HitRecord &hit = hits[first + i];
+			hit.t = glm::length(ray.origin - position);
+			hit.primitive_id = uint32_t(x);
+			hit.instance_id = 0;
+			hit.bary = glm::vec2(bary.y, bary.z);
+		}
 	}
-	return hit;
 }
 
-bool BVH::
-intersect(Ray const& ray, Intersection* isect) const
+void BVH::
+intersect_packet_local(RayPacket &packet) const
 {
-	// transform ray in object space
-	const Ray ray_local = transform_ray(ray, transform_world_to_object);
-	Intersection isect_local;
-	if (intersect_local(ray_local, &isect_local)) {
-		if (isect) {
-			*isect = transform_intersection(isect_local, 
-				transform_object_to_world, transform_object_to_world_normal);
-			isect->t = glm::length(ray.origin-isect->position);
+	if(flat_nodes.empty())
+		return;
+
+	int stack[TRAVERSAL_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	BVHTraversalCounters *const counters = traversal_counters;
+
+	while(stack_size > 0) {
+		int const idx = stack[--stack_size];
+		const FlatNode &n = flat_nodes[idx];
+		if(counters)
+			counters->nodes_visited++;
+
+		if(packet.culls(n.aabb))
+			continue;
+		int const mask = packet.intersect(n.aabb);
+		if(!mask)
+			continue;
+
+		int num_active = 0;
+		for(int m = mask; m; m &= m - 1)
+			num_active++;
+		if(num_active < PACKET_MIN_ACTIVE_RAYS) { /* packet diverged, continue with single rays */
+			for(int i = 0; i < packet.size; i++) {
+				if(mask & (1 << i))
+					intersect_binary<false>(packet.rays[i], idx, packet.min_dist[i],
+							packet.bary[i], packet.nearest_triangle[i]);
+			}
+			continue;
+		}
+
+		if(n.num_triangles > 0) { /* leaf node, intersect triangles with all active rays */
+			if(counters)
+				counters->triangles_tested += uint64_t(num_active) * n.num_triangles;
+			for(int i = 0; i < n.num_triangles; i++) {
+				TriangleBlock const& b = triangle_blocks[n.offset + i / 4];
+				int const l = i % 4;
+				packet.intersect_triangle(mask, b.triangle_id[l],
+						glm::vec3(b.v0[0][l],    b.v0[1][l],    b.v0[2][l]),
+						glm::vec3(b.edge1[0][l], b.edge1[1][l], b.edge1[2][l]),
+						glm::vec3(b.edge2[0][l], b.edge2[1][l], b.edge2[2][l]));
+			}
+		}
+		else { /* visit the child first that lies in the direction of the packet */
+			int const left  = idx + 1;
+			int const right = n.offset;
+			glm::vec3 const d = flat_nodes[right].aabb.center() - flat_nodes[left].aabb.center();
+			if(glm::dot(d, packet.direction_sum) < 0.0f) {
+				stack[stack_size++] = left;
+				stack[stack_size++] = right;
+			}
+			else {
+				stack[stack_size++] = right;
+				stack[stack_size++] = left;
+			}
 		}
-		return true;
 	}
-	return false;
 }
 
 void BVH::
 sanity_checks()
 {
 	unsigned const num_nodes = static_cast<unsigned>(nodes.size());
+	unsigned const num_references = static_cast<unsigned>(triangle_indices.size());
+	cg_assert(build_mode == BVH_BUILD_SBVH
+		   ? num_references >= unsigned(triangle_soup.num_triangles)
+		   : num_references == unsigned(triangle_soup.num_triangles));
 	cg_assert((triangle_soup.num_triangles == 0 && num_nodes == 1)
-		   || num_nodes <= unsigned(2 * triangle_soup.num_triangles));
+		   || num_nodes <= 2 * num_references);
 
 	int sum_triangles = 0;
 	for(unsigned int i = 0; i < num_nodes; i++) {
@@ -129,14 +1559,15 @@ sanity_checks()
 		if(n.left == -1)
 			sum_triangles += n.num_triangles;
 	}
-	cg_assert(sum_triangles == triangle_soup.num_triangles);
+	cg_assert(sum_triangles == int(num_references));
 }
 
 void BVH::
-build_bvh(int node_idx, int first_triangle_idx, int num_triangles, int depth)
+build_bvh(std::vector<Node> &out, int node_idx, int first_triangle_idx, int num_triangles, int depth,
+		std::vector<BuildJob> *jobs, ThreadPool *thread_pool)
 {	
 	cg_assert(node_idx >= 0);
-	cg_assert(node_idx < int(nodes.size()));
+	cg_assert(node_idx < int(out.size()));
 
 	if (node_idx == 0 && num_triangles == 0)
 	{
@@ -145,119 +1576,687 @@ build_bvh(int node_idx, int first_triangle_idx, int num_triangles, int depth)
 	cg_assert(num_triangles > 0);
 	cg_assert(first_triangle_idx + num_triangles <= triangle_soup.num_triangles);
 
+	if(jobs && num_triangles <= PARALLEL_BUILD_JOB_TRIANGLES) {
+		BuildJob job;
+		job.node_idx           = node_idx;
+		job.first_triangle_idx = first_triangle_idx;
+		job.num_triangles      = num_triangles;
+		job.depth              = depth;
+		jobs->push_back(std::move(job));
+		return;
+	}
+
+	AABB aabb;
+	reduce_chunks(thread_pool, num_triangles, aabb, [&](AABB &a, int begin, int end) {
+			for(int i = begin; i < end; i++)
+				a.extend(triangle_aabbs[triangle_indices[first_triangle_idx + i]]);
+		}, merge_aabb);
+
+	out[node_idx].aabb          = aabb;
+	out[node_idx].triangle_idx  = first_triangle_idx;
+	out[node_idx].num_triangles = num_triangles;
+
+	int nt = 0;
+	if(depth >= MAX_DEPTH)
+		nt = 0;
+	else if(build_mode == BVH_BUILD_SAH && !near_depth_limit(depth, num_triangles))
+		nt = split_sah(first_triangle_idx, num_triangles, aabb, thread_pool);
+	else
+		nt = split_median(first_triangle_idx, num_triangles, depth);
+
+	if(nt == 0) { /* leaf node */
+		out[node_idx].left  = -1;
+		out[node_idx].right = -1;
+		return;
+	}
+	cg_assert(nt > 0 && nt < num_triangles);
+
+	int const num_nodes = static_cast<int>(out.size());
+	out[node_idx].left  = num_nodes + 0;
+	out[node_idx].right = num_nodes + 1;
+	out.push_back(Node());
+	out.push_back(Node());
+	build_bvh(out, out[node_idx].left, first_triangle_idx, nt, depth + 1, jobs, thread_pool);
+	build_bvh(out, out[node_idx].right, first_triangle_idx + nt, num_triangles - nt, depth + 1, jobs, thread_pool);
+}
+
+int BVH::
+split_median(int first_triangle_idx, int num_triangles, int depth)
+{
+	if(num_triangles <= MAX_TRIANGLES_IN_LEAF)
+		return 0;
+
 	int axis = depth % 3; /* split axis */
-	if(num_triangles <= MAX_TRIANGLES_IN_LEAF) {
-		nodes[node_idx].left          = -1;
-		nodes[node_idx].right         = -1;
-		nodes[node_idx].triangle_idx  = first_triangle_idx;
-		nodes[node_idx].num_triangles = num_triangles;
-		for(int i = 0; i < num_triangles; i++) {
-			int tidx = triangle_indices[first_triangle_idx + i];
-			for(int j = 0; j < 3; j++)
-				nodes[node_idx].aabb.extend(triangle_soup.vertices[tidx * 3 + j]);
+	std::nth_element(
+			triangle_indices.begin() + first_triangle_idx,
+			triangle_indices.begin() + first_triangle_idx + num_triangles / 2,
+			triangle_indices.begin() + first_triangle_idx + num_triangles,
+			[&](int l, int r) -> bool {
+				auto &v = triangle_soup.vertices;
+				float min_l, min_r, max_l, max_r;
+				min_l = min_r =  FLT_MAX;
+				max_l = max_r = -FLT_MAX;
+				for(int i = 0; i < 3; i++) {
+					min_l = std::min(min_l, v[l * 3 + i][axis]);
+					max_l = std::max(max_l, v[l * 3 + i][axis]);
+					min_r = std::min(min_r, v[r * 3 + i][axis]);
+					max_r = std::max(max_r, v[r * 3 + i][axis]);
+				}
+				return min_l + max_l < min_r + max_r;
+			});
+	return num_triangles / 2;
+}
+
+int BVH::
+split_sah(int first_triangle_idx, int num_triangles, AABB const& aabb, ThreadPool *thread_pool)
+{
+	if(num_triangles <= MAX_TRIANGLES_IN_LEAF)
+		return 0;
+
+	auto const begin = triangle_indices.begin() + first_triangle_idx;
+	auto const end   = begin + num_triangles;
+	int const chunks = num_chunks(num_triangles);
+
+	/* bin triangles by the centers of their bounding boxes */
+	AABB centroids;
+	reduce_chunks(thread_pool, num_triangles, centroids, [&](AABB &a, int b, int e) {
+			for(auto it = begin + b; it != begin + e; ++it) {
+				glm::vec3 const center = triangle_aabbs[*it].center();
+				a.min = glm::min(a.min, center);
+				a.max = glm::max(a.max, center);
+			}
+		}, merge_aabb);
+	glm::vec3 const centroid_min = centroids.min;
+	glm::vec3 const centroid_max = centroids.max;
+
+	auto bin_index = [&](int tidx, int axis) -> int {
+		float const extent = centroid_max[axis] - centroid_min[axis];
+		float const rel = (triangle_aabbs[tidx].center()[axis] - centroid_min[axis]) / extent;
+		return std::min(int(rel * float(SAH_NUM_BINS)), SAH_NUM_BINS - 1);
+	};
+
+	struct Bins {
+		AABB aabb[3][SAH_NUM_BINS];
+		int  count[3][SAH_NUM_BINS];
+	};
+	Bins bins;
+	std::fill(&bins.count[0][0], &bins.count[0][0] + 3 * SAH_NUM_BINS, 0);
+	reduce_chunks(thread_pool, num_triangles, bins, [&](Bins &bins_, int b, int e) {
+			for(int axis = 0; axis < 3; axis++) {
+				if(!(centroid_max[axis] > centroid_min[axis]))
+					continue;
+				for(auto it = begin + b; it != begin + e; ++it) {
+					int const bin = bin_index(*it, axis);
+					bins_.aabb[axis][bin].extend(triangle_aabbs[*it]);
+					bins_.count[axis][bin]++;
+				}
+			}
+		}, [](Bins &bins_, Bins const& other) {
+			for(int axis = 0; axis < 3; axis++) {
+				for(int bin = 0; bin < SAH_NUM_BINS; bin++) {
+					bins_.aabb[axis][bin].extend(other.aabb[axis][bin]);
+					bins_.count[axis][bin] += other.count[axis][bin];
+				}
+			}
+		});
+
+	float best_cost = FLT_MAX;
+	int   best_axis = -1;
+	int   best_bin  = -1;
+	for(int axis = 0; axis < 3; axis++) {
+		if(!(centroid_max[axis] > centroid_min[axis]))
+			continue;
+
+		/* sweep from the right to get the cost of every right-hand side ... */
+		float right_area[SAH_NUM_BINS];
+		int   right_count[SAH_NUM_BINS];
+		AABB  acc;
+		int   count = 0;
+		for(int b = SAH_NUM_BINS - 1; b > 0; b--) {
+			acc.extend(bins.aabb[axis][b]);
+			count += bins.count[axis][b];
+			right_area[b]  = acc.surface_area();
+			right_count[b] = count;
+		}
+
+		/* ... and from the left to evaluate the split after bin b */
+		acc   = AABB();
+		count = 0;
+		for(int b = 0; b < SAH_NUM_BINS - 1; b++) {
+			acc.extend(bins.aabb[axis][b]);
+			count += bins.count[axis][b];
+			if(count == 0 || right_count[b + 1] == 0)
+				continue;
+			float const cost = float(count) * acc.surface_area()
+				+ float(right_count[b + 1]) * right_area[b + 1];
+			if(cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin  = b;
+			}
 		}
 	}
-	else {
-		std::nth_element(
-				triangle_indices.begin() + first_triangle_idx,
-				triangle_indices.begin() + first_triangle_idx + num_triangles / 2,
-				triangle_indices.begin() + first_triangle_idx + num_triangles,
-				[&](int l, int r) -> bool {
-					auto &v = triangle_soup.vertices;
-					float min_l, min_r, max_l, max_r;
-					min_l = min_r =  FLT_MAX;
-					max_l = max_r = -FLT_MAX;
-					for(int i = 0; i < 3; i++) {
-						min_l = std::min(min_l, v[l * 3 + i][axis]);
-						max_l = std::max(max_l, v[l * 3 + i][axis]);
-						min_r = std::min(min_r, v[r * 3 + i][axis]);
-						max_r = std::max(max_r, v[r * 3 + i][axis]);
-					}
-					return min_l + max_l < min_r + max_r;
-				});
-		int const num_nodes = static_cast<int>(nodes.size());
-		nodes[node_idx].left  = num_nodes + 0;
-		nodes[node_idx].right = num_nodes + 1;
-		nodes.push_back(Node());
-		nodes.push_back(Node());
-		nodes[node_idx].triangle_idx = first_triangle_idx;
-		nodes[node_idx].num_triangles = num_triangles;
-		int nt = num_triangles / 2;
-		build_bvh(nodes[node_idx].left, first_triangle_idx, nt, depth + 1);
-		build_bvh(nodes[node_idx].right, first_triangle_idx + nt, num_triangles - nt, depth + 1);
 
-		Node &nl = nodes[nodes[node_idx].left];
-		Node &nr = nodes[nodes[node_idx].right];
+	if(best_axis < 0) {
+		/* all centers coincide, no split can separate them */
+		return num_triangles <= SAH_MAX_TRIANGLES_IN_LEAF ? 0 : num_triangles / 2;
+	}
+
+	float const area = aabb.surface_area();
+	float const split_cost = SAH_TRAVERSAL_COST
+		+ SAH_INTERSECTION_COST * best_cost / std::max(area, FLT_MIN);
+	float const leaf_cost = SAH_INTERSECTION_COST * float(num_triangles);
+	if(num_triangles <= SAH_MAX_TRIANGLES_IN_LEAF && leaf_cost <= split_cost)
+		return 0;
+
+	auto goes_left = [&](int tidx) -> bool {
+		return bin_index(tidx, best_axis) <= best_bin;
+	};
+
+	if(!thread_pool || chunks == 1) {
+		return static_cast<int>(std::stable_partition(begin, end, goes_left) - begin);
+	}
 
-		nodes[node_idx].aabb.min = glm::min(nl.aabb.min, nr.aabb.min);
-		nodes[node_idx].aabb.max = glm::max(nl.aabb.max, nr.aabb.max);
+	/* stable partition in parallel: count per chunk, then scatter */
+	std::vector<int> chunk_left(chunks, 0);
+	for_each_chunk(thread_pool, num_triangles, [&](int c, int b, int e) {
+			chunk_left[c] = static_cast<int>(std::count_if(begin + b, begin + e, goes_left));
+		});
+	std::vector<int> left_offset(chunks), right_offset(chunks);
+	int num_left = 0;
+	for(int c = 0; c < chunks; c++) {
+		left_offset[c] = num_left;
+		num_left += chunk_left[c];
 	}
+	for(int c = 0, num_right = 0; c < chunks; c++) {
+		right_offset[c] = num_left + num_right;
+		num_right += std::min(num_triangles, (c + 1) * PARALLEL_BUILD_CHUNK) - c * PARALLEL_BUILD_CHUNK - chunk_left[c];
+	}
+	std::vector<int> partitioned(num_triangles);
+	for_each_chunk(thread_pool, num_triangles, [&](int c, int b, int e) {
+			int l = left_offset[c], r = right_offset[c];
+			for(auto it = begin + b; it != begin + e; ++it)
+				partitioned[goes_left(*it) ? l++ : r++] = *it;
+		});
+	for_each_chunk(thread_pool, num_triangles, [&](int, int b, int e) {
+			std::copy(partitioned.begin() + b, partitioned.begin() + e, begin + b);
+		});
+	return num_left;
 }
 
-glm::vec3 BVH::
-intersect_count(const Ray &ray, int idx, int depth)
+void BVH::
+build_lbvh(ThreadPool *thread_pool)
 {
-	Ray ray_local = ray;
-	if (depth == 0)
-		ray_local = transform_ray(ray, transform_world_to_object);
+	int const num_triangles = triangle_soup.num_triangles;
+
+	AABB centroids;
+	reduce_chunks(thread_pool, num_triangles, centroids, [&](AABB &a, int begin, int end) {
+			for(int i = begin; i < end; i++) {
+				glm::vec3 const center = triangle_aabbs[i].center();
+				a.min = glm::min(a.min, center);
+				a.max = glm::max(a.max, center);
+			}
+		}, merge_aabb);
+	glm::vec3 const extent = centroids.max - centroids.min;
+	glm::vec3 const scale(
+		extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+		extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+		extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+	std::vector<uint32_t> codes(num_triangles);
+	for_each_chunk(thread_pool, num_triangles, [&](int, int begin, int end) {
+			for(int i = begin; i < end; i++) {
+				codes[i] = morton_code((triangle_aabbs[i].center() - centroids.min) * scale);
+				triangle_indices[i] = i;
+			}
+		});
+	radix_sort(thread_pool, codes, triangle_indices);
+
+	nodes.assign(1, Node());
+	emit_lbvh(0, 0, num_triangles, 0, codes);
+	fit_bounds(thread_pool);
+}
+
+void BVH::
+emit_lbvh(int node_idx, int first_triangle_idx, int num_triangles, int depth,
+		std::vector<uint32_t> const& codes)
+{
+	nodes[node_idx].triangle_idx  = first_triangle_idx;
+	nodes[node_idx].num_triangles = num_triangles;
+	if(num_triangles <= MAX_TRIANGLES_IN_LEAF || depth >= MAX_DEPTH)
+		return;
+
+	/*
+	 * The codes are sorted, so the first code that has the highest
+	 * differing bit set is found by binary search. Identical codes, and
+	 * all codes close to the depth limit, are split in the middle.
+	 */
+	int nt = num_triangles / 2;
+	uint32_t const first_code = codes[first_triangle_idx];
+	uint32_t const last_code  = codes[first_triangle_idx + num_triangles - 1];
+	if(first_code != last_code && !near_depth_limit(depth, num_triangles)) {
+		uint32_t bit = 1u << 31;
+		while(!((first_code ^ last_code) & bit))
+			bit >>= 1;
+		auto const begin = codes.begin() + first_triangle_idx;
+		nt = static_cast<int>(std::partition_point(begin, begin + num_triangles,
+				[&](uint32_t code) { return !(code & bit); }) - begin);
+	}
+	cg_assert(nt > 0 && nt < num_triangles);
+
+	int const num_nodes = static_cast<int>(nodes.size());
+	nodes[node_idx].left  = num_nodes + 0;
+	nodes[node_idx].right = num_nodes + 1;
+	nodes.push_back(Node());
+	nodes.push_back(Node());
+	emit_lbvh(num_nodes + 0, first_triangle_idx, nt, depth + 1, codes);
+	emit_lbvh(num_nodes + 1, first_triangle_idx + nt, num_triangles - nt, depth + 1, codes);
+}
+
+/*
+ * Split the part of triangle v that lies in bounds at the plane
+ * x[axis] = pos into the bounds of the parts on either side. A part is
+ * invalid if the triangle does not reach that side.
+ */
+static void
+split_reference(glm::vec3 const v[3], AABB const& bounds, int axis, float pos,
+		AABB &left, AABB &right)
+{
+	left = right = AABB();
+	for(int i = 0; i < 3; i++) {
+		glm::vec3 const& a = v[i];
+		glm::vec3 const& b = v[(i + 1) % 3];
+		if(a[axis] <= pos)
+			left.extend(a);
+		if(a[axis] >= pos)
+			right.extend(a);
+		if((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos)) {
+			float const t = glm::clamp((pos - a[axis]) / (b[axis] - a[axis]), 0.0f, 1.0f);
+			glm::vec3 p = glm::mix(a, b, t);
+			p[axis] = pos;
+			left.extend(p);
+			right.extend(p);
+		}
+	}
+	left.min  = glm::max(left.min,  bounds.min);
+	left.max  = glm::min(left.max,  bounds.max);
+	right.min = glm::max(right.min, bounds.min);
+	right.max = glm::min(right.max, bounds.max);
+}
+
+void BVH::
+build_sbvh(std::vector<Node> &out, int node_idx, std::vector<Reference> &&refs, int depth,
+		float root_area, int &duplication_budget)
+{
+	cg_assert(node_idx >= 0 && node_idx < int(out.size()));
+	cg_assert(depth <= MAX_DEPTH);
+	cg_assert(!refs.empty());
+
+	int const num_refs = static_cast<int>(refs.size());
+	AABB aabb;
+	glm::vec3 centroid_min( FLT_MAX);
+	glm::vec3 centroid_max(-FLT_MAX);
+	for(auto const& r: refs) {
+		aabb.extend(r.aabb);
+		centroid_min = glm::min(centroid_min, r.aabb.center());
+		centroid_max = glm::max(centroid_max, r.aabb.center());
+	}
+	out[node_idx].aabb          = aabb;
+	out[node_idx].triangle_idx  = static_cast<int>(triangle_indices.size());
+	out[node_idx].num_triangles = num_refs;
+
+	auto make_leaf = [&]() {
+		for(auto const& r: refs)
+			triangle_indices.push_back(r.triangle);
+		out[node_idx].left  = -1;
+		out[node_idx].right = -1;
+	};
+	if(num_refs <= MAX_TRIANGLES_IN_LEAF || depth >= MAX_DEPTH) {
+		make_leaf();
+		return;
+	}
+
+	/* close to the depth limit, the references are halved below */
+	bool const halve = near_depth_limit(depth, num_refs);
+
+	/* object split: binned SAH over the centers of the references */
+	auto object_bin = [&](Reference const& r, int axis) -> int {
+		float const extent = centroid_max[axis] - centroid_min[axis];
+		float const rel = (r.aabb.center()[axis] - centroid_min[axis]) / extent;
+		return std::min(int(rel * float(SAH_NUM_BINS)), SAH_NUM_BINS - 1);
+	};
+
+	float best_object_cost = FLT_MAX;
+	int   best_object_axis = -1;
+	int   best_object_bin  = -1;
+	AABB  best_object_left, best_object_right;
+	for(int axis = 0; !halve && axis < 3; axis++) {
+		if(!(centroid_max[axis] > centroid_min[axis]))
+			continue;
+
+		AABB bin_aabb[SAH_NUM_BINS];
+		int  bin_count[SAH_NUM_BINS] = {};
+		for(auto const& r: refs) {
+			int const bin = object_bin(r, axis);
+			bin_aabb[bin].extend(r.aabb);
+			bin_count[bin]++;
+		}
+
+		AABB right_aabb[SAH_NUM_BINS];
+		int  right_count[SAH_NUM_BINS];
+		AABB acc;
+		int  count = 0;
+		for(int b = SAH_NUM_BINS - 1; b > 0; b--) {
+			acc.extend(bin_aabb[b]);
+			count += bin_count[b];
+			right_aabb[b]  = acc;
+			right_count[b] = count;
+		}
+
+		acc   = AABB();
+		count = 0;
+		for(int b = 0; b < SAH_NUM_BINS - 1; b++) {
+			acc.extend(bin_aabb[b]);
+			count += bin_count[b];
+			if(count == 0 || right_count[b + 1] == 0)
+				continue;
+			float const cost = float(count) * acc.surface_area()
+				+ float(right_count[b + 1]) * right_aabb[b + 1].surface_area();
+			if(cost < best_object_cost) {
+				best_object_cost  = cost;
+				best_object_axis  = axis;
+				best_object_bin   = b;
+				best_object_left  = acc;
+				best_object_right = right_aabb[b + 1];
+			}
+		}
+	}
+
+	/* spatial split: bin the clipped references into slabs of the node */
+	float best_spatial_cost = FLT_MAX;
+	int   best_spatial_axis = -1;
+	int   best_spatial_bin  = -1;
+	int   best_spatial_duplicates = 0;
+	AABB overlap;
+	overlap.min = glm::max(best_object_left.min, best_object_right.min);
+	overlap.max = glm::min(best_object_left.max, best_object_right.max);
+	bool const try_spatial = !halve && duplication_budget > 0
+		&& (best_object_axis < 0 || overlap.surface_area() > SBVH_OVERLAP_THRESHOLD * root_area);
 
-	glm::vec3 colors[5] = {
+	auto spatial_bin = [&](float x, int axis) -> int {
+		float const extent = aabb.max[axis] - aabb.min[axis];
+		int const bin = int((x - aabb.min[axis]) / extent * float(SAH_NUM_BINS));
+		return std::max(0, std::min(bin, SAH_NUM_BINS - 1));
+	};
+	auto spatial_plane = [&](int bin, int axis) -> float {
+		float const extent = aabb.max[axis] - aabb.min[axis];
+		return aabb.min[axis] + extent * float(bin + 1) / float(SAH_NUM_BINS);
+	};
+
+	for(int axis = 0; try_spatial && axis < 3; axis++) {
+		if(!(aabb.max[axis] > aabb.min[axis]))
+			continue;
+
+		AABB bin_aabb[SAH_NUM_BINS];
+		int  bin_enter[SAH_NUM_BINS] = {};
+		int  bin_exit[SAH_NUM_BINS]  = {};
+		for(auto const& r: refs) {
+			int const first = spatial_bin(r.aabb.min[axis], axis);
+			int const last  = std::max(first, spatial_bin(r.aabb.max[axis], axis));
+			AABB part = r.aabb;
+			for(int b = first; b < last; b++) {
+				AABB left, right;
+				split_reference(&triangle_soup.vertices[r.triangle * 3], part, axis,
+						spatial_plane(b, axis), left, right);
+				bin_aabb[b].extend(left);
+				part = right;
+			}
+			bin_aabb[last].extend(part);
+			bin_enter[first]++;
+			bin_exit[last]++;
+		}
+
+		float right_area[SAH_NUM_BINS];
+		int   right_count[SAH_NUM_BINS];
+		AABB  acc;
+		int   count = 0;
+		for(int b = SAH_NUM_BINS - 1; b > 0; b--) {
+			acc.extend(bin_aabb[b]);
+			count += bin_exit[b];
+			right_area[b]  = acc.surface_area();
+			right_count[b] = count;
+		}
+
+		acc   = AABB();
+		count = 0;
+		for(int b = 0; b < SAH_NUM_BINS - 1; b++) {
+			acc.extend(bin_aabb[b]);
+			count += bin_enter[b];
+			int const duplicates = count + right_count[b + 1] - num_refs;
+			if(count == 0 || right_count[b + 1] == 0 || duplicates > duplication_budget)
+				continue;
+			float const cost = float(count) * acc.surface_area()
+				+ float(right_count[b + 1]) * right_area[b + 1];
+			if(cost < best_spatial_cost) {
+				best_spatial_cost       = cost;
+				best_spatial_axis       = axis;
+				best_spatial_bin        = b;
+				best_spatial_duplicates = duplicates;
+			}
+		}
+	}
+
+	float const best_cost = std::min(best_object_cost, best_spatial_cost);
+	if(halve) {
+		/* at the object median along the longest axis of the centers */
+		glm::vec3 const extent = centroid_max - centroid_min;
+		int const axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+		std::nth_element(refs.begin(), refs.begin() + num_refs / 2, refs.end(),
+				[&](Reference const& l, Reference const& r) {
+					return l.aabb.center()[axis] < r.aabb.center()[axis];
+				});
+	}
+	else if(best_object_axis < 0 && best_spatial_axis < 0) {
+		/* all references coincide, no split can separate them */
+		if(num_refs <= SAH_MAX_TRIANGLES_IN_LEAF) {
+			make_leaf();
+			return;
+		}
+	}
+	else {
+		float const split_cost = SAH_TRAVERSAL_COST
+			+ SAH_INTERSECTION_COST * best_cost / std::max(aabb.surface_area(), FLT_MIN);
+		float const leaf_cost = SAH_INTERSECTION_COST * float(num_refs);
+		if(num_refs <= SAH_MAX_TRIANGLES_IN_LEAF && leaf_cost <= split_cost) {
+			make_leaf();
+			return;
+		}
+	}
+
+	std::vector<Reference> left_refs, right_refs;
+	if(best_spatial_axis >= 0 && best_spatial_cost < best_object_cost) {
+		int const axis = best_spatial_axis;
+		float const pos = spatial_plane(best_spatial_bin, axis);
+
+		/* references that lie on one side stay whole ... */
+		std::vector<Reference> straddling;
+		AABB left_aabb, right_aabb;
+		for(auto const& r: refs) {
+			int const first = spatial_bin(r.aabb.min[axis], axis);
+			int const last  = std::max(first, spatial_bin(r.aabb.max[axis], axis));
+			if(last <= best_spatial_bin) {
+				left_refs.push_back(r);
+				left_aabb.extend(r.aabb);
+			}
+			else if(first > best_spatial_bin) {
+				right_refs.push_back(r);
+				right_aabb.extend(r.aabb);
+			}
+			else
+				straddling.push_back(r);
+		}
+
+		/*
+		 * ... the others are split, unless moving them to one side as a whole
+		 * is cheaper (reference unsplitting)
+		 */
+		for(auto const& r: straddling) {
+			AABB left, right;
+			split_reference(&triangle_soup.vertices[r.triangle * 3], r.aabb, axis, pos, left, right);
+			float const num_left  = float(left_refs.size());
+			float const num_right = float(right_refs.size());
+			AABB left_all = left_aabb, right_all = right_aabb;
+			AABB left_split = left_aabb, right_split = right_aabb;
+			left_all.extend(r.aabb);
+			right_all.extend(r.aabb);
+			left_split.extend(left);
+			right_split.extend(right);
+			float const cost_split = left_split.surface_area() * (num_left + 1.0f)
+				+ right_split.surface_area() * (num_right + 1.0f);
+			float const cost_left  = left_all.surface_area() * (num_left + 1.0f)
+				+ right_aabb.surface_area() * num_right;
+			float const cost_right = left_aabb.surface_area() * num_left
+				+ right_all.surface_area() * (num_right + 1.0f);
+
+			if(!right.is_valid() || (left.is_valid() && cost_left < std::min(cost_split, cost_right))) {
+				left_refs.push_back(r);
+				left_aabb = left_all;
+			}
+			else if(!left.is_valid() || cost_right < cost_split) {
+				right_refs.push_back(r);
+				right_aabb = right_all;
+			}
+			else {
+				left_refs.push_back(Reference { left, r.triangle });
+				right_refs.push_back(Reference { right, r.triangle });
+				left_aabb  = left_split;
+				right_aabb = right_split;
+			}
+		}
+		cg_assert(int(left_refs.size() + right_refs.size()) - num_refs <= best_spatial_duplicates);
+	}
+	else if(best_object_axis >= 0) {
+		for(auto const& r: refs) {
+			if(object_bin(r, best_object_axis) <= best_object_bin)
+				left_refs.push_back(r);
+			else
+				right_refs.push_back(r);
+		}
+	}
+
+	if(left_refs.empty() || right_refs.empty()) {
+		/* no usable split, halve the references */
+		left_refs.assign(refs.begin(), refs.begin() + num_refs / 2);
+		right_refs.assign(refs.begin() + num_refs / 2, refs.end());
+	}
+	duplication_budget -= int(left_refs.size() + right_refs.size()) - num_refs;
+	std::vector<Reference>().swap(refs);
+
+	int const num_nodes = static_cast<int>(out.size());
+	out[node_idx].left  = num_nodes + 0;
+	out[node_idx].right = num_nodes + 1;
+	out.push_back(Node());
+	out.push_back(Node());
+	build_sbvh(out, num_nodes + 0, std::move(left_refs), depth + 1, root_area, duplication_budget);
+	build_sbvh(out, num_nodes + 1, std::move(right_refs), depth + 1, root_area, duplication_budget);
+
+	/* the leaves below this node were appended to triangle_indices */
+	out[node_idx].num_triangles = static_cast<int>(triangle_indices.size()) - out[node_idx].triangle_idx;
+}
+
+/*
+ * The color intersect_count adds for an AABB at the given depth.
+ */
+static glm::vec3
+depth_color(int depth)
+{
+	static glm::vec3 const colors[5] = {
 		glm::vec3(1.0, 0.0, 0.0),
 		glm::vec3(0.0, 1.0, 0.0),
 		glm::vec3(0.0, 0.0, 1.0),
 		glm::vec3(1.0, 0.0, 1.0),
 		glm::vec3(0.0, 1.0, 1.0),
 	};
-	const Node &n = nodes[idx];
+	return colors[depth % 5];
+}
+
+/*
+ * intersect_count for collapsed nodes, whose children are tested together.
+ */
+template <int N, class WideNodes>
+static glm::vec3
+intersect_count_wide(WideNodes const& wide_nodes, WideRay const& r, int idx, int depth)
+{
+	if(wide_nodes.empty())
+		return glm::vec3(0.0f);
+
+	auto const& n = wide_nodes[idx];
+	float t_near[N];
+	int const mask = intersect_children(n, r, FLT_MAX, t_near);
+	glm::vec3 color(0.0f);
+	for(int i = 0; i < N; i++) {
+		if(!(mask & (1 << i)))
+			continue;
+		color += depth_color(depth);
+		if(n.num_triangles[i] == 0)
+			color += intersect_count_wide<N>(wide_nodes, r, n.offset[i], depth + 1);
+	}
+	return color;
+}
+
+glm::vec3 BVH::
+intersect_count(const Ray &ray, int idx, int depth)
+{
+	Ray ray_local = ray;
+	if (depth == 0)
+		ray_local = transform_ray(ray, transform_world_to_object);
+
+	/* count the AABBs of the tree that is traversed */
+	if(depth == 0 && node_width != BVH_BINARY) {
+		WideRay const r(ray_local);
+		switch(node_width) {
+		case BVH_WIDE_4:      return intersect_count_wide<4>(wide4_nodes, r, 0, 0);
+		case BVH_WIDE_8:      return intersect_count_wide<8>(wide8_nodes, r, 0, 0);
+		case BVH_QUANTIZED_4: return intersect_count_wide<4>(quantized4_nodes, r, 0, 0);
+		default:              return intersect_count_wide<8>(quantized8_nodes, r, 0, 0);
+		}
+	}
+
+	if(flat_nodes.empty())
+		return glm::vec3(0.0f);
+
+	const FlatNode &n = flat_nodes[idx];
 	float t_min = 0.0;
 	float t_max = FLT_MAX;
 
 	if(!n.aabb.intersect(ray_local, t_min, t_max))
 		return glm::vec3(0.0f);
 
-	if(n.left < 0) {
-		return colors[depth % 5];
+	if(n.num_triangles > 0) {
+		return depth_color(depth);
 	}
 	else {
-		return colors[depth % 5]
-			+ intersect_count(ray_local, n.left,  depth + 1)
-			+ intersect_count(ray_local, n.right, depth + 1);
+		return depth_color(depth)
+			+ intersect_count(ray_local, idx + 1,  depth + 1)
+			+ intersect_count(ray_local, n.offset, depth + 1);
 	}
 }
 
 void BVH::
 compute_shading_info(Intersection* isect) {
 	cg_assert(isect);
-	auto &material_ = triangle_soup.materials[triangle_soup.material_ids[isect->primitive_id]];
-	isect->material.evaluate(material_, *isect);
+	isect->material.evaluate(get_material(isect->primitive_id), *isect);
 }
 
 void BVH::
 compute_shading_info(const Ray rays[4], Intersection* isect) {
 	cg_assert(isect);
-	glm::vec2 uv_min = glm::vec2( std::numeric_limits<float>::max());
-	glm::vec2 uv_max = glm::vec2(-std::numeric_limits<float>::max());
-	auto t_id = isect->primitive_id;
-	cg_assert(t_id < unsigned(triangle_soup.num_triangles));
-	for(int i = 0; i < 4; i++) {
-		glm::vec3 b = glm::vec3(0.0f);
-		float d;
-		intersect_triangle<false>(rays[i].origin, rays[i].direction,
-				triangle_soup.vertices[t_id * 3 + 0],
-				triangle_soup.vertices[t_id * 3 + 1],
-				triangle_soup.vertices[t_id * 3 + 2],
-				b, d);
-
-		glm::vec2 uv = interpolate_barycentric(
-				triangle_soup.tex_coordinates[t_id * 3 + 0],
-				triangle_soup.tex_coordinates[t_id * 3 + 1],
-				triangle_soup.tex_coordinates[t_id * 3 + 2], b);
-
-		uv_min = glm::min(uv_min, uv);
-		uv_max = glm::max(uv_max, uv);
-	}
-
-	isect->dudv = glm::abs(uv_max - uv_min);
-	auto &material_ = triangle_soup.materials[triangle_soup.material_ids[isect->primitive_id]];
-	isect->material.evaluate(material_, *isect);
+	isect->dudv = triangle_soup.compute_uv_footprint(rays, isect->primitive_id);
+	isect->material.evaluate(get_material(isect->primitive_id), *isect);
+}
+
+Material const& BVH::
+get_material(uint32_t triangle) const
+{
+	return triangle_soup.materials[triangle_soup.material_ids[triangle]];
 }
@@ -0,0 +1,465 @@
+#include <cglib/rt/bvh_cache.h>
+#include <cglib/rt/triangle_soup.h>
+
+#include <cglib/core/assert.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Increment whenever the file layout or the builder changes in a way that
+ * invalidates existing cache files.
+ */
+static const uint64_t BVH_CACHE_VERSION = 5;
+
+static const char BVH_CACHE_MAGIC[8] = { 'C', 'G', 'B', 'V', 'H', 'C', 'A', 'C' };
+
+namespace {
+
+/*
+ * A read-only memory mapping of a whole file. data() is nullptr if the file
+ * could not be opened or is empty.
+ */
+class MappedFile
+{
+public:
+	explicit MappedFile(std::string const& path)
+	{
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+			return;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping)
+			return;
+		void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!p)
+			return;
+		ptr = static_cast<char const*>(p);
+		length = size_t(file_size.QuadPart);
+#else
+		int const fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				ptr = static_cast<char const*>(p);
+				length = size_t(st.st_size);
+			}
+		}
+		close(fd);
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (ptr)
+			UnmapViewOfFile(ptr);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+#else
+		if (ptr)
+			munmap(const_cast<char*>(ptr), length);
+#endif
+	}
+
+	MappedFile(MappedFile const&) = delete;
+	MappedFile& operator=(MappedFile const&) = delete;
+
+	char const* data() const { return ptr; }
+	size_t size() const { return length; }
+
+private:
+	char const* ptr = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+/*
+ * 64 bit FNV-1a hash.
+ */
+struct Hash
+{
+	uint64_t value = 14695981039346656037ull;
+
+	void add(void const* data, size_t size)
+	{
+		unsigned char const* p = static_cast<unsigned char const*>(data);
+		for (size_t i = 0; i < size; i++) {
+			value ^= p[i];
+			value *= 1099511628211ull;
+		}
+	}
+
+	template <class T>
+	void add(T const& v)
+	{
+		add(&v, sizeof(T));
+	}
+};
+
+/*
+ * Hash of the contents of a file, the same for a missing and an empty file.
+ */
+uint64_t
+file_hash(std::string const& path)
+{
+	Hash hash;
+	MappedFile file(path);
+	if (file.data())
+		hash.add(file.data(), file.size());
+	return hash.value;
+}
+
+struct CacheHeader
+{
+	char     magic[8];
+	uint64_t key;
+	uint64_t num_dependencies;
+	uint64_t num_triangles;
+	uint64_t num_references; /* entries of BVH::triangle_indices */
+	uint64_t num_materials;
+	uint64_t num_nodes;      /* entries of BVH::flat_nodes */
+	uint64_t string_bytes;
+};
+
+/*
+ * An MTL file the OBJ file references, its path is a range in the string
+ * table.
+ */
+struct CacheDependency
+{
+	uint32_t path_offset, path_length;
+	uint64_t hash;
+};
+
+/*
+ * A material of the soup, texture paths are ranges in the string table.
+ */
+struct CacheMaterial
+{
+	uint32_t map_kd_offset, map_kd_length;
+	uint32_t map_ks_offset, map_ks_length;
+	float diffuse[3];
+	float specular[3];
+	float shininess;
+};
+
+/*
+ * Hash the contents of the OBJ file and the builder settings. The MTL
+ * files are only known after parsing the OBJ file, they are stored as
+ * dependencies in the cache file instead. Returns false if the OBJ file
+ * does not exist or is empty.
+ */
+bool
+cache_key(std::string const& obj_path, BVHBuildMode build_mode, uint64_t *key)
+{
+	MappedFile obj(obj_path);
+	if (!obj.data())
+		return false;
+
+	Hash hash;
+	hash.add(BVH_CACHE_VERSION);
+	hash.add(int32_t(build_mode));
+	hash.add(int32_t(BVH::MAX_TRIANGLES_IN_LEAF));
+	hash.add(int32_t(BVH::MAX_DEPTH));
+	hash.add(int32_t(BVH::SAH_NUM_BINS));
+	hash.add(int32_t(BVH::SAH_MAX_TRIANGLES_IN_LEAF));
+	hash.add(float(BVH::SAH_TRAVERSAL_COST));
+	hash.add(float(BVH::SAH_INTERSECTION_COST));
+	hash.add(float(BVH::SBVH_OVERLAP_THRESHOLD));
+	hash.add(float(BVH::SBVH_MAX_DUPLICATION));
+	hash.add(uint64_t(sizeof(BVH::FlatNode)));
+	hash.add(obj.data(), obj.size());
+
+	*key = hash.value;
+	return true;
+}
+
+/*
+ * Paths of the MTL files referenced by an OBJ file, resolved relative to
+ * the OBJ file like OBJFile does.
+ */
+std::vector<std::string>
+mtl_paths(std::string const& obj_path)
+{
+	std::vector<std::string> paths;
+	MappedFile obj(obj_path);
+	if (!obj.data())
+		return paths;
+
+	size_t const slash = obj_path.rfind('/');
+	std::string const dir = slash == std::string::npos ? "" : obj_path.substr(0, slash + 1);
+	char const* const end = obj.data() + obj.size();
+	for (char const* line = obj.data(); line < end; ) {
+		char const* eol = static_cast<char const*>(std::memchr(line, '\n', size_t(end - line)));
+		if (!eol)
+			eol = end;
+		if (eol - line < 7 || std::memcmp(line, "mtllib ", 7) != 0) {
+			line = eol + 1;
+			continue;
+		}
+		std::string const l(line, eol);
+		line = eol + 1;
+		size_t const begin = l.find_first_not_of(" \t", 7);
+		size_t const last = l.find_last_not_of(" \t\r");
+		if (begin != std::string::npos && last >= begin)
+			paths.push_back(dir + l.substr(begin, last - begin + 1));
+	}
+	return paths;
+}
+
+/*
+ * Hands out consecutive arrays of a mapped file where they lie, and
+ * nullptr for arrays that reach past its end or are misaligned.
+ */
+struct CacheReader
+{
+	char const* p;
+	char const* end;
+
+	template <class T>
+	T const* view(size_t count)
+	{
+		size_t const bytes = count * sizeof(T);
+		if (size_t(end - p) < bytes || reinterpret_cast<uintptr_t>(p) % alignof(T) != 0)
+			return nullptr;
+		T const* v = reinterpret_cast<T const*>(p);
+		p += bytes;
+		return v;
+	}
+};
+
+template <class T, class Allocator>
+void
+write_array(std::ofstream &out, std::vector<T, Allocator> const& v)
+{
+	if (!v.empty())
+		out.write(reinterpret_cast<char const*>(v.data()), std::streamsize(v.size() * sizeof(T)));
+}
+
+bool
+read_cache(std::string const& cache_path, uint64_t key, TextureContainer *textures,
+		BVHBuildMode build_mode, BVHNodeWidth node_width,
+		std::shared_ptr<TriangleSoup> *soup, std::unique_ptr<BVH> *bvh)
+{
+	MappedFile file(cache_path);
+	if (!file.data())
+		return false;
+
+	CacheReader reader { file.data(), file.data() + file.size() };
+	CacheHeader const* header = reader.view<CacheHeader>(1);
+	if (!header
+	 || std::memcmp(header->magic, BVH_CACHE_MAGIC, sizeof(header->magic)) != 0
+	 || header->key != key)
+		return false;
+
+	/* reject absurd counts before computing sizes from them */
+	if (header->num_dependencies > file.size()
+	 || header->num_triangles > file.size() || header->num_references > file.size()
+	 || header->num_references < header->num_triangles || header->num_materials > file.size()
+	 || header->num_nodes > file.size() || header->string_bytes > file.size())
+		return false;
+
+	size_t const num_triangles  = size_t(header->num_triangles);
+	size_t const num_vertices   = 3 * num_triangles;
+	size_t const num_references = size_t(header->num_references);
+	size_t const num_nodes      = size_t(header->num_nodes);
+
+	CacheDependency const* dependencies     = reader.view<CacheDependency>(size_t(header->num_dependencies));
+	glm::vec3 const*       vertices         = reader.view<glm::vec3>(num_vertices);
+	glm::vec3 const*       normals          = reader.view<glm::vec3>(num_vertices);
+	glm::vec2 const*       tex_coordinates  = reader.view<glm::vec2>(num_vertices);
+	int const*             material_ids     = reader.view<int>(num_triangles);
+	int const*             triangle_indices = reader.view<int>(num_references);
+	BVH::FlatNode const*   flat_nodes       = reader.view<BVH::FlatNode>(num_nodes);
+	CacheMaterial const*   materials        = reader.view<CacheMaterial>(size_t(header->num_materials));
+	char const*            strings          = reader.view<char>(size_t(header->string_bytes));
+	if (!dependencies || !vertices || !normals || !tex_coordinates || !material_ids
+	 || !triangle_indices || !flat_nodes || !materials || !strings
+	 || reader.p != reader.end
+	 || num_nodes == 0)
+		return false;
+
+	auto const in_strings = [&](uint32_t offset, uint32_t length) {
+		return uint64_t(offset) + length <= header->string_bytes;
+	};
+
+	/* the MTL files must not have changed since the cache was written */
+	for (size_t i = 0; i < size_t(header->num_dependencies); i++) {
+		CacheDependency const& d = dependencies[i];
+		if (!in_strings(d.path_offset, d.path_length)
+		 || file_hash(std::string(strings + d.path_offset, d.path_length)) != d.hash)
+			return false;
+	}
+
+	/* the tree must be complete and reference every index exactly once */
+	size_t leaf_triangles = 0;
+	for (size_t i = 0; i < num_nodes; i++) {
+		BVH::FlatNode const& n = flat_nodes[i];
+		if (n.num_triangles < 0
+		 || (n.num_triangles == 0 && (n.offset <= int(i) + 1 || size_t(n.offset) >= num_nodes)))
+			return false;
+		leaf_triangles += size_t(n.num_triangles);
+	}
+	if (leaf_triangles != num_references)
+		return false;
+	for (size_t i = 0; i < num_references; i++) {
+		if (triangle_indices[i] < 0 || size_t(triangle_indices[i]) >= num_triangles)
+			return false;
+	}
+
+	std::vector<TriangleSoup::MaterialInfo> material_infos;
+	for (size_t i = 0; i < size_t(header->num_materials); i++) {
+		CacheMaterial const& m = materials[i];
+		if (!in_strings(m.map_kd_offset, m.map_kd_length)
+		 || !in_strings(m.map_ks_offset, m.map_ks_length))
+			return false;
+		TriangleSoup::MaterialInfo info;
+		info.map_kd.assign(strings + m.map_kd_offset, m.map_kd_length);
+		info.map_ks.assign(strings + m.map_ks_offset, m.map_ks_length);
+		info.diffuse   = glm::vec3(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
+		info.specular  = glm::vec3(m.specular[0], m.specular[1], m.specular[2]);
+		info.shininess = m.shininess;
+		material_infos.push_back(info);
+	}
+
+	*soup = std::make_shared<TriangleSoup>(
+		std::vector<glm::vec3>(vertices, vertices + num_vertices),
+		std::vector<glm::vec3>(normals, normals + num_vertices),
+		std::vector<glm::vec2>(tex_coordinates, tex_coordinates + num_vertices),
+		std::vector<int>(material_ids, material_ids + num_triangles),
+		std::vector<Material>());
+	(*soup)->material_infos = std::move(material_infos);
+	(*soup)->create_materials(textures);
+	bvh->reset(new BVH(**soup, build_mode, node_width,
+				triangle_indices, num_references, flat_nodes, num_nodes));
+	return true;
+}
+
+void
+write_cache(std::string const& cache_path, uint64_t key, std::string const& obj_path,
+		TriangleSoup const& soup, BVH const& bvh)
+{
+	std::string strings;
+	auto const add_string = [&](std::string const& str, uint32_t *offset, uint32_t *length) {
+		*offset = uint32_t(strings.size());
+		*length = uint32_t(str.size());
+		strings += str;
+	};
+
+	std::vector<CacheDependency> dependencies;
+	for (auto const& path : mtl_paths(obj_path)) {
+		CacheDependency d;
+		add_string(path, &d.path_offset, &d.path_length);
+		d.hash = file_hash(path);
+		dependencies.push_back(d);
+	}
+
+	std::vector<CacheMaterial> materials;
+	for (auto const& info : soup.material_infos) {
+		CacheMaterial m;
+		add_string(info.map_kd, &m.map_kd_offset, &m.map_kd_length);
+		add_string(info.map_ks, &m.map_ks_offset, &m.map_ks_length);
+		for (int i = 0; i < 3; i++) {
+			m.diffuse[i]  = info.diffuse[i];
+			m.specular[i] = info.specular[i];
+		}
+		m.shininess = info.shininess;
+		materials.push_back(m);
+	}
+
+	CacheHeader header;
+	std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+	header.key              = key;
+	header.num_dependencies = uint64_t(dependencies.size());
+	header.num_triangles    = uint64_t(soup.num_triangles);
+	header.num_references   = uint64_t(bvh.triangle_indices.size());
+	header.num_materials    = uint64_t(materials.size());
+	header.num_nodes        = uint64_t(bvh.flat_nodes.size());
+	header.string_bytes     = uint64_t(strings.size());
+
+	/* write to a temporary file first, so that a cache file is never incomplete */
+	std::string const tmp_path = cache_path + ".tmp";
+	{
+		std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+		if (!out)
+			return;
+		out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+		write_array(out, dependencies);
+		write_array(out, soup.vertices);
+		write_array(out, soup.normals);
+		write_array(out, soup.tex_coordinates);
+		write_array(out, soup.material_ids);
+		write_array(out, bvh.triangle_indices);
+		write_array(out, bvh.flat_nodes);
+		write_array(out, materials);
+		out.write(strings.data(), std::streamsize(strings.size()));
+		if (!out) {
+			out.close();
+			std::remove(tmp_path.c_str());
+			return;
+		}
+	}
+	std::remove(cache_path.c_str());
+	if (std::rename(tmp_path.c_str(), cache_path.c_str()) != 0)
+		std::remove(tmp_path.c_str());
+}
+
+} // namespace
+
+std::unique_ptr<BVH>
+load_obj_bvh(
+		std::string const& obj_path,
+		TextureContainer *textures,
+		BVHBuildMode build_mode,
+		BVHNodeWidth node_width,
+		std::shared_ptr<TriangleSoup> *soup)
+{
+	cg_assert(soup);
+
+	std::string const cache_path = obj_path + ".bvhcache";
+	uint64_t key = 0;
+	bool const have_key = cache_key(obj_path, build_mode, &key);
+
+	std::unique_ptr<BVH> bvh;
+	if (have_key && read_cache(cache_path, key, textures, build_mode, node_width, soup, &bvh))
+		return bvh;
+
+	*soup = std::make_shared<TriangleSoup>(obj_path, textures);
+	/* the cache stores the binary tree, which quantized trees free */
+	bvh.reset(new BVH(**soup, build_mode, BVH_BINARY));
+	if (have_key) {
+		std::cout << "writing BVH cache " << cache_path << std::endl;
+		write_cache(cache_path, key, obj_path, **soup, *bvh);
+	}
+	bvh->set_node_width(node_width);
+	return bvh;
+}
@@ -5,6 +5,13 @@
 #include <cglib/rt/renderer.h>
 #include <cglib/imgui/imgui.h>
 #include <cglib/rt/bvh.h>
+#include <cglib/rt/triangle_soup.h>
+#include <cglib/rt/wavefront_render.h>
+
+#include <cglib/core/aligned_allocator.h>
+
+#include <limits>
+#include <queue>
 
 int HostRender::run(RaytracingContext& context, 
 		PixelFunc const& render_pixel, 
@@ -15,14 +22,28 @@ int HostRender::run(RaytracingContext& context,
 		-> glm::vec3
 		{
 			RenderData data(context, tld);
+
+			/* the first hit of the pixel center ray may have been traced by trace_pixel_block */
+			auto set_camera = [&](Camera::Mode mode)
+			{
+				data.camera_mode = mode;
+				data.primary_hit = tld->primary_hits ? tld->primary_hits->pixel_hit(mode) : -1;
+			};
+			set_camera(Camera::Mono);
+
 			switch(context.params.render_mode) {
 
+				case RaytracingParameters::SAMPLE_COUNT:
+					if (!context.params.adaptive_sampling)
+						return heatmap(0.25f); /* spp samples, as scaled by render_tile_adaptive */
+					/* render_tile_adaptive shows the samples per pixel */
+				case RaytracingParameters::WAVEFRONT: /* if not supported by WavefrontRender */
 				case RaytracingParameters::RECURSIVE:
 					if (context.params.stereo)
 					{
-						data.camera_mode = Camera::StereoLeft;
+						set_camera(Camera::StereoLeft);
 						auto const left = render_pixel(x, y, ctx, data);
-						data.camera_mode = Camera::StereoRight;
+						set_camera(Camera::StereoRight);
 						auto const right = render_pixel(x, y, ctx, data);
 						return combine_stereo(left, right);
 					}
@@ -34,9 +55,9 @@ int HostRender::run(RaytracingContext& context,
 				case RaytracingParameters::DESATURATE:
 					if (context.params.stereo)
 					{
-						data.camera_mode = Camera::StereoLeft;
+						set_camera(Camera::StereoLeft);
 						auto const left = render_pixel(x, y, ctx, data);
-						data.camera_mode = Camera::StereoRight;
+						set_camera(Camera::StereoRight);
 						auto const right = render_pixel(x, y, ctx, data);
 						return combine_stereo(desaturate(left), desaturate(right));
 					}
@@ -69,12 +90,8 @@ int HostRender::run(RaytracingContext& context,
  					}
 					else {
 						Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
-						for(auto& o: context.get_active_scene()->objects) {
-							BVH *bvh = dynamic_cast<BVH *>(o.get());
-							if(bvh) {
-								bvh->intersect(ray, nullptr);
-							}
-						}
+						for(BVH *bvh: context.get_active_scene()->tlas.get_meshes())
+							bvh->intersect(ray, nullptr);
 					}
 					timer.stop();
 					return heatmap(static_cast<float>(timer.getElapsedTimeInMilliSec()) * context.params.scale_render_time);
@@ -89,12 +106,8 @@ int HostRender::run(RaytracingContext& context,
 				case RaytracingParameters::AABB_INTERSECT_COUNT: {
 					Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
 					glm::vec3 accum(0.0f);
-					for(auto& o: context.get_active_scene()->objects) {
-						auto *bvh = dynamic_cast<BVH *>(o.get());
-						if(bvh) {
-							accum += bvh->intersect_count(ray, 0, 0) * 0.02f;
-						}
-					}
+					for(BVH *bvh: context.get_active_scene()->tlas.get_meshes())
+						accum += bvh->intersect_count(ray, 0, 0) * 0.02f;
 					return accum;
 				}
 				default: /* should never happen */
@@ -115,6 +128,129 @@ int HostRender::run(RaytracingContext& context,
 
 // -----------------------------------------------------------------------------
 
+/*
+ * Sum of the build times of all BVHs in the active scene.
+ */
+static double bvh_build_time(RaytracingContext const& context)
+{
+	double time_ms = 0.0;
+	for(BVH *bvh: context.get_active_scene()->get_bvhs())
+		time_ms += bvh->build_time_ms;
+	return time_ms;
+}
+
+/*
+ * Print the build time and the statistics of all BVHs in the active scene.
+ * With spatial splits, triangles are referenced more than once.
+ */
+static void print_bvh_stats(RaytracingContext const& context)
+{
+	std::cout << "BVH build time: " << bvh_build_time(context) << "ms" << std::endl;
+	std::vector<BVH*> const bvhs = context.get_active_scene()->get_bvhs();
+	for(size_t i = 0; i < bvhs.size(); i++) {
+		BVH const* bvh = bvhs[i];
+		BVH::Stats const& stats = bvh->stats;
+		std::cout << "BVH " << i << ": "
+			<< stats.num_nodes << " nodes, "
+			<< stats.num_leaves << " leaves, "
+			<< "depth " << stats.max_depth << " (mean leaf depth " << stats.mean_leaf_depth << "), "
+			<< "SAH cost " << stats.sah_cost << ", "
+			<< double(stats.memory_size) / (1024.0 * 1024.0) << "MB, "
+			<< stats.num_references << " references to " << bvh->triangle_soup.num_triangles << " triangles"
+			<< std::endl;
+		std::cout << "  leaves by size:";
+		for(int n = 1; n <= BVH::SAH_MAX_TRIANGLES_IN_LEAF; n++) {
+			if(stats.leaf_sizes[n])
+				std::cout << " " << n << ":" << stats.leaf_sizes[n];
+		}
+		std::cout << std::endl;
+	}
+}
+
+/*
+ * Print the BVH traversal work of the last frame per ray.
+ */
+static void print_traversal_counters(BVHTraversalCounters const& c)
+{
+	double const rays = double(std::max<uint64_t>(c.rays, 1));
+	std::cout << "BVH traversal: " << c.rays << " rays, "
+		<< double(c.nodes_visited) / rays << " nodes, "
+		<< double(c.triangles_tested) / rays << " triangles, "
+		<< double(c.hits) / rays << " hits per ray" << std::endl;
+}
+
+/*
+ * BVH traversal counters of the render threads. Each thread only adds to
+ * its own entry, which fills a cache line, and the entries are summed once
+ * all tiles of a frame are done.
+ */
+struct alignas(64) ThreadTraversalCounters
+{
+	BVHTraversalCounters counters;
+};
+static std::vector<ThreadTraversalCounters, AlignedAllocator<ThreadTraversalCounters, 64>> thread_traversal_counters;
+
+/*
+ * Number of tiles of the current frame whose pixels are all written, and
+ * the number of these pixels. The increment of tiles_done publishes the
+ * pixels to the thread that polls it.
+ */
+static std::atomic<int> tiles_done(0);
+static std::atomic<int> pixels_done(0);
+
+static BVHTraversalCounters sum_traversal_counters()
+{
+	BVHTraversalCounters sum;
+	for(auto const& t: thread_traversal_counters)
+		sum += t.counters;
+	return sum;
+}
+
+// -----------------------------------------------------------------------------
+
+/*
+ * Trace the first hits of the pixel center rays of the pixels [x0, x1) x [y0, y1)
+ * as one ray packet per camera, in row order. This only pays off if
+ * render_pixel shoots exactly these rays, i.e. with one sample per pixel
+ * and without depth of field. Otherwise render_pixel may trace packets of
+ * its own rays.
+ */
+static void trace_pixel_block(RaytracingContext const& context, ThreadLocalData* tld,
+		int x0, int y0, int x1, int y1)
+{
+	RaytracingParameters const& params = context.params;
+	tld->primary_hits->clear();
+	/* TIME measures the first hit inside render_pixel, SAMPLE_COUNT
+	 * traces nothing without adaptive sampling */
+	if (params.spp > 1 || params.dof || params.progressive || params.adaptive_sampling
+	 || params.render_mode == RaytracingParameters::TIME
+	 || params.render_mode == RaytracingParameters::BVH_TIME
+	 || params.render_mode == RaytracingParameters::AABB_INTERSECT_COUNT
+	 || params.render_mode == RaytracingParameters::SAMPLE_COUNT)
+		return;
+
+	bool const stereo = params.stereo
+		&& (params.render_mode == RaytracingParameters::RECURSIVE
+		 || params.render_mode == RaytracingParameters::DESATURATE);
+	Camera::Mode const modes[] = { Camera::Mono, Camera::StereoLeft, Camera::StereoRight };
+
+	RenderData data(context, tld);
+	for (int m = stereo ? 1 : 0; m < (stereo ? 3 : 1); m++)
+	{
+		data.camera_mode = modes[m];
+		Ray rays[BVH::MAX_PACKET_SIZE];
+		int num_rays = 0;
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++)
+				rays[num_rays++] = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
+		int const first_hit = trace_primary_packet(data, rays, num_rays);
+		cg_assert(first_hit == (modes[m] == Camera::StereoRight ? num_rays : 0));
+		tld->primary_hits->block_pixels = num_rays;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
 void HostRender::generate_tile_idx(int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx)
 {
 	/* Generate tile indices in the order of a spiral that starts in the center of the image.
@@ -154,17 +290,95 @@ void HostRender::generate_tile_idx(int num_tiles_x, int num_tiles_y, std::vector
 
 // -----------------------------------------------------------------------------
 
+/*
+ * The cell with index d along the Hilbert curve through n x n cells, where
+ * n is a power of two. The 4^k cells from a multiple of 4^k on form an
+ * aligned block of 2^k x 2^k cells.
+ */
+static glm::ivec2 hilbert_cell(int n, int d)
+{
+	glm::ivec2 p(0);
+	for (int s = 1; s < n; s *= 2)
+	{
+		int const rx = 1 & (d / 2);
+		int const ry = 1 & (d ^ rx);
+		if (ry == 0)
+		{
+			if (rx == 1)
+				p = glm::ivec2(s - 1) - p;
+			std::swap(p.x, p.y);
+		}
+		p += s * glm::ivec2(rx, ry);
+		d /= 4;
+	}
+	return p;
+}
+
+void HostRender::generate_tiles_hilbert(int width, int height, int min_tile_size, int max_tile_size,
+		int num_threads, std::vector<glm::ivec4>* tiles)
+{
+	cg_assert(min_tile_size >= 1);
+	int const cells_x = (width  + min_tile_size - 1) / min_tile_size;
+	int const cells_y = (height + min_tile_size - 1) / min_tile_size;
+	int n = 1, levels = 0;
+	while (n < std::max(cells_x, cells_y))
+	{
+		n *= 2;
+		levels++;
+	}
+	int max_level = 0;
+	while (max_level < levels && (min_tile_size << (max_level + 1)) <= max_tile_size)
+		max_level++;
+
+	// Walk along the curve and emit the largest aligned block at each
+	// step that is still small enough. Blocks outside of the image are
+	// skipped as a whole.
+	tiles->clear();
+	int64_t remaining = int64_t(width) * int64_t(height);
+	for (int d = 0; d < n * n;)
+	{
+		int k = 0;
+		while (k < levels && d % (1 << (2 * (k + 1))) == 0)
+			k++;
+
+		glm::ivec2 const cell = hilbert_cell(n, d);
+		for (;; k--)
+		{
+			int const size = min_tile_size << k;
+			int const x0 = (cell.x & ~((1 << k) - 1)) * min_tile_size;
+			int const y0 = (cell.y & ~((1 << k) - 1)) * min_tile_size;
+			if (x0 >= width || y0 >= height)
+			{
+				d += 1 << (2 * k);
+				break;
+			}
+			if (k == 0 || (k <= max_level
+			 && remaining >= int64_t(TILES_PER_THREAD) * num_threads * size * size))
+			{
+				glm::ivec4 const tile(x0, y0, std::min(x0 + size, width), std::min(y0 + size, height));
+				tiles->push_back(tile);
+				remaining -= int64_t(tile[2] - tile[0]) * int64_t(tile[3] - tile[1]);
+				d += 1 << (2 * k);
+				break;
+			}
+		}
+	}
+	cg_assert(remaining == 0);
+}
+
+// -----------------------------------------------------------------------------
+
 int HostRender::run_noninteractive(RaytracingContext& context, 
 		PixelFuncRaw const& render_pixel, int kill_timeout_seconds)
 {
 	Image      frame_buffer(context.params.image_width, context.params.image_height);
 	ThreadPool thread_pool(context.params.num_threads);
-	std::vector<glm::ivec2> tile_idx;
+	std::vector<glm::ivec4> tiles;
 
 	Timer timer;
 	timer.start();
 	context.get_active_scene()->refresh_scene(context.params);
-	launch(&frame_buffer, thread_pool, &context, &tile_idx, render_pixel);
+	launch(&frame_buffer, thread_pool, &context, &tiles, render_pixel);
 
 	if (kill_timeout_seconds > 0)
 	{
@@ -180,7 +394,10 @@ int HostRender::run_noninteractive(RaytracingContext& context,
 	}
 	thread_pool.poll_exceptions();
 	timer.stop();
+	context.traversal_counters = sum_traversal_counters();
 	std::cout << "Rendering time: " << timer.getElapsedTimeInMilliSec() << "ms" << std::endl;
+	print_bvh_stats(context);
+	print_traversal_counters(context.traversal_counters);
 	frame_buffer.save(context.params.output_file_name.c_str(), 2.2f);
 
 	return 0;
@@ -188,12 +405,41 @@ int HostRender::run_noninteractive(RaytracingContext& context,
 
 // -----------------------------------------------------------------------------
 
+/*
+ * Scale src, which was rendered at scale times the size of dst, up to dst
+ * with bilinear interpolation.
+ */
+static void upscale(Image const& src, float scale, Image* dst)
+{
+	for (int y = 0; y < dst->getHeight(); y++)
+	{
+		for (int x = 0; x < dst->getWidth(); x++)
+		{
+			glm::vec2 const p = (glm::vec2(x, y) + 0.5f) * scale - 0.5f;
+			glm::ivec2 const p0(glm::floor(p));
+			glm::vec2 const f = p - glm::vec2(p0);
+			glm::vec4 const top    = glm::mix(src.getPixel(p0.x, p0.y,     Image::CLAMP), src.getPixel(p0.x + 1, p0.y,     Image::CLAMP), f.x);
+			glm::vec4 const bottom = glm::mix(src.getPixel(p0.x, p0.y + 1, Image::CLAMP), src.getPixel(p0.x + 1, p0.y + 1, Image::CLAMP), f.x);
+			dst->setPixel(x, y, glm::mix(top, bottom, f.y));
+		}
+	}
+}
+
+static float elapsed_ms(std::chrono::high_resolution_clock::time_point since)
+{
+	auto const now = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<float, std::milli>(now - since).count();
+}
+
+// -----------------------------------------------------------------------------
+
 int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const& render_pixel,
 		std::function<void()> const& render_overlay)
 {
 	Image      frame_buffer(context.params.image_width, context.params.image_height);
+	Image      accum_buffer(context.params.image_width, context.params.image_height);
 	ThreadPool thread_pool(context.params.num_threads);
-	std::vector<glm::ivec2> tile_idx;
+	std::vector<glm::ivec4> tiles;
 
 	if (!GUI::init_host(context.params))
 	{
@@ -203,8 +449,62 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 	if(context.get_active_scene())
 		context.get_active_scene()->set_active_camera();
 
+	int pass = 0;
+	bool frame_counted = false;
+
+	// In the frame time budget mode, a change is rendered as a preview at
+	// preview_scale first, and the full image replaces the preview tile
+	// by tile once it is done.
+	Image preview_buffer;
+	bool previewing = false;
+	auto time_launch = std::chrono::high_resolution_clock::now();
+	int const image_pixels = frame_buffer.getWidth() * frame_buffer.getHeight();
+
+	// Choose the scale at which a preview would take the budget, from the
+	// cost of the pixels of the current preview so far. Without a single
+	// pixel done, the cost is unknown and the scale is only halved.
+	auto update_preview_scale = [&]()
+	{
+		int const done = pixels_done.load();
+		if (done == 0) {
+			context.preview_scale = std::max(0.5f * context.preview_scale, 1.f / 16.f);
+			return;
+		}
+		float const pixel_ms = elapsed_ms(time_launch) / float(done);
+		float const scale = std::sqrt(context.params.frame_budget_ms / pixel_ms / float(image_pixels));
+		context.preview_scale = glm::clamp(std::min(scale, 2.f * context.preview_scale),
+			1.f / 16.f, 1.f);
+	};
+
+	auto launch_preview = [&]()
+	{
+		thread_pool.terminate();
+		if (previewing)
+			update_preview_scale();
+		context.render_scale = context.preview_scale;
+		preview_buffer.setSize(
+			static_cast<int>(std::ceil(float(frame_buffer.getWidth())  * context.preview_scale)),
+			static_cast<int>(std::ceil(float(frame_buffer.getHeight()) * context.preview_scale)));
+		launch(&preview_buffer, thread_pool, &context, &tiles, render_pixel);
+		previewing = true;
+		time_launch = std::chrono::high_resolution_clock::now();
+	};
+
+	auto launch_frame = [&]()
+	{
+		thread_pool.terminate();
+		context.render_scale = 1.f;
+		launch(&frame_buffer, thread_pool, &context, &tiles, render_pixel,
+				context.params.progressive ? &accum_buffer : nullptr, pass);
+		previewing = false;
+	};
+
 	// Launch first render.
-	launch(&frame_buffer, thread_pool, &context, &tile_idx, render_pixel);
+	if (context.params.frame_budget)
+		launch_preview();
+	else
+		launch_frame();
+	context.accumulated_passes = 0;
 
 	auto time_last_frame = std::chrono::high_resolution_clock::now();
 
@@ -220,11 +520,35 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 		if (cam && cam->requires_restart())
 			update_flags |= GUI::FLAG_REDRAW;
 
-		if(update_flags) {
+		// Show the preview once it is done, and start it again smaller if
+		// it takes twice the budget. Pending changes are applied below
+		// before anything is launched again.
+		if(previewing && thread_pool.num_jobs() > 0)
+		{
+			if (tiles_done.load() >= thread_pool.num_jobs())
+			{
+				update_preview_scale();
+				upscale(preview_buffer, context.render_scale, &frame_buffer);
+				previewing = false;
+				if (!update_flags)
+					launch_frame();
+			}
+			else if (elapsed_ms(time_launch) > 2.f * context.params.frame_budget_ms)
+			{
+				update_preview_scale();
+				previewing = false;
+				if (!update_flags)
+					launch_preview();
+			}
+		}
+
+		// Let a preview finish before restarting, so that the image keeps
+		// up with a moving camera.
+		if(update_flags && !previewing) {
 			thread_pool.terminate();
 		}
 
-		if(update_flags)
+		if(update_flags && !previewing)
 		{
 			if (oldParams.eye_separation != context.params.eye_separation)
 			{
@@ -258,17 +582,44 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 				}
 			}
 			oldParams = context.params;
-			launch(&frame_buffer, thread_pool, &context, &tile_idx, render_pixel);
+			pass = 0;
+			if (context.params.frame_budget)
+			{
+				launch_preview();
+			}
+			else
+			{
+				frame_buffer.clear(glm::vec4(0.f));
+				launch_frame();
+			}
+			context.accumulated_passes = 0;
+			frame_counted = false;
 			update_flags = 0;
 		}
 
+		if(!previewing && !frame_counted && thread_pool.num_jobs() > 0
+		 && tiles_done.load() >= thread_pool.num_jobs()) {
+			context.traversal_counters = sum_traversal_counters();
+			context.accumulated_passes = pass + 1;
+			frame_counted = true;
+		}
+
+		// Refine the image with another pass while nothing changes.
+		if(frame_counted && context.params.progressive
+		 && context.accumulated_passes < context.params.max_passes) {
+			pass = context.accumulated_passes;
+			launch(&frame_buffer, thread_pool, &context, &tiles, render_pixel,
+					&accum_buffer, pass);
+			frame_counted = false;
+		}
+
 		// Update the texture displayed online in regular intervals so that
 		// we don't waste many cycles uploading all the time.
 		auto const now = std::chrono::high_resolution_clock::now();
 		float const mspf = 1000.f / static_cast<float>(context.params.fps);
 		if (std::chrono::duration_cast<std::chrono::milliseconds>(now-time_last_frame).count() > mspf)
 		{
-			update_flags = GUI::display_host(frame_buffer, render_overlay);
+			update_flags |= GUI::display_host(frame_buffer, render_overlay);
 		}
 	}
 
@@ -279,11 +630,120 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 
 // -----------------------------------------------------------------------------
 
+bool HostRender::render_tile_adaptive(RaytracingContext const& context, ThreadLocalData* tld,
+		int x0, int y0, int x1, int y1, PixelFuncRaw const& render_pixel, PixelStore const& store,
+		std::atomic<bool> const& terminate)
+{
+	RaytracingParameters const& params = context.params;
+
+	/*
+	 * Running mean of the color, and mean and variance of the luminance
+	 * of the samples of one pixel.
+	 */
+	struct PixelStats
+	{
+		glm::vec3 mean = glm::vec3(0.f);
+		float lum_mean = 0.f;
+		float lum_m2   = 0.f;
+		int n          = 0;
+
+		void add(glm::vec3 const& color)
+		{
+			n++;
+			mean += (color - mean) / float(n);
+			float const lum   = luminance(color);
+			float const delta = lum - lum_mean;
+			lum_mean += delta / float(n);
+			lum_m2   += delta * (lum - lum_mean);
+		}
+
+		float variance() const
+		{
+			return n < 2 ? 0.f : lum_m2 / float(n - 1);
+		}
+	};
+
+	int const width      = x1 - x0;
+	int const height     = y1 - y0;
+	int const num_pixels = width * height;
+	int const min_spp    = std::max(1, std::min(params.adaptive_min_spp, params.spp));
+	int budget           = std::max(params.spp, min_spp) * num_pixels;
+
+	std::vector<PixelStats> stats(num_pixels);
+	for (int i = 0; i < num_pixels; i++)
+	{
+		for (int s = 0; s < min_spp; s++)
+		{
+			if (terminate.load())
+				return false;
+			stats[i].add(render_pixel(x0 + i % width, y0 + i / width, context, tld));
+		}
+	}
+	budget -= min_spp * num_pixels;
+
+	/*
+	 * Standard error of the mean luminance of a pixel, relative to its mean
+	 * for pixels brighter than white. The variance is the largest in the
+	 * 3x3 neighborhood of the pixel, because a few samples of a pixel that
+	 * is barely covered by an edge often all agree.
+	 */
+	auto error = [&](int i)
+	{
+		int const x = i % width;
+		int const y = i / width;
+		float variance = 0.f;
+		for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++)
+			for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++)
+				variance = std::max(variance, stats[ny * width + nx].variance());
+		return std::sqrt(variance / float(stats[i].n)) / std::max(stats[i].lum_mean, 1.f);
+	};
+
+	// Spend the rest of the budget one sample at a time on the pixel with
+	// the largest error. A sample also changes the errors of the neighbors,
+	// so they are queued again, and outdated entries are skipped.
+	std::priority_queue<std::pair<float, int>> queue;
+	for (int i = 0; i < num_pixels; i++)
+		queue.push(std::make_pair(error(i), i));
+	while (budget > 0 && !queue.empty() && queue.top().first > params.adaptive_error)
+	{
+		if (terminate.load())
+			return false;
+		int const i = queue.top().second;
+		float const queued_error = queue.top().first;
+		queue.pop();
+		if (queued_error != error(i))
+			continue;
+
+		stats[i].add(render_pixel(x0 + i % width, y0 + i / width, context, tld));
+		budget--;
+
+		int const x = i % width;
+		int const y = i / width;
+		for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++)
+			for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++)
+				queue.push(std::make_pair(error(ny * width + nx), ny * width + nx));
+	}
+
+	bool const show_samples = params.render_mode == RaytracingParameters::SAMPLE_COUNT;
+	for (int i = 0; i < num_pixels; i++)
+	{
+		glm::vec3 const color = show_samples
+			? heatmap(float(stats[i].n) / float(4 * std::max(params.spp, 1)))
+			: stats[i].mean;
+		store(x0 + i % width, y0 + i / width, color);
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
 void HostRender::launch(Image* fb, 
 		ThreadPool& thread_pool, 
 		RaytracingContext const* context, 
-		std::vector<glm::ivec2>* tile_idx,
-		PixelFuncRaw render_pixel)
+		std::vector<glm::ivec4>* tiles,
+		PixelFuncRaw render_pixel,
+		Image* accum,
+		int pass)
 {
 	if (!thread_pool.enough_progress())
 	{
@@ -292,53 +752,128 @@ void HostRender::launch(Image* fb,
 
 	// Clean up.
 	thread_pool.terminate();
-	fb->clear(glm::vec4(0.f));
+	if (accum && pass == 0)
+		accum->clear(glm::vec4(0.f));
+	thread_traversal_counters.assign(thread_pool.num_threads(), ThreadTraversalCounters());
+	tiles_done.store(0);
+	pixels_done.store(0);
 
-	// Compute number of tiles (work units).
+	// Compute the tiles (work units).
 	int const width  = fb->getWidth();
 	int const height = fb->getHeight();
 	int const tile_size   = context->params.tile_size;
-	int const num_tiles_x = static_cast<int>(std::ceil(float(width) / float(tile_size)));
-	int const num_tiles_y = static_cast<int>(std::ceil(float(height) / float(tile_size)));
-	int const num_tiles   = num_tiles_x * num_tiles_y;
+	int const block_size  = context->params.get_packet_block_size();
+	cg_assert(block_size * block_size <= BVH::MAX_PACKET_SIZE);
 
-	// New tile indices.
-	generate_tile_idx(num_tiles_x, num_tiles_y, tile_idx);
+	if (context->params.tile_order == RaytracingParameters::TILES_SPIRAL)
+	{
+		int const num_tiles_x = static_cast<int>(std::ceil(float(width) / float(tile_size)));
+		int const num_tiles_y = static_cast<int>(std::ceil(float(height) / float(tile_size)));
+		std::vector<glm::ivec2> tile_idx;
+		generate_tile_idx(num_tiles_x, num_tiles_y, &tile_idx);
+		tiles->clear();
+		for (glm::ivec2 const& idx : tile_idx)
+		{
+			tiles->push_back(glm::ivec4(idx * tile_size,
+				glm::min((idx + 1) * tile_size, glm::ivec2(width, height))));
+		}
+	}
+	else
+	{
+		// Tiles smaller than a packet block would only trace partial
+		// packets.
+		int const min_tile_size = std::max(tile_size / 4, block_size);
+		generate_tiles_hilbert(width, height, min_tile_size, 4 * tile_size,
+			thread_pool.num_threads(), tiles);
+	}
+	int const num_tiles = static_cast<int>(tiles->size());
 
 	// Launch threads.
 	thread_pool.run<ThreadLocalData>(num_tiles, 
 			// The actual kernel.
 			[=](int tile, ThreadLocalData* tld, std::atomic<bool>& terminate)
 			{
-				glm::ivec2 const idx = (*tile_idx)[tile];
-				int const baseX = std::max<int>(idx[0] * tile_size, 0);
-				int const endX  = std::min<int>(baseX + tile_size, width);
+				glm::ivec4 const& rect = (*tiles)[tile];
+				int const baseX = rect[0];
+				int const endX  = rect[2];
 
-				int const baseY = std::max<int>(idx[1] * tile_size, 0);
-				int const endY  = std::min<int>(baseY + tile_size, height);
+				int const baseY = rect[1];
+				int const endY  = rect[3];
 
-				Image img(endX-baseX, endY-baseY);
-				for (int y = baseY; y < endY; y++) 
+				// Every pass and tile needs its own random samples, no
+				// matter which thread renders it.
+				if (accum)
 				{
-					for (int x = baseX; x < endX; x++) 
-					{
-						if (terminate.load())
-							return;
+					std::seed_seq seed{ pass, tile };
+					tld->rng.seed(seed);
+				}
 
-						glm::vec3 const color = render_pixel(x, y, *context, dynamic_cast<ThreadLocalData*>(tld));
-						img.setPixel(x-baseX, y-baseY, glm::vec4(color, 1.f));
+				// With ray packets, the tile is rendered in blocks of
+				// block_size x block_size pixels whose first hits are traced
+				// together.
+				PrimaryHits primary_hits;
+				struct PrimaryHitsGuard {
+					ThreadLocalData* tld;
+					PrimaryHitsGuard(ThreadLocalData* tld_, PrimaryHits* hits) : tld(tld_) { tld->primary_hits = hits; }
+					~PrimaryHitsGuard() { tld->primary_hits = nullptr; }
+				} g(tld, block_size > 1 ? &primary_hits : nullptr);
+
+				// Count the BVH traversals of this thread.
+				struct TraversalCountersGuard {
+					TraversalCountersGuard(BVHTraversalCounters* counters) { BVH::traversal_counters = counters; }
+					~TraversalCountersGuard() { BVH::traversal_counters = nullptr; }
+				} c(&thread_traversal_counters[tld->thread_id].counters);
+
+				PixelStore const store = [=](int x, int y, glm::vec3 const& color)
+				{
+					if (accum)
+					{
+						glm::vec4 const sum = accum->getPixel(x, y) + glm::vec4(color, 1.f);
+						accum->setPixel(x, y, sum);
+						fb->setPixel(x, y, sum / sum.w);
 					}
-				}
+					else
+					{
+						fb->setPixel(x, y, glm::vec4(color, 1.f));
+					}
+				};
 
-				std::lock_guard<std::mutex> lock(mutex);
-				for (int y = baseY; y < endY; y++) 
+				if (context->params.adaptive_sampling)
+				{
+					if (!render_tile_adaptive(*context, tld, baseX, baseY, endX, endY, render_pixel, store, terminate))
+						return;
+				}
+				else if (context->params.render_mode == RaytracingParameters::WAVEFRONT
+				      && WavefrontRender::supports(context->params))
 				{
-					for (int x = baseX; x < endX; x++) 
+					if (!WavefrontRender::render_tile(*context, tld, baseX, baseY, endX, endY, store, terminate))
+						return;
+				}
+				else
+				for (int blockY = baseY; blockY < endY; blockY += block_size)
+				for (int blockX = baseX; blockX < endX; blockX += block_size)
+				{
+					int const blockEndX = std::min(blockX + block_size, endX);
+					int const blockEndY = std::min(blockY + block_size, endY);
+					if (block_size > 1)
+						trace_pixel_block(*context, tld, blockX, blockY, blockEndX, blockEndY);
+
+					for (int y = blockY; y < blockEndY; y++) 
 					{
-						fb->setPixel(x, y, img.getPixel(x-baseX, y-baseY));
+						for (int x = blockX; x < blockEndX; x++) 
+						{
+							if (terminate.load())
+								return;
+
+							if (primary_hits.block_pixels > 0)
+								primary_hits.pixel = (y - blockY) * (blockEndX - blockX) + (x - blockX);
+							store(x, y, render_pixel(x, y, *context, dynamic_cast<ThreadLocalData*>(tld)));
+						}
 					}
 				}
 
+				pixels_done += (endX - baseX) * (endY - baseY);
+				tiles_done++;
 			}
 	);
 }
@@ -0,0 +1,175 @@
+#include <cglib/rt/instance_group.h>
+#include <cglib/rt/bvh.h>
+#include <cglib/rt/intersection.h>
+#include <cglib/rt/transform.h>
+#include <cglib/rt/triangle_soup.h>
+
+#include <cglib/core/assert.h>
+
+#include <cmath>
+#include <limits>
+
+int InstanceGroup::
+add_mesh(std::shared_ptr<BVH> mesh)
+{
+	cg_assert(mesh);
+	meshes.push_back(std::move(mesh));
+	return int(meshes.size()) - 1;
+}
+
+int InstanceGroup::
+add_material(std::shared_ptr<Material> material_)
+{
+	cg_assert(material_);
+	materials.push_back(std::move(material_));
+	return int(materials.size()) - 1;
+}
+
+void InstanceGroup::
+add_instance(int mesh, glm::mat4 const& object_to_world, int material_)
+{
+	cg_assert(mesh >= 0 && mesh < int(meshes.size()));
+	cg_assert(material_ < int(materials.size()));
+	Instance instance;
+	instance.world_to_object = glm::inverse(object_to_world);
+	instance.object_to_world = object_to_world;
+	instance.mesh = mesh;
+	instance.material = material_;
+	instances.push_back(instance);
+}
+
+void InstanceGroup::
+build()
+{
+	instance_bounds.clear();
+	leaf_instances.clear();
+
+	for (size_t i = 0; i < instances.size(); i++) {
+		Instance const& instance = instances[i];
+		AABB local, aabb;
+		meshes[instance.mesh]->get_local_bounds(&local);
+		if (local.is_valid()) {
+			for (int c = 0; c < 8; ++c) {
+				glm::vec3 const corner(
+					(c & 1) ? local.max.x : local.min.x,
+					(c & 2) ? local.max.y : local.min.y,
+					(c & 4) ? local.max.z : local.min.z);
+				aabb.extend(transform_position(instance.object_to_world, corner));
+			}
+			leaf_instances.push_back(int(i));
+		}
+		instance_bounds.push_back(aabb);
+	}
+
+	TopLevelBVH::build_tree(instance_bounds, leaf_instances, nodes);
+}
+
+void InstanceGroup::
+intersect_instance(int idx, Ray const& ray, HitRecord* hit, int &nearest) const
+{
+	Instance const& instance = instances[idx];
+	/* search no farther than the nearest hit so far, a hit as near still
+	 * wins for an instance added earlier */
+	HitRecord candidate;
+	candidate.t = nearest >= 0 && idx < nearest
+		? std::nextafter(hit->t, std::numeric_limits<float>::max())
+		: hit->t;
+	if (!meshes[instance.mesh]->intersect_instance(ray, &candidate,
+				instance.world_to_object, instance.object_to_world))
+		return;
+	if (candidate.t < hit->t || (candidate.t == hit->t && nearest >= 0 && idx < nearest)) {
+		*hit = candidate;
+		hit->instance_id = uint32_t(idx);
+		nearest = idx;
+	}
+}
+
+bool InstanceGroup::
+intersect(Ray const& ray, Intersection* isect) const
+{
+	cg_assert(isect);
+	HitRecord hit;
+	hit.t = isect->t;
+	if (!intersect_hit(ray, &hit))
+		return false;
+	fill_intersection(ray, hit, isect);
+	return true;
+}
+
+void InstanceGroup::
+fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const
+{
+	cg_assert(hit.instance_id < instances.size());
+	Instance const& instance = instances[hit.instance_id];
+	meshes[instance.mesh]->fill_instance_intersection(ray, hit, isect,
+			instance.world_to_object, instance.object_to_world);
+	isect->instance_id = hit.instance_id;
+}
+
+bool InstanceGroup::
+intersect_hit(Ray const& ray, HitRecord* hit) const
+{
+	cg_assert(hit);
+	int nearest = -1;
+	glm::vec3 const div = 1.0f / ray.direction;
+	TopLevelBVH::traverse(nodes, ray, div, hit->t, [&](TopLevelBVH::Node const& n) -> bool {
+		for (int i = n.offset; i < n.offset + n.num_objects; i++) {
+			int const o = leaf_instances[i];
+			float t_min = 0.0f;
+			float t_max = hit->t;
+			if (instance_bounds[o].intersect(ray, t_min, t_max, div))
+				intersect_instance(o, ray, hit, nearest);
+		}
+		return false;
+	});
+	return nearest >= 0;
+}
+
+bool InstanceGroup::
+occluded(Ray const& ray, float t_max) const
+{
+	glm::vec3 const div = 1.0f / ray.direction;
+	return TopLevelBVH::traverse(nodes, ray, div, t_max, [&](TopLevelBVH::Node const& n) -> bool {
+		for (int i = n.offset; i < n.offset + n.num_objects; i++) {
+			Instance const& instance = instances[leaf_instances[i]];
+			if (meshes[instance.mesh]->occluded_instance(ray, t_max,
+						instance.world_to_object, instance.object_to_world))
+				return true;
+		}
+		return false;
+	});
+}
+
+bool InstanceGroup::
+get_local_bounds(AABB* aabb) const
+{
+	cg_assert(aabb);
+	if (!nodes.empty())
+		*aabb = nodes[0].aabb;
+	return true;
+}
+
+void InstanceGroup::
+compute_shading_info(Intersection* isect)
+{
+	cg_assert(isect);
+	cg_assert(isect->instance_id < instances.size());
+	Instance const& instance = instances[isect->instance_id];
+	Material const& instance_material = instance.material >= 0
+		? *materials[instance.material]
+		: meshes[instance.mesh]->get_material(isect->primitive_id);
+	isect->material.evaluate(instance_material, *isect);
+}
+
+void InstanceGroup::
+compute_shading_info(const Ray rays[4], Intersection* isect)
+{
+	cg_assert(isect);
+	cg_assert(isect->instance_id < instances.size());
+	Instance const& instance = instances[isect->instance_id];
+	Ray rays_local[4];
+	for (int i = 0; i < 4; ++i)
+		rays_local[i] = transform_ray(rays[i], instance.world_to_object);
+	isect->dudv = meshes[instance.mesh]->triangle_soup.compute_uv_footprint(rays_local, isect->primitive_id);
+	compute_shading_info(isect);
+}
@@ -6,11 +6,11 @@ evaluate(
 	Material const& material, 
 	Intersection const& isect)
 {
-	k_d    = glm::vec3(material.k_d->evaluate(isect.uv, isect.dudv));
-	k_s    = glm::vec3(material.k_s->evaluate(isect.uv, isect.dudv));
-	k_r    = glm::vec3(material.k_r->evaluate(isect.uv, isect.dudv));
-	k_t    = glm::vec3(material.k_t->evaluate(isect.uv, isect.dudv));
-	normal = glm::vec3(material.normal->evaluate(isect.uv, isect.dudv));
+	k_d    = glm::vec3(material.k_d->lookup(isect.uv, isect.dudv));
+	k_s    = glm::vec3(material.k_s->lookup(isect.uv, isect.dudv));
+	k_r    = glm::vec3(material.k_r->lookup(isect.uv, isect.dudv));
+	k_t    = glm::vec3(material.k_t->lookup(isect.uv, isect.dudv));
+	normal = glm::vec3(material.normal->lookup(isect.uv, isect.dudv));
 	normal = glm::normalize(glm::vec3(2.f*normal[0]-1.f, normal[2], 2.f*normal[1]-1.f));
 
 	k_a = 0.1f * k_d; // simple ambient term
@@ -22,6 +22,88 @@ intersect(Ray const& ray, Intersection* isect) const
 	return false;
 }
 
+bool Object::
+intersect_hit(Ray const& ray, HitRecord* hit) const
+{
+	cg_assert(hit);
+	const Ray ray_local = transform_ray(ray, transform_world_to_object);
+	float t_local;
+	if (!geo->intersect_distance(ray_local, &t_local))
+		return false;
+	return record_hit(ray, ray_local, t_local, hit);
+}
+
+bool Object::
+record_hit(Ray const& ray, Ray const& ray_local, float t_local, HitRecord* hit) const
+{
+	/* the same position and distance as intersect computes */
+	glm::vec3 const position = ray_local.origin + t_local * ray_local.direction;
+	float const t = glm::length(ray.origin - transform_position(transform_object_to_world, position));
+	if (!(t < hit->t))
+		return false;
+	hit->t = t;
+	hit->primitive_id = 0;
+	hit->instance_id = 0;
+	hit->bary = glm::vec2(0.f);
+	hit->t_local = t_local;
+	return true;
+}
+
+void Object::
+fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const
+{
+	cg_assert(isect);
+	/* the hit lies at hit.t_local along the object space ray */
+	const Ray ray_local = transform_ray(ray, transform_world_to_object);
+	*isect = Intersection();
+	geo->fill_intersection(ray_local, hit.t_local, isect);
+	local_to_world(hit, isect);
+}
+
+void Object::
+local_to_world(HitRecord const& hit, Intersection* isect) const
+{
+	/* geo fills in no tangent space, compute_shading_info adds it later */
+	isect->position         = transform_position(transform_object_to_world, isect->position);
+	isect->geometric_normal = transform_direction(transform_object_to_world_normal, isect->geometric_normal);
+	isect->normal           = transform_direction(transform_object_to_world_normal, isect->normal);
+	isect->t = hit.t;
+}
+
+bool Object::
+occluded(Ray const& ray, float t_max) const
+{
+	HitRecord hit;
+	hit.t = t_max;
+	return intersect_hit(ray, &hit);
+}
+
+bool Object::
+get_local_bounds(AABB* aabb) const
+{
+	cg_assert(aabb);
+	return geo && geo->get_bounds(aabb);
+}
+
+bool Object::
+get_world_bounds(AABB* aabb) const
+{
+	cg_assert(aabb);
+	AABB local;
+	if (!get_local_bounds(&local))
+		return false;
+	if (!local.is_valid())
+		return true;
+	for (int i = 0; i < 8; ++i) {
+		glm::vec3 const corner(
+			(i & 1) ? local.max.x : local.min.x,
+			(i & 2) ? local.max.y : local.min.y,
+			(i & 4) ? local.max.z : local.min.z);
+		aabb->extend(transform_position(transform_object_to_world, corner));
+	}
+	return true;
+}
+
 void Object::
 compute_shading_info(Intersection* isect)
 {
@@ -80,14 +162,14 @@ compute_shading_info(const Ray rays[4], Intersection* isect)
 	}
 }
 
-void Object::
-get_intersection_uvs(glm::vec3 const positions[4], Intersection const& isect, glm::vec2 uvs[4])
+void
+get_intersection_uvs(TextureMapping const& mapping, glm::vec3 const positions[4], Intersection const& isect, glm::vec2 uvs[4])
 {
 	for (int i = 0; i < 4; ++i)
 	{
 		Intersection isect_corner = isect;
 		isect_corner.position = positions[i];
-		uvs[i] = get_uv(isect_corner);
+		uvs[i] = mapping.get_uv(isect_corner);
 	}
 
 	for (int k = 0; k < 2; ++k)
@@ -105,8 +187,8 @@ get_intersection_uvs(glm::vec3 const positions[4], Intersection const& isect, gl
 }
 
 // compute texel footprint in uv-space
-glm::vec2 Object::
-compute_uv_aabb_size(const Ray rays[4], Intersection const& isect)
+glm::vec2
+compute_uv_aabb_size(TextureMapping const& mapping, const Ray rays[4], Intersection const& isect)
 {
 	// TODO: compute intersection positions 
 	glm::vec3 intersection_positions[4] = {
@@ -122,7 +204,7 @@ compute_uv_aabb_size(const Ray rays[4], Intersection const& isect)
 
 	// compute uv coordinates from intersection positions
 	glm::vec2 intersection_uvs[4];
-	get_intersection_uvs(intersection_positions, isect, intersection_uvs);
+	get_intersection_uvs(mapping, intersection_positions, isect, intersection_uvs);
 		
 	// TODO: compute dudv = length of sides of AABB in uv space
 	glm::vec2 min_uv = isect.uv;
@@ -136,6 +218,18 @@ compute_uv_aabb_size(const Ray rays[4], Intersection const& isect)
 	return max_uv-min_uv;
 }
 
+void Object::
+get_intersection_uvs(glm::vec3 const positions[4], Intersection const& isect, glm::vec2 uvs[4])
+{
+	::get_intersection_uvs(*texture_mapping, positions, isect, uvs);
+}
+
+glm::vec2 Object::
+compute_uv_aabb_size(const Ray rays[4], Intersection const& isect)
+{
+	return ::compute_uv_aabb_size(*texture_mapping, rays, isect);
+}
+
 glm::vec2 Object::
 get_uv(Intersection const& isect)
 {
@@ -0,0 +1,468 @@
+#include <cglib/rt/primitive_bvh.h>
+#include <cglib/rt/bvh.h>
+#include <cglib/rt/intersection.h>
+#include <cglib/rt/intersection_tests.h>
+#include <cglib/rt/texture_mapping.h>
+#include <cglib/rt/top_level_bvh.h>
+#include <cglib/rt/transform.h>
+#include <cglib/rt/triangle_soup.h>
+
+#include <cglib/core/assert.h>
+
+#include <algorithm>
+#include <cfloat>
+
+int PrimitiveBVH::
+add_material(std::shared_ptr<Material> material_)
+{
+	cg_assert(material_);
+	materials.push_back(std::move(material_));
+	return int(materials.size()) - 1;
+}
+
+void PrimitiveBVH::
+add_triangles(TriangleSoup const& soup)
+{
+	int const soup_idx = int(soups.size());
+	int const first_material = int(materials.size());
+	soups.push_back(&soup);
+	for (auto const& m : soup.materials)
+		materials.push_back(std::make_shared<Material>(m));
+
+	for (int i = 0; i < soup.num_triangles; i++) {
+		TrianglePrimitive tri;
+		tri.v0 = soup.vertices[3 * i + 0];
+		tri.v1 = soup.vertices[3 * i + 1];
+		tri.v2 = soup.vertices[3 * i + 2];
+		tri.soup = soup_idx;
+		tri.triangle = i;
+		tri.material = first_material + soup.material_ids[i];
+		triangles.push_back(tri);
+	}
+}
+
+void PrimitiveBVH::
+add_sphere(glm::vec3 const& center, float radius, int material_, glm::vec2 const& scale_uv)
+{
+	cg_assert(material_ >= 0 && material_ < int(materials.size()));
+	SpherePrimitive sphere;
+	sphere.center = center;
+	sphere.radius = radius;
+	sphere.scale_uv = scale_uv;
+	sphere.material = material_;
+	spheres.push_back(sphere);
+}
+
+void PrimitiveBVH::
+add_quad(glm::vec3 const& center, glm::vec3 const& normal,
+		glm::vec3 const& e0, glm::vec3 const& e1, int material_, glm::vec2 const& scale_uv)
+{
+	cg_assert(material_ >= 0 && material_ < int(materials.size()));
+	cg_assert(glm::distance(normal, glm::normalize(glm::cross(
+					glm::normalize(e0),
+					glm::normalize(e1)))) < 1e-4);
+	QuadPrimitive quad;
+	quad.p = center - 0.5f * e0 - 0.5f * e1;
+	quad.e0 = e0;
+	quad.e1 = e1;
+	quad.normal = glm::normalize(normal);
+	quad.scale_uv = scale_uv;
+	quad.material = material_;
+	quads.push_back(quad);
+}
+
+void PrimitiveBVH::
+build()
+{
+	std::vector<Reference> refs;
+	refs.reserve(triangles.size() + spheres.size() + quads.size());
+	for (size_t i = 0; i < triangles.size(); i++) {
+		Reference r;
+		r.aabb.extend(triangles[i].v0);
+		r.aabb.extend(triangles[i].v1);
+		r.aabb.extend(triangles[i].v2);
+		r.type = PRIMITIVE_TRIANGLE;
+		r.index = int(i);
+		refs.push_back(r);
+	}
+	for (size_t i = 0; i < spheres.size(); i++) {
+		Reference r;
+		r.aabb.extend(spheres[i].center - glm::vec3(spheres[i].radius));
+		r.aabb.extend(spheres[i].center + glm::vec3(spheres[i].radius));
+		r.type = PRIMITIVE_SPHERE;
+		r.index = int(i);
+		refs.push_back(r);
+	}
+	for (size_t i = 0; i < quads.size(); i++) {
+		QuadPrimitive const& q = quads[i];
+		Reference r;
+		r.aabb.extend(q.p);
+		r.aabb.extend(q.p + q.e0);
+		r.aabb.extend(q.p + q.e1);
+		r.aabb.extend(q.p + q.e0 + q.e1);
+		r.type = PRIMITIVE_QUAD;
+		r.index = int(i);
+		refs.push_back(r);
+	}
+
+	std::vector<TrianglePrimitive> src_triangles;
+	std::vector<SpherePrimitive> src_spheres;
+	std::vector<QuadPrimitive> src_quads;
+	src_triangles.swap(triangles);
+	src_spheres.swap(spheres);
+	src_quads.swap(quads);
+
+	nodes.clear();
+	if (refs.empty())
+		return;
+	nodes.reserve(2 * refs.size());
+	nodes.emplace_back();
+	build_node(refs, 0, 0, int(refs.size()), 0, src_triangles, src_spheres, src_quads);
+}
+
+void PrimitiveBVH::
+build_node(std::vector<Reference> &refs, int node_idx, int first, int count, int depth,
+		std::vector<TrianglePrimitive> const& src_triangles,
+		std::vector<SpherePrimitive> const& src_spheres,
+		std::vector<QuadPrimitive> const& src_quads)
+{
+	AABB aabb, centroids;
+	for (int i = first; i < first + count; i++) {
+		aabb.extend(refs[i].aabb);
+		centroids.min = glm::min(centroids.min, refs[i].aabb.center());
+		centroids.max = glm::max(centroids.max, refs[i].aabb.center());
+	}
+	nodes[node_idx].aabb = aabb;
+
+	auto bin_of = [&](Reference const& r, int axis) {
+		float const extent = centroids.max[axis] - centroids.min[axis];
+		int const bin = int(NUM_BINS * (r.aabb.center()[axis] - centroids.min[axis]) / extent);
+		return std::min(std::max(bin, 0), int(NUM_BINS) - 1);
+	};
+
+	/* nodes at the depth limit become leaves, close to it they are halved */
+	bool const at_limit = depth >= BVH::MAX_DEPTH;
+	bool const halve = !at_limit
+		&& BVH::near_depth_limit(depth, count, MAX_PRIMITIVES_IN_LEAF);
+
+	/* binned SAH, splitting after best_bin along best_axis */
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	int best_bin = 0;
+	for (int axis = 0; axis < 3 && count > 1 && !at_limit && !halve; axis++) {
+		if (!(centroids.max[axis] > centroids.min[axis]))
+			continue;
+		AABB bins[NUM_BINS];
+		int counts[NUM_BINS] = { 0 };
+		for (int i = first; i < first + count; i++) {
+			int const b = bin_of(refs[i], axis);
+			bins[b].extend(refs[i].aabb);
+			counts[b]++;
+		}
+
+		float right_cost[NUM_BINS];
+		AABB right;
+		int num_right = 0;
+		for (int b = NUM_BINS - 1; b > 0; b--) {
+			right.extend(bins[b]);
+			num_right += counts[b];
+			right_cost[b] = float(num_right) * right.surface_area();
+		}
+		AABB left;
+		int num_left = 0;
+		for (int b = 0; b < NUM_BINS - 1; b++) {
+			left.extend(bins[b]);
+			num_left += counts[b];
+			float const cost = float(num_left) * left.surface_area() + right_cost[b + 1];
+			if (num_left > 0 && num_left < count && cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	/* the same surface area heuristic as BVH::split_sah */
+	float const area = aabb.surface_area();
+	float const split_cost = BVH::SAH_TRAVERSAL_COST
+		+ BVH::SAH_INTERSECTION_COST * best_cost / std::max(area, FLT_MIN);
+	float const leaf_cost = BVH::SAH_INTERSECTION_COST * float(count);
+	int num_left = 0;
+	if (best_axis >= 0 && (count > MAX_PRIMITIVES_IN_LEAF || split_cost < leaf_cost)) {
+		auto const mid = std::partition(refs.begin() + first, refs.begin() + first + count,
+				[&](Reference const& r) { return bin_of(r, best_axis) <= best_bin; });
+		num_left = int(mid - (refs.begin() + first));
+	}
+	else if (count > MAX_PRIMITIVES_IN_LEAF && !at_limit) {
+		/* object median along the axis of largest centroid extent, when
+		 * halving or when all centroids coincide */
+		glm::vec3 const extent = centroids.max - centroids.min;
+		int const axis = extent.x > extent.y
+			? (extent.x > extent.z ? 0 : 2)
+			: (extent.y > extent.z ? 1 : 2);
+		num_left = count / 2;
+		std::nth_element(refs.begin() + first, refs.begin() + first + num_left,
+				refs.begin() + first + count,
+				[&](Reference const& a, Reference const& b) {
+					return a.aabb.center()[axis] < b.aabb.center()[axis];
+				});
+	}
+
+	if (num_left == 0) {
+		Node &n = nodes[node_idx];
+		n.offset = -1;
+		n.first[PRIMITIVE_TRIANGLE] = int(triangles.size());
+		n.first[PRIMITIVE_SPHERE]   = int(spheres.size());
+		n.first[PRIMITIVE_QUAD]     = int(quads.size());
+		for (int i = first; i < first + count; i++) {
+			Reference const& r = refs[i];
+			switch (r.type) {
+			case PRIMITIVE_TRIANGLE: triangles.push_back(src_triangles[r.index]); break;
+			case PRIMITIVE_SPHERE:   spheres.push_back(src_spheres[r.index]); break;
+			default:                 quads.push_back(src_quads[r.index]); break;
+			}
+			n.count[r.type]++;
+		}
+		return;
+	}
+
+	int const left = int(nodes.size());
+	cg_assert(left == node_idx + 1);
+	nodes.emplace_back();
+	build_node(refs, left, first, num_left, depth + 1, src_triangles, src_spheres, src_quads);
+
+	int const right = int(nodes.size());
+	nodes.emplace_back();
+	build_node(refs, right, first + num_left, count - num_left, depth + 1, src_triangles, src_spheres, src_quads);
+
+	nodes[node_idx].offset = right;
+}
+
+template <bool any_hit>
+bool PrimitiveBVH::
+intersect_leaf(Node const& n, Ray const& ray, Hit &hit) const
+{
+	bool found = false;
+
+	int const first_triangle = n.first[PRIMITIVE_TRIANGLE];
+	for (int i = first_triangle; i < first_triangle + n.count[PRIMITIVE_TRIANGLE]; i++) {
+		TrianglePrimitive const& tri = triangles[i];
+		glm::vec3 bary;
+		float t;
+		if (intersect_triangle(ray.origin, ray.direction, tri.v0, tri.v1, tri.v2, bary, t)
+				&& t < hit.t) {
+			hit.t = t;
+			hit.type = PRIMITIVE_TRIANGLE;
+			hit.index = i;
+			hit.bary = bary;
+			found = true;
+			if (any_hit)
+				return true;
+		}
+	}
+	if (BVH::traversal_counters)
+		BVH::traversal_counters->triangles_tested += n.count[PRIMITIVE_TRIANGLE];
+
+	int const first_sphere = n.first[PRIMITIVE_SPHERE];
+	for (int i = first_sphere; i < first_sphere + n.count[PRIMITIVE_SPHERE]; i++) {
+		SpherePrimitive const& sphere = spheres[i];
+		float t;
+		if (intersect_sphere(ray.origin, ray.direction, sphere.center, sphere.radius, &t)
+				&& t < hit.t) {
+			hit.t = t;
+			hit.type = PRIMITIVE_SPHERE;
+			hit.index = i;
+			found = true;
+			if (any_hit)
+				return true;
+		}
+	}
+
+	int const first_quad = n.first[PRIMITIVE_QUAD];
+	for (int i = first_quad; i < first_quad + n.count[PRIMITIVE_QUAD]; i++) {
+		QuadPrimitive const& quad = quads[i];
+		float t;
+		if (!intersect_plane(ray.origin, ray.direction, quad.p, quad.normal, &t) || !(t < hit.t))
+			continue;
+		glm::vec3 const d = ray.origin + t * ray.direction - quad.p;
+		float const u = glm::dot(d, quad.e0) / glm::dot(quad.e0, quad.e0);
+		float const v = glm::dot(d, quad.e1) / glm::dot(quad.e1, quad.e1);
+		if (u < 0.f || u > 1.f || v < 0.f || v > 1.f)
+			continue;
+		hit.t = t;
+		hit.type = PRIMITIVE_QUAD;
+		hit.index = i;
+		found = true;
+		if (any_hit)
+			return true;
+	}
+
+	return found;
+}
+
+template <bool any_hit>
+bool PrimitiveBVH::
+traverse(Ray const& ray, Hit &hit) const
+{
+	bool found = false;
+	glm::vec3 const div = 1.0f / ray.direction;
+	TopLevelBVH::traverse(nodes, ray, div, hit.t, [&](Node const& n) -> bool {
+		if (intersect_leaf<any_hit>(n, ray, hit))
+			found = true;
+		return any_hit && found;
+	}, BVH::traversal_counters ? &BVH::traversal_counters->nodes_visited : nullptr);
+	return found;
+}
+
+bool PrimitiveBVH::
+intersect(Ray const& ray, Intersection* isect) const
+{
+	cg_assert(isect);
+	HitRecord hit;
+	hit.t = isect->t;
+	if (!intersect_hit(ray, &hit))
+		return false;
+	fill_intersection(ray, hit, isect);
+	return true;
+}
+
+bool PrimitiveBVH::
+intersect_hit(Ray const& ray, HitRecord* hit) const
+{
+	cg_assert(hit);
+	Hit nearest;
+	nearest.t = hit->t;
+	if (!traverse<false>(ray, nearest))
+		return false;
+
+	uint32_t id = uint32_t(nearest.index);
+	if (nearest.type == PRIMITIVE_SPHERE)
+		id += uint32_t(triangles.size());
+	else if (nearest.type == PRIMITIVE_QUAD)
+		id += uint32_t(triangles.size() + spheres.size());
+	hit->t = nearest.t;
+	hit->primitive_id = id;
+	hit->instance_id = 0;
+	hit->bary = glm::vec2(nearest.bary.y, nearest.bary.z);
+	return true;
+}
+
+void PrimitiveBVH::
+fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const
+{
+	cg_assert(isect);
+	*isect = Intersection();
+
+	int index;
+	switch (get_primitive(hit.primitive_id, &index)) {
+	case PRIMITIVE_TRIANGLE: {
+		TrianglePrimitive const& tri = triangles[index];
+		soups[tri.soup]->fill_intersection(isect, tri.triangle, hit.t, hit.barycentrics());
+		break;
+	}
+	case PRIMITIVE_SPHERE:
+		isect->t = hit.t;
+		isect->position = ray.origin + hit.t * ray.direction;
+		isect->normal = glm::normalize(isect->position - spheres[index].center);
+		isect->geometric_normal = isect->normal;
+		break;
+	default:
+		isect->t = hit.t;
+		isect->position = ray.origin + hit.t * ray.direction;
+		isect->normal = quads[index].normal;
+		isect->geometric_normal = isect->normal;
+		break;
+	}
+	isect->primitive_id = hit.primitive_id;
+}
+
+bool PrimitiveBVH::
+occluded(Ray const& ray, float t_max) const
+{
+	Hit hit;
+	hit.t = t_max;
+	return traverse<true>(ray, hit);
+}
+
+bool PrimitiveBVH::
+get_local_bounds(AABB* aabb) const
+{
+	cg_assert(aabb);
+	if (!nodes.empty())
+		*aabb = nodes[0].aabb;
+	return true;
+}
+
+PrimitiveBVH::PrimitiveType PrimitiveBVH::
+get_primitive(uint32_t primitive_id, int *index) const
+{
+	if (primitive_id < triangles.size()) {
+		*index = int(primitive_id);
+		return PRIMITIVE_TRIANGLE;
+	}
+	primitive_id -= uint32_t(triangles.size());
+	if (primitive_id < spheres.size()) {
+		*index = int(primitive_id);
+		return PRIMITIVE_SPHERE;
+	}
+	primitive_id -= uint32_t(spheres.size());
+	cg_assert(primitive_id < quads.size());
+	*index = int(primitive_id);
+	return PRIMITIVE_QUAD;
+}
+
+/*
+ * Shade an analytic primitive like Object::compute_shading_info does for
+ * an untransformed object with the given texture mapping.
+ */
+static void
+shade_mapped(TextureMapping const& mapping, Material const& material, Intersection* isect, const Ray *rays)
+{
+	mapping.compute_tangent_space(isect);
+	isect->uv = mapping.get_uv(*isect);
+	if (rays)
+		isect->dudv = compute_uv_aabb_size(mapping, rays, *isect);
+	isect->material.evaluate(material, *isect);
+	isect->shading_normal = transform_direction_to_object_space(isect->material.normal,
+		isect->normal, isect->tangent, isect->bitangent);
+}
+
+void PrimitiveBVH::
+shade(Intersection* isect, const Ray *rays)
+{
+	cg_assert(isect);
+	int index;
+	switch (get_primitive(isect->primitive_id, &index)) {
+	case PRIMITIVE_TRIANGLE: {
+		TrianglePrimitive const& tri = triangles[index];
+		if (rays)
+			isect->dudv = soups[tri.soup]->compute_uv_footprint(rays, tri.triangle);
+		isect->material.evaluate(*materials[tri.material], *isect);
+		break;
+	}
+	case PRIMITIVE_SPHERE: {
+		SpherePrimitive const& sphere = spheres[index];
+		shade_mapped(SphericalMapping(sphere.center, sphere.scale_uv),
+				*materials[sphere.material], isect, rays);
+		break;
+	}
+	default: {
+		QuadPrimitive const& quad = quads[index];
+		shade_mapped(PlanarMapping(quad.p, quad.normal, quad.e0, quad.e1, quad.scale_uv),
+				*materials[quad.material], isect, rays);
+		break;
+	}
+	}
+}
+
+void PrimitiveBVH::
+compute_shading_info(Intersection* isect)
+{
+	shade(isect, nullptr);
+}
+
+void PrimitiveBVH::
+compute_shading_info(const Ray rays[4], Intersection* isect)
+{
+	shade(isect, rays);
+}
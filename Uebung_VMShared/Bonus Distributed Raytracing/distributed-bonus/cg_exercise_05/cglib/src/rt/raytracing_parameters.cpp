@@ -2,6 +2,7 @@
 #include <cglib/core/gui.h>
 #include <cglib/rt/raytracing_context.h>
 #include <cglib/rt/scene.h>
+#include <cglib/rt/triangle_soup.h>
 
 /*
  * ImGui Notes:
@@ -21,10 +22,63 @@ TextureWrapMode RaytracingParameters::get_tex_wrap_mode() const
 	return (TextureWrapMode)tex_wrap_mode;
 }
 
+BVHBuildMode RaytracingParameters::get_bvh_build_mode() const
+{
+	return (BVHBuildMode)bvh_build_mode;
+}
+
+BVHNodeWidth RaytracingParameters::get_bvh_node_width() const
+{
+	return (BVHNodeWidth)bvh_node_width;
+}
+
+int RaytracingParameters::get_packet_block_size() const
+{
+	switch (ray_packet_mode) {
+	case PACKETS_2X2: return 2;
+	case PACKETS_4X4: return 4;
+	default:          return 1;
+	}
+}
+
 void RaytracingParameters::initialize()
 {
 }
 
+/*
+ * Statistics of the BVHs in the active scene, and the traversal work of
+ * the last frame that was rendered completely.
+ */
+static void display_bvh_statistics()
+{
+	RaytracingContext const* context = RaytracingContext::get_active();
+	std::vector<BVH*> const bvhs = context->get_active_scene()->get_bvhs();
+	for (size_t i = 0; i < bvhs.size(); i++)
+	{
+		BVH const* bvh = bvhs[i];
+		BVH::Stats const& stats = bvh->stats;
+		ImGui::Text("BVH %d: %d nodes, %d leaves, built in %.1f ms",
+				int(i), stats.num_nodes, stats.num_leaves, bvh->build_time_ms);
+		ImGui::Text("Depth %d, mean leaf depth %.1f", stats.max_depth, stats.mean_leaf_depth);
+		ImGui::Text("SAH cost %.2f, %.2f MB", stats.sah_cost, double(stats.memory_size) / (1024.0 * 1024.0));
+		ImGui::Text("%d references to %d triangles", stats.num_references, bvh->triangle_soup.num_triangles);
+
+		float leaf_sizes[BVH::SAH_MAX_TRIANGLES_IN_LEAF];
+		for (int n = 0; n < BVH::SAH_MAX_TRIANGLES_IN_LEAF; n++)
+			leaf_sizes[n] = float(stats.leaf_sizes[n + 1]);
+		ImGui::PushID(int(i));
+		ImGui::PlotHistogram("Leaf Sizes", leaf_sizes, BVH::SAH_MAX_TRIANGLES_IN_LEAF,
+				0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 50));
+		ImGui::PopID();
+	}
+
+	BVHTraversalCounters const& c = context->traversal_counters;
+	double const rays = double(std::max<uint64_t>(c.rays, 1));
+	ImGui::Text("Last frame: %.0f rays", double(c.rays));
+	ImGui::Text("Per ray: %.1f nodes, %.1f triangles, %.2f hits",
+			double(c.nodes_visited) / rays, double(c.triangles_tested) / rays, double(c.hits) / rays);
+}
+
 int RaytracingParameters::display_parameters()
 {
 	bool redraw = false;
@@ -54,6 +108,8 @@ int RaytracingParameters::display_parameters()
 "du dv:                   texture coordinate gradient length\n"
 "AABB Intersection Count: Number of AABBs that could be intersected by ray\n"
 "BVH Traversal Time:      Time spent on bvh traversal for primary hit\n"
+"Adaptive Samples:        Samples per pixel, red at 4x Pixel Samples\n"
+"Wavefront:               Recursive, traced one generation of rays per tile at a time\n"
 			);
 		}
 		if (render_mode == TIME
@@ -62,12 +118,34 @@ int RaytracingParameters::display_parameters()
 		{
 			redraw |= ImGui::DragFloat("Render Time Exposure", &scale_render_time, 0.1f, 0.f, 1000.f);
 		}
+		refresh_scene |= ImGui::Combo("BVH Builder", &bvh_build_mode, &bvh_build_mode_names[0], BVH_BUILD_MODE_COUNT);
+		refresh_scene |= ImGui::Combo("BVH Node Width", &bvh_node_width, &bvh_node_width_names[0], BVH_NODE_WIDTH_COUNT);
+		refresh_scene |= ImGui::DragFloat("Monkey Twist", &monkey_twist, 0.01f, -3.f, 3.f);
+		redraw |= ImGui::Combo("Ray Packets", &ray_packet_mode, &ray_packet_mode_names[0], RAY_PACKET_MODE_COUNT);
+		redraw |= ImGui::Combo("Tile Order", &tile_order, &tile_order_names[0], TILE_ORDER_COUNT);
 		redraw |= ImGui::InputInt("Max Recursion Depth", &max_depth);
 		redraw |= ImGui::DragFloat("Ray Epsilon", &ray_epsilon, 0.00001f, 0.0f, 0.f, "%.7f");
 		redraw |= ImGui::DragFloat("Field of View Y", &fovy);
 		redraw |= ImGui::InputInt("Render Threads", &num_threads);
 		redraw |= ImGui::Checkbox("Stratified Samples", &stratified);
 		redraw |= ImGui::InputInt("Pixel Samples", &spp);
+		redraw |= ImGui::Checkbox("Progressive", &progressive);
+		if (progressive) {
+			ImGui::InputInt("Max Passes", &max_passes);
+			int const passes = RaytracingContext::get_active()->accumulated_passes;
+			ImGui::Text("%d passes, %d samples per pixel", passes, passes * spp);
+		}
+		redraw |= ImGui::Checkbox("Frame Time Budget", &frame_budget);
+		if (frame_budget) {
+			redraw |= ImGui::DragFloat("Budget (ms)", &frame_budget_ms, 1.f, 1.f, 1000.f);
+			float const scale = RaytracingContext::get_active()->preview_scale;
+			ImGui::Text("Preview at %d%% resolution", int(100.f * scale + 0.5f));
+		}
+		redraw |= ImGui::Checkbox("Adaptive Sampling", &adaptive_sampling);
+		if (adaptive_sampling) {
+			redraw |= ImGui::InputInt("Min Pixel Samples", &adaptive_min_spp);
+			redraw |= ImGui::DragFloat("Error Target", &adaptive_error, 0.001f, 0.f, 1.f, "%.4f");
+		}
 		redraw |= ImGui::Checkbox("Stereo Rendering", &stereo);
 		if (stereo) {
 			redraw |= ImGui::DragFloat("Eye Separation", &eye_separation, 0.01f, 0.f, 0.f);
@@ -105,6 +183,11 @@ int RaytracingParameters::display_parameters()
 		refresh_scene |= ImGui::Combo("Texture Wrap", &tex_wrap_mode, &tex_wrap_mode_names[0], TEXTURE_WRAP_MODE_COUNT);
 	}
 
+	if (ImGui::CollapsingHeader("BVH Statistics"))
+	{
+		display_bvh_statistics();
+	}
+
 	auto flags = 0
 		| (redraw        ? GUI::FLAG_REDRAW        : 0)
 		| (refresh_scene ? GUI::FLAG_REFRESH_SCENE : 0);
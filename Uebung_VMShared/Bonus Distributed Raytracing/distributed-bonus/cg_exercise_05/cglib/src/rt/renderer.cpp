@@ -1,5 +1,6 @@
 #include <cglib/rt/renderer.h>
 
+#include <cglib/rt/bvh.h>
 #include <cglib/rt/epsilon.h>
 #include <cglib/rt/intersection.h>
 #include <cglib/rt/object.h>
@@ -80,6 +81,8 @@ float fresnel(glm::vec3 const& v, glm::vec3 const& n, float eta)
 
 Ray createPrimaryRay(RenderData& data, float x, float y)
 {
+    x /= data.context.render_scale;
+    y /= data.context.render_scale;
     const float height = static_cast<float>(data.context.params.image_height);
     const float width = static_cast<float>(data.context.params.image_width);
     const glm::vec4 origin_view_space(0.f, 0.f, 0.f, 1.f);
@@ -102,14 +105,7 @@ bool visible(
     const glm::vec3 d = glm::normalize(to-from);
     const float dist = glm::length(to-from) - 2.f*data.context.params.ray_epsilon;
     Ray ray_eps(from + data.context.params.ray_epsilon * d, d);
-    for (auto& o : data.context.get_active_scene()->objects) {
-        cg_assert(o);
-        Intersection isect;
-        if (o->intersect(ray_eps, &isect) && isect.t < dist) {
-            return false;
-        }
-    }
-    return true;
+    return !data.context.get_active_scene()->tlas.occluded(ray_eps, dist);
 }
 
 bool shoot_ray(RenderData &data, Ray const& ray, Intersection* isect)
@@ -120,16 +116,7 @@ bool shoot_ray(RenderData &data, Ray const& ray, Intersection* isect)
     
 	Ray ray_eps(ray.origin + data.context.params.ray_epsilon * ray.direction, ray.direction);
 
-    bool found_intersection = false;
-    for (auto& o : data.context.get_active_scene()->objects) {
-        cg_assert(o);
-        Intersection isect_temp;
-        if (o->intersect(ray_eps, &isect_temp) && isect_temp.t < isect->t) {
-            found_intersection = true;
-            object = o.get();
-            *isect = isect_temp;
-        }
-    }
+    bool found_intersection = data.context.get_active_scene()->tlas.intersect(ray_eps, isect, &object);
 
     if(found_intersection) {
         cg_assert(object);
@@ -151,16 +138,7 @@ bool shoot_ray(
     cg_assert(isect);
     Ray ray_eps(ray.origin + data.context.params.ray_epsilon * ray.direction, ray.direction);
 
-    bool found_intersection = false;
-    for (auto& o : data.context.get_active_scene()->objects) {
-        cg_assert(o);
-        Intersection isect_temp;
-        if (o->intersect(ray_eps, &isect_temp) && isect_temp.t < isect->t) {
-            found_intersection = true;
-            object = o.get();
-            *isect = isect_temp;
-        }
-    }
+    bool found_intersection = data.context.get_active_scene()->tlas.intersect(ray_eps, isect, &object);
 
     if(found_intersection) {
         cg_assert(object);
@@ -171,6 +149,72 @@ bool shoot_ray(
     return false;
 }
 
+int trace_primary_packet(RenderData &data, Ray const rays[], int num_rays)
+{
+	PrimaryHits *hits = data.tld->primary_hits;
+	if (!hits)
+		return -1;
+
+	if (hits->size + num_rays > PrimaryHits::CAPACITY)
+		hits->clear();
+	int const first_hit = hits->size;
+	num_rays = std::min(num_rays, int(PrimaryHits::CAPACITY) - first_hit);
+
+	int const packet_size = BVH::MAX_PACKET_SIZE;
+	for (int first = 0; first < num_rays; first += packet_size) {
+		int const size = std::min(num_rays - first, packet_size);
+
+		/* same as shoot_ray, the nearest hit over all objects wins */
+		Ray rays_eps[packet_size];
+		HitRecord packet_hits[packet_size];
+		for (int i = 0; i < size; i++) {
+			Ray const& ray = rays[first + i];
+			rays_eps[i] = Ray(ray.origin + data.context.params.ray_epsilon * ray.direction, ray.direction);
+		}
+
+		TopLevelBVH const& tlas = data.context.get_active_scene()->tlas;
+		tlas.intersect_packet(rays_eps, size, packet_hits);
+
+		for (int i = 0; i < size; i++) {
+			hits->hits[hits->size]    = packet_hits[i];
+			hits->objects[hits->size] = tlas.get_object(packet_hits[i]);
+			hits->size++;
+		}
+	}
+	return first_hit;
+}
+
+/*
+ * Like shoot_ray, but takes the first hit at data.primary_hit from
+ * data.tld->primary_hits if there is one. corner_rays may be nullptr.
+ */
+static bool shoot_primary_ray(
+	RenderData &data,
+	Ray const& ray,
+	const Ray corner_rays[4],
+	Intersection* isect)
+{
+	PrimaryHits const* hits = data.tld->primary_hits;
+	int const idx = data.primary_hit;
+	data.primary_hit = -1;
+	if (!hits || idx < 0 || idx >= hits->size) {
+		return corner_rays ? shoot_ray(data, ray, corner_rays, isect)
+		                   : shoot_ray(data, ray, isect);
+	}
+
+	Object* object = hits->objects[idx];
+	if (!object)
+		return false;
+
+	Ray const ray_eps(ray.origin + data.context.params.ray_epsilon * ray.direction, ray.direction);
+	data.context.get_active_scene()->tlas.fill_intersection(ray_eps, hits->hits[idx], isect);
+	if (corner_rays)
+		object->compute_shading_info(corner_rays, isect);
+	else
+		object->compute_shading_info(isect);
+	return true;
+}
+
 glm::vec3 evaluate_ambient(
 	RenderData &data,			// class containing raytracing information
 	MaterialSample const& mat,	// the material at position
@@ -254,15 +298,10 @@ float max_unobstructed_distance(
 {
 	data.num_cast_rays++;
     Ray ray_eps(from + data.context.params.ray_epsilon * dir, dir);
-	float closest_hit = FLT_MAX;
-    for (auto& o : data.context.get_active_scene()->objects) {
-        cg_assert(o);
-        Intersection isect;
-        if (o->intersect(ray_eps, &isect) && isect.t < closest_hit) {
-            closest_hit = isect.t + data.context.params.ray_epsilon;
-        }
-    }
-    return closest_hit;
+	HitRecord hit;
+	if (data.context.get_active_scene()->tlas.intersect(ray_eps, &hit))
+		return hit.t + data.context.params.ray_epsilon;
+	return FLT_MAX;
 }
 
 glm::vec3 evaluate_phong_BRDF(
@@ -413,7 +452,10 @@ glm::vec3 trace_recursive(RenderData & data, Ray const& ray, int depth)
                        createPrimaryRay(data, (data.x + 0.5f), (data.y + 0.5f)),
                        createPrimaryRay(data, (data.x - 0.5f), (data.y + 0.5f)),
                        createPrimaryRay(data, (data.x + 0.5f), (data.y - 0.5f))};
-        found_intersection = shoot_ray(data, ray, rays, &isect);
+        found_intersection = shoot_primary_ray(data, ray, rays, &isect);
+    }
+    else if (depth == 0) {
+        found_intersection = shoot_primary_ray(data, ray, nullptr, &isect);
     }
     else {
         found_intersection = shoot_ray(data, ray, &isect);
@@ -9,6 +9,9 @@
 #include <cglib/rt/transform.h>
 
 #include <cglib/rt/bvh.h>
+#include <cglib/rt/bvh_cache.h>
+#include <cglib/rt/instance_group.h>
+#include <cglib/rt/primitive_bvh.h>
 #include <cglib/rt/triangle_soup.h>
 
 #include <cglib/core/camera.h>
@@ -28,6 +31,31 @@ set_active_camera()
 		camera->set_active();
 }
 
+std::vector<BVH*> Scene::
+get_bvhs() const
+{
+	std::vector<BVH*> bvhs;
+	for (auto &o : objects) {
+		if (BVH *bvh = dynamic_cast<BVH *>(o.get()))
+			bvhs.push_back(bvh);
+		else if (InstanceGroup *group = dynamic_cast<InstanceGroup *>(o.get()))
+			for (auto &mesh : group->meshes)
+				bvhs.push_back(mesh.get());
+	}
+	return bvhs;
+}
+
+void Scene::
+update_bvhs(RaytracingParameters const& params)
+{
+	for (BVH *bvh : get_bvhs()) {
+		if (bvh->build_mode != params.get_bvh_build_mode())
+			bvh->rebuild(params.get_bvh_build_mode(), params.get_bvh_node_width());
+		else if (bvh->node_width != params.get_bvh_node_width())
+			bvh->set_node_width(params.get_bvh_node_width());
+	}
+}
+
 PoolTableScene::PoolTableScene(RaytracingParameters & params)
 {
     init_camera(params);
@@ -134,6 +162,8 @@ void PoolTableScene::init_scene(RaytracingParameters const& params)
 	area_lights.emplace_back(new AreaLight(
 		glm::vec3(-1.0354f, 6.41604f, 11.5f), glm::vec3(1.5f, 0.f, 0.0f), glm::vec3(0.0f, 1.0f, 2.0f), glm::vec3(2000.f)));
 	lights.emplace_back(new Light(area_lights.back()->getPosition(), area_lights.back()->getPower()));
+
+	tlas.build(objects);
 }
 
 void PoolTableScene::refresh_scene(RaytracingParameters const& params)
@@ -142,6 +172,8 @@ void PoolTableScene::refresh_scene(RaytracingParameters const& params)
         tex.second->filter_mode = params.get_tex_filter_mode();
         tex.second->wrap_mode = params.get_tex_wrap_mode();
     }
+
+	tlas.build(objects);
 }
 
 void PoolTableScene::init_camera(RaytracingParameters& params)
@@ -250,6 +282,8 @@ void GoBoardScene::init_scene(RaytracingParameters const& params)
 	textures.insert({"envmap",  std::make_shared<ImageTexture>("assets/warehouse.jpg", NEAREST, REPEAT)});
 	textures["envmap"]->create_mipmap();
 	env_map = textures["envmap"].get();
+
+	tlas.build(objects);
 }
 
 void GoBoardScene::refresh_scene(RaytracingParameters const& params)
@@ -258,6 +292,8 @@ void GoBoardScene::refresh_scene(RaytracingParameters const& params)
         tex.second->filter_mode = params.get_tex_filter_mode();
         tex.second->wrap_mode = params.get_tex_wrap_mode();
     }
+
+	tlas.build(objects);
 }
 
 void GoBoardScene::init_camera(RaytracingParameters& params)
@@ -331,8 +367,10 @@ void TriangleScene::init_scene(RaytracingParameters const& params)
     soups.clear();
 
 	soups.emplace_back(createTriangleSoup(params.num_triangles));
-    objects.emplace_back(new BVH(*soups.back()));
+    objects.emplace_back(new BVH(*soups.back(), params.get_bvh_build_mode(), params.get_bvh_node_width()));
     lights.emplace_back(new Light(glm::vec3(0.f, 200.f, 400.f), glm::vec3(15000.f)));
+
+	tlas.build(objects);
 }
 
 void TriangleScene::refresh_scene(RaytracingParameters const& params)
@@ -341,7 +379,9 @@ void TriangleScene::refresh_scene(RaytracingParameters const& params)
     objects.clear();
     
 	soups.emplace_back(createTriangleSoup(params.num_triangles));
-	objects.emplace_back(new BVH(*soups.back()));
+	objects.emplace_back(new BVH(*soups.back(), params.get_bvh_build_mode(), params.get_bvh_node_width()));
+
+	tlas.build(objects);
 }
 
 void TriangleScene::init_camera(RaytracingParameters& params)
@@ -382,7 +422,11 @@ void MonkeyScene::init_scene(RaytracingParameters const& params)
 	
     soups.push_back(std::make_shared<TriangleSoup>(
 		"assets/suzanne.obj", &this->textures));
-    objects.emplace_back(new BVH(*soups.back()));
+	rest_vertices = soups.back()->vertices;
+	rest_normals  = soups.back()->normals;
+	twist = 0.f;
+    objects.emplace_back(new BVH(*soups.back(), params.get_bvh_build_mode(), params.get_bvh_node_width()));
+	twist_monkey(params.monkey_twist);
 	objects.back()->set_transform_object_to_world(
 		glm::translate(glm::mat4(1.0), glm::vec3(0.f, 2.f, 0.f)) * 
 		glm::scale(glm::mat4(1.0), glm::vec3(3.f, 3.f, 3.f)));
@@ -400,10 +444,39 @@ void MonkeyScene::init_scene(RaytracingParameters const& params)
 	lights.emplace_back(new Light(area_lights.back()->getPosition(), area_lights.back()->getPower()));
 
 	env_map = textures["appartment_env"].get();
+
+	tlas.build(objects);
 }
 
 void MonkeyScene::refresh_scene(RaytracingParameters const& params)
 {
+	update_bvhs(params);
+	twist_monkey(params.monkey_twist);
+
+	tlas.build(objects);
+}
+
+void MonkeyScene::twist_monkey(float twist_)
+{
+	if (twist_ == twist)
+		return;
+	twist = twist_;
+
+	TriangleSoup &soup = *soups.front();
+	for (size_t i = 0; i < rest_vertices.size(); ++i) {
+		float const angle = twist * rest_vertices[i].y;
+		float const c = std::cos(angle), s = std::sin(angle);
+		auto const rotate = [c, s](glm::vec3 const& v) {
+			return glm::vec3(c * v.x + s * v.z, v.y, c * v.z - s * v.x);
+		};
+		soup.vertices[i] = rotate(rest_vertices[i]);
+		soup.normals[i]  = rotate(rest_normals[i]);
+	}
+
+	/* the monkey is the first object */
+	BVH *bvh = static_cast<BVH*>(objects.front().get());
+	if (!bvh->refit())
+		bvh->rebuild(bvh->build_mode, bvh->node_width);
 }
 
 void MonkeyScene::init_camera(RaytracingParameters& params)
@@ -434,9 +507,10 @@ void SponzaScene::init_scene(RaytracingParameters const& params)
 		objects.back()->material->n = (i + 1) * 10.0f;
 	}
 
-	auto objTriangles = std::make_shared<TriangleSoup>("assets/crytek-sponza/sponza_subdiv3.obj", &this->textures);
+	std::shared_ptr<TriangleSoup> objTriangles;
+	objects.emplace_back(load_obj_bvh("assets/crytek-sponza/sponza_subdiv3.obj", &this->textures,
+		params.get_bvh_build_mode(), params.get_bvh_node_width(), &objTriangles));
 	soups.push_back(objTriangles);
-	objects.emplace_back(new BVH(*objTriangles));
 	objects.back()->set_transform_object_to_world(
 		glm::scale(glm::mat4(1.0), glm::vec3(0.01f)));
 	//for (auto& m : objTriangles->materials)
@@ -447,6 +521,8 @@ void SponzaScene::init_scene(RaytracingParameters const& params)
 	lights.emplace_back(new Light(area_lights.back()->getPosition(), area_lights.back()->getPower()));
 	//lights.emplace_back(new AreaLight(
 	//	glm::vec3(-14.2f, 0.0f, 0.9f), 2.0f * glm::vec3(0.0f, 0.f, -1.0f), glm::vec3(0.0f, 2.0f, 0.0f), glm::vec3(100.f)));
+
+	tlas.build(objects);
 }
 
 void SponzaScene::refresh_scene(RaytracingParameters const& params)
@@ -455,10 +531,13 @@ void SponzaScene::refresh_scene(RaytracingParameters const& params)
 		init_scene(params);
 		scene_loaded = true;
 	}
+	update_bvhs(params);
 	for (auto &tex : textures) {
 		tex.second->filter_mode = params.get_tex_filter_mode();
 		tex.second->wrap_mode = params.get_tex_wrap_mode();
 	}
+
+	tlas.build(objects);
 }
 
 void SponzaScene::init_camera(RaytracingParameters& params)
@@ -470,3 +549,207 @@ void SponzaScene::init_camera(RaytracingParameters& params)
 		params.focal_distance);
 }
 
+
+InstancingScene::InstancingScene(RaytracingParameters& params)
+{
+	init_camera(params);
+	init_scene(params);
+}
+
+void InstancingScene::init_scene(RaytracingParameters const& params)
+{
+	objects.clear();
+	lights.clear();
+	textures.clear();
+	soups.clear();
+
+	textures.insert({"floor", std::make_shared<ImageTexture>(
+		"assets/checker.tga", params.get_tex_filter_mode(),
+		params.get_tex_wrap_mode(), 2.2f)});
+	textures["floor"]->create_mipmap();
+
+	std::shared_ptr<Image> appartment = std::make_shared<Image>();
+	appartment->load("assets/appartment.jpg", 1.f);
+	textures.insert({"appartment_env",
+		std::make_shared<ImageTexture>(*appartment,
+		BILINEAR, REPEAT)});
+	textures["appartment_env"]->create_mipmap();
+	env_map = textures["appartment_env"].get();
+
+	soups.push_back(std::make_shared<TriangleSoup>(
+		"assets/suzanne.obj", &this->textures));
+	std::unique_ptr<InstanceGroup> group(new InstanceGroup());
+	int const monkey = group->add_mesh(std::make_shared<BVH>(
+		*soups.back(), params.get_bvh_build_mode(), params.get_bvh_node_width()));
+
+	glm::vec3 const colors[] = {
+		glm::vec3(0.9f, 0.1f, 0.1f),
+		glm::vec3(0.1f, 0.9f, 0.1f),
+		glm::vec3(0.1f, 0.1f, 0.9f),
+	};
+	for (glm::vec3 const& c : colors) {
+		auto material = std::make_shared<Material>();
+		material->k_d = std::make_shared<ConstTexture>(c);
+		group->add_material(material);
+	}
+
+	std::minstd_rand rng_engine(1337);
+	std::uniform_real_distribution<float> uniform_dist(0, 1);
+	auto rand = [&]() { return uniform_dist(rng_engine); };
+
+	int const grid_size = 40;
+	for (int z = 0; z < grid_size; ++z) {
+		for (int x = 0; x < grid_size; ++x) {
+			glm::vec3 const pos(
+				3.f * (x - 0.5f * (grid_size - 1)), -1.f, -3.f * z);
+			int const material = int(rand() * 4.f) - 1;
+			group->add_instance(monkey,
+				glm::translate(glm::mat4(1.0f), pos) *
+				glm::rotate(glm::mat4(1.0f), float(0.5f * M_PI * (rand() - 0.5f)),
+					glm::vec3(0.f, 1.f, 0.f)),
+				std::min(material, 2));
+		}
+	}
+	group->build();
+	objects.emplace_back(std::move(group));
+
+	objects.emplace_back((create_plane(
+		glm::vec3(0.f, -2.f, 0.f),
+		glm::vec3(0.f, 1.f, 0.f),
+		glm::vec3(1.f, 0.f, 0.f),
+		glm::vec3(0.f, 0.f, -1.f),
+		glm::vec2(4.f))));
+	objects.back()->material->k_d = textures["floor"];
+
+	area_lights.emplace_back(new AreaLight(
+		glm::vec3(8.5f, 7.5f, 5.5f), glm::vec3(1.5f, 0.f, -1.5f), glm::vec3(-1.5f, -1.5f, 1.5f), glm::vec3(1000.f)));
+	lights.emplace_back(new Light(area_lights.back()->getPosition(), area_lights.back()->getPower()));
+
+	tlas.build(objects);
+}
+
+void InstancingScene::refresh_scene(RaytracingParameters const& params)
+{
+	update_bvhs(params);
+
+	tlas.build(objects);
+}
+
+void InstancingScene::init_camera(RaytracingParameters& params)
+{
+	camera = std::make_shared<LookAroundCamera>(
+		glm::vec3(0.f, 4.f, 10.f),
+		glm::vec3(0.f, 0.f, -20.f),
+		params.eye_separation,
+		params.focal_distance);
+}
+
+SphereFlakeScene::SphereFlakeScene(RaytracingParameters& params)
+{
+	init_camera(params);
+	init_scene(params);
+}
+
+/*
+ * Add a sphere with nine spheres of a third of its radius on the side that
+ * faces up, each of them a flake of one level less.
+ */
+static void
+add_sphere_flake(PrimitiveBVH &bvh, glm::vec3 const& center, float radius,
+		glm::vec3 const& up, int level, int first_material)
+{
+	bvh.add_sphere(center, radius, first_material + level);
+	if (level == 0)
+		return;
+
+	glm::vec3 const tangent = glm::normalize(glm::cross(up,
+			std::fabs(up.x) > 0.9f ? glm::vec3(0.f, 1.f, 0.f) : glm::vec3(1.f, 0.f, 0.f)));
+	glm::vec3 const bitangent = glm::cross(up, tangent);
+	float const child_radius = radius / 3.f;
+	for (int i = 0; i < 9; ++i) {
+		/* six children around the equator, three above them */
+		float const elevation = i < 6 ? 0.f : float(M_PI) / 3.f;
+		float const azimuth = i < 6
+			? float(i) * float(M_PI) / 3.f
+			: float(i - 6) * 2.f * float(M_PI) / 3.f + float(M_PI) / 6.f;
+		glm::vec3 const dir = std::cos(elevation) * (std::cos(azimuth) * tangent + std::sin(azimuth) * bitangent)
+			+ std::sin(elevation) * up;
+		add_sphere_flake(bvh, center + dir * (radius + child_radius), child_radius,
+				dir, level - 1, first_material);
+	}
+}
+
+void SphereFlakeScene::init_scene(RaytracingParameters const& params)
+{
+	objects.clear();
+	lights.clear();
+	textures.clear();
+	soups.clear();
+
+	textures.insert({"floor", std::make_shared<ImageTexture>(
+		"assets/checker.tga", params.get_tex_filter_mode(),
+		params.get_tex_wrap_mode(), 2.2f)});
+	textures["floor"]->create_mipmap();
+
+	std::shared_ptr<Image> appartment = std::make_shared<Image>();
+	appartment->load("assets/appartment.jpg", 1.f);
+	textures.insert({"appartment_env",
+		std::make_shared<ImageTexture>(*appartment,
+		BILINEAR, REPEAT)});
+	textures["appartment_env"]->create_mipmap();
+	env_map = textures["appartment_env"].get();
+
+	std::unique_ptr<PrimitiveBVH> bvh(new PrimitiveBVH());
+
+	soups.push_back(std::make_shared<TriangleSoup>(
+		"assets/suzanne.obj", &this->textures));
+	bvh->add_triangles(*soups.back());
+
+	int const num_levels = 5;
+	int const first_material = int(bvh->materials.size());
+	for (int level = 0; level < num_levels; ++level) {
+		float const f = float(level) / float(num_levels - 1);
+		auto material = std::make_shared<Material>();
+		material->k_d = std::make_shared<ConstTexture>(glm::mix(
+			glm::vec3(0.8f, 0.7f, 0.2f), glm::vec3(0.2f, 0.3f, 0.8f), f));
+		material->k_s = std::make_shared<ConstTexture>(glm::vec3(1.0f));
+		material->n = 200.f;
+		material->k_r = std::make_shared<ConstTexture>(glm::vec3(0.2f));
+		bvh->add_material(material);
+	}
+	add_sphere_flake(*bvh, glm::vec3(3.f, -0.5f, 0.f), 1.f, glm::vec3(0.f, 1.f, 0.f),
+			num_levels - 1, first_material);
+
+	auto floor = std::make_shared<Material>();
+	floor->k_d = textures["floor"];
+	bvh->add_quad(
+		glm::vec3(0.f, -1.5f, 0.f),
+		glm::vec3(0.f, 1.f, 0.f),
+		glm::vec3(20.f, 0.f, 0.f),
+		glm::vec3(0.f, 0.f, -20.f),
+		bvh->add_material(floor),
+		glm::vec2(4.f));
+
+	bvh->build();
+	objects.emplace_back(std::move(bvh));
+
+	area_lights.emplace_back(new AreaLight(
+		glm::vec3(-4.f, 7.5f, 9.f), glm::vec3(1.5f, 0.f, 1.5f), glm::vec3(1.5f, -1.5f, -1.5f), glm::vec3(1000.f)));
+	lights.emplace_back(new Light(area_lights.back()->getPosition(), area_lights.back()->getPower()));
+
+	tlas.build(objects);
+}
+
+void SphereFlakeScene::refresh_scene(RaytracingParameters const& params)
+{
+	tlas.build(objects);
+}
+
+void SphereFlakeScene::init_camera(RaytracingParameters& params)
+{
+	camera = std::make_shared<LookAroundCamera>(
+		glm::vec3(1.5f, 1.5f, 8.f),
+		glm::vec3(1.5f, -0.5f, 0.f),
+		params.eye_separation,
+		params.focal_distance);
+}
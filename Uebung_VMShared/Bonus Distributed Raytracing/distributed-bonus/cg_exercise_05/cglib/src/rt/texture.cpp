@@ -21,7 +21,7 @@ ImageTexture::ImageTexture(
     TextureFilterMode filter_mode_,
     TextureWrapMode wrap_mode_,
     float gamma_) :
-    Texture(),
+    Texture(TEXTURE_IMAGE),
     filter_mode(filter_mode_),
     wrap_mode(wrap_mode_)
 {
@@ -33,7 +33,7 @@ ImageTexture::ImageTexture(
     Image const& image,
     TextureFilterMode filter_mode_,
     TextureWrapMode wrap_mode_) :
-    Texture(),
+    Texture(TEXTURE_IMAGE),
     filter_mode(filter_mode_),
     wrap_mode(wrap_mode_)
 {
@@ -0,0 +1,378 @@
+#include <cglib/rt/top_level_bvh.h>
+#include <cglib/rt/bvh.h>
+#include <cglib/rt/instance_group.h>
+#include <cglib/rt/intersectable.h>
+#include <cglib/rt/object.h>
+#include <cglib/rt/intersection.h>
+#include <cglib/rt/primitive_bvh.h>
+
+#include <cglib/core/assert.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <typeinfo>
+
+void TopLevelBVH::
+build(std::vector<std::unique_ptr<Object>> const& objects)
+{
+	nodes.clear();
+	scene_objects.clear();
+	object_kinds.clear();
+	object_bounds.clear();
+	leaf_objects.clear();
+	unbounded_objects.clear();
+	meshes.clear();
+
+	for (auto &o : objects) {
+		cg_assert(o);
+		int const idx = int(scene_objects.size());
+		AABB aabb;
+		scene_objects.push_back(o.get());
+		object_kinds.push_back(get_kind(*o));
+		if (object_kinds.back() == OBJECT_MESH)
+			meshes.push_back(static_cast<BVH*>(o.get()));
+		if (!o->get_world_bounds(&aabb))
+			unbounded_objects.push_back(idx);
+		else if (aabb.is_valid()) /* objects with empty bounds are never hit */
+			leaf_objects.push_back(idx);
+		object_bounds.push_back(aabb);
+	}
+
+	build_tree(object_bounds, leaf_objects, nodes);
+}
+
+void TopLevelBVH::
+build_tree(std::vector<AABB> const& bounds, std::vector<int> &leaf_items, std::vector<Node> &out)
+{
+	out.clear();
+	if (leaf_items.empty())
+		return;
+	out.reserve(2 * leaf_items.size());
+	out.emplace_back();
+	build_node(bounds, leaf_items, out, 0, 0, int(leaf_items.size()));
+}
+
+void TopLevelBVH::
+build_node(std::vector<AABB> const& bounds, std::vector<int> &leaf_items,
+		std::vector<Node> &out, int node_idx, int first, int count)
+{
+	AABB aabb, centroids;
+	for (int i = first; i < first + count; i++) {
+		AABB const& b = bounds[leaf_items[i]];
+		aabb.extend(b);
+		centroids.min = glm::min(centroids.min, b.center());
+		centroids.max = glm::max(centroids.max, b.center());
+	}
+	out[node_idx].aabb = aabb;
+
+	if (count <= MAX_OBJECTS_IN_LEAF) {
+		out[node_idx].offset = first;
+		out[node_idx].num_objects = count;
+		return;
+	}
+
+	/* object median along the axis of largest centroid extent */
+	glm::vec3 const extent = centroids.max - centroids.min;
+	int const axis = extent.x > extent.y
+		? (extent.x > extent.z ? 0 : 2)
+		: (extent.y > extent.z ? 1 : 2);
+	int const num_left = count / 2;
+	std::nth_element(leaf_items.begin() + first,
+			leaf_items.begin() + first + num_left,
+			leaf_items.begin() + first + count,
+			[&](int a, int b) {
+				float const ca = bounds[a].center()[axis];
+				float const cb = bounds[b].center()[axis];
+				return ca < cb || (ca == cb && a < b);
+			});
+
+	int const left = int(out.size());
+	cg_assert(left == node_idx + 1);
+	out.emplace_back();
+	build_node(bounds, leaf_items, out, left, first, num_left);
+
+	int const right = int(out.size());
+	out.emplace_back();
+	build_node(bounds, leaf_items, out, right, first + num_left, count - num_left);
+
+	out[node_idx].offset = right;
+	out[node_idx].num_objects = 0;
+}
+
+TopLevelBVH::ObjectKind TopLevelBVH::
+get_kind(Object const& object)
+{
+	/* exact types only, a derived class may override the routines */
+	std::type_info const& type = typeid(object);
+	if (type == typeid(BVH))
+		return OBJECT_MESH;
+	if (type == typeid(InstanceGroup))
+		return OBJECT_INSTANCE_GROUP;
+	if (type == typeid(PrimitiveBVH))
+		return OBJECT_PRIMITIVE_BVH;
+	if (type != typeid(Object) || !object.geo)
+		return OBJECT_OTHER;
+
+	std::type_info const& geo_type = typeid(*object.geo);
+	if (geo_type == typeid(Sphere))
+		return OBJECT_SPHERE;
+	if (geo_type == typeid(Plane))
+		return OBJECT_PLANE;
+	if (geo_type == typeid(Quad))
+		return OBJECT_QUAD;
+	return OBJECT_OTHER;
+}
+
+bool TopLevelBVH::
+intersect_hit(int idx, Ray const& ray, HitRecord* hit) const
+{
+	Object const* o = scene_objects[idx];
+	switch (object_kinds[idx]) {
+	case OBJECT_MESH:
+		return static_cast<BVH const*>(o)->BVH::intersect_hit(ray, hit);
+	case OBJECT_INSTANCE_GROUP:
+		return static_cast<InstanceGroup const*>(o)->InstanceGroup::intersect_hit(ray, hit);
+	case OBJECT_PRIMITIVE_BVH:
+		return static_cast<PrimitiveBVH const*>(o)->PrimitiveBVH::intersect_hit(ray, hit);
+	case OBJECT_SPHERE:
+		return o->intersect_hit_as<Sphere>(ray, hit);
+	case OBJECT_PLANE:
+		return o->intersect_hit_as<Plane>(ray, hit);
+	case OBJECT_QUAD:
+		return o->intersect_hit_as<Quad>(ray, hit);
+	default:
+		return o->intersect_hit(ray, hit);
+	}
+}
+
+bool TopLevelBVH::
+occluded(int idx, Ray const& ray, float t_max) const
+{
+	Object const* o = scene_objects[idx];
+	switch (object_kinds[idx]) {
+	case OBJECT_MESH:
+		return static_cast<BVH const*>(o)->BVH::occluded(ray, t_max);
+	case OBJECT_INSTANCE_GROUP:
+		return static_cast<InstanceGroup const*>(o)->InstanceGroup::occluded(ray, t_max);
+	case OBJECT_PRIMITIVE_BVH:
+		return static_cast<PrimitiveBVH const*>(o)->PrimitiveBVH::occluded(ray, t_max);
+	case OBJECT_SPHERE:
+		return o->occluded_as<Sphere>(ray, t_max);
+	case OBJECT_PLANE:
+		return o->occluded_as<Plane>(ray, t_max);
+	case OBJECT_QUAD:
+		return o->occluded_as<Quad>(ray, t_max);
+	default:
+		return o->occluded(ray, t_max);
+	}
+}
+
+void TopLevelBVH::
+fill_intersection(Ray const& ray, HitRecord const& hit, Intersection* isect) const
+{
+	cg_assert(hit.object >= 0 && hit.object < int(scene_objects.size()));
+	Object const* o = scene_objects[hit.object];
+	switch (object_kinds[hit.object]) {
+	case OBJECT_MESH:
+		static_cast<BVH const*>(o)->BVH::fill_intersection(ray, hit, isect);
+		break;
+	case OBJECT_INSTANCE_GROUP:
+		static_cast<InstanceGroup const*>(o)->InstanceGroup::fill_intersection(ray, hit, isect);
+		break;
+	case OBJECT_PRIMITIVE_BVH:
+		static_cast<PrimitiveBVH const*>(o)->PrimitiveBVH::fill_intersection(ray, hit, isect);
+		break;
+	case OBJECT_SPHERE:
+		o->fill_intersection_as<Sphere>(ray, hit, isect);
+		break;
+	case OBJECT_PLANE:
+		o->fill_intersection_as<Plane>(ray, hit, isect);
+		break;
+	case OBJECT_QUAD:
+		o->fill_intersection_as<Quad>(ray, hit, isect);
+		break;
+	default:
+		o->fill_intersection(ray, hit, isect);
+		break;
+	}
+}
+
+void TopLevelBVH::
+keep_nearer(int idx, HitRecord const& candidate, HitRecord* hit)
+{
+	if (candidate.t < hit->t || (candidate.t == hit->t && hit->object >= 0 && idx < hit->object)) {
+		*hit = candidate;
+		hit->object = idx;
+	}
+}
+
+void TopLevelBVH::
+intersect_object(int idx, Ray const& ray, HitRecord* hit) const
+{
+	/* search no farther than the nearest hit so far, a hit as near still
+	 * wins for an object earlier in the scene */
+	HitRecord candidate;
+	candidate.t = hit->object >= 0 && idx < hit->object
+		? std::nextafter(hit->t, std::numeric_limits<float>::max())
+		: hit->t;
+	if (intersect_hit(idx, ray, &candidate))
+		keep_nearer(idx, candidate, hit);
+}
+
+bool TopLevelBVH::
+intersect(Ray const& ray, Intersection* isect, Object** object) const
+{
+	cg_assert(isect);
+	cg_assert(object);
+
+	HitRecord hit;
+	hit.t = isect->t;
+	if (!intersect(ray, &hit))
+		return false;
+	*object = scene_objects[hit.object];
+	fill_intersection(ray, hit, isect);
+	return true;
+}
+
+bool TopLevelBVH::
+intersect(Ray const& ray, HitRecord* hit) const
+{
+	cg_assert(hit);
+
+	hit->object = -1;
+	for (int idx : unbounded_objects)
+		intersect_object(idx, ray, hit);
+
+	glm::vec3 const div = 1.0f / ray.direction;
+	traverse(nodes, ray, div, hit->t, [&](Node const& n) -> bool {
+		for (int i = n.offset; i < n.offset + n.num_objects; i++) {
+			int const o = leaf_objects[i];
+			float t_min = 0.0f;
+			float t_max = hit->t;
+			if (object_bounds[o].intersect(ray, t_min, t_max, div))
+				intersect_object(o, ray, hit);
+		}
+		return false;
+	});
+
+	bool const found = hit->object >= 0;
+	if (BVH::traversal_counters) {
+		BVH::traversal_counters->rays++;
+		BVH::traversal_counters->hits += found;
+	}
+	return found;
+}
+
+bool TopLevelBVH::
+occluded(Ray const& ray, float t_max) const
+{
+	bool const found = find_occluder(ray, t_max);
+	if (BVH::traversal_counters) {
+		BVH::traversal_counters->rays++;
+		BVH::traversal_counters->hits += found;
+	}
+	return found;
+}
+
+bool TopLevelBVH::
+find_occluder(Ray const& ray, float t_max) const
+{
+	for (int idx : unbounded_objects) {
+		if (occluded(idx, ray, t_max))
+			return true;
+	}
+	glm::vec3 const div = 1.0f / ray.direction;
+	return traverse(nodes, ray, div, t_max, [&](Node const& n) -> bool {
+		for (int i = n.offset; i < n.offset + n.num_objects; i++) {
+			if (occluded(leaf_objects[i], ray, t_max))
+				return true;
+		}
+		return false;
+	});
+}
+
+void TopLevelBVH::
+intersect_packet(Ray const rays[], int num_rays, HitRecord hits[]) const
+{
+	cg_assert(num_rays <= BVH::MAX_PACKET_SIZE);
+
+	for (int i = 0; i < num_rays; i++) {
+		hits[i].object = -1;
+		for (int idx : unbounded_objects)
+			intersect_object(idx, rays[i], &hits[i]);
+	}
+
+	if (!nodes.empty()) {
+		glm::vec3 div[BVH::MAX_PACKET_SIZE];
+		for (int i = 0; i < num_rays; i++)
+			div[i] = 1.0f / rays[i].direction;
+
+		/* bit i of the mask is set if rays[i] crosses the bounds */
+		auto hit_mask = [&](AABB const& aabb, int mask) {
+			int result = 0;
+			for (int i = 0; i < num_rays; i++) {
+				float t_min = 0.0f;
+				float t_max = hits[i].t;
+				if ((mask & (1 << i)) && aabb.intersect(rays[i], t_min, t_max, div[i]))
+					result |= 1 << i;
+			}
+			return result;
+		};
+
+		struct Entry {
+			int idx;
+			int mask;
+		};
+		Entry stack[TRAVERSAL_STACK_SIZE];
+		int stack_size = 0;
+		stack[stack_size++] = Entry { 0, (1 << num_rays) - 1 };
+
+		HitRecord hits_temp[BVH::MAX_PACKET_SIZE];
+		bool found[BVH::MAX_PACKET_SIZE];
+		while (stack_size > 0) {
+			Entry const e = stack[--stack_size];
+			Node const& n = nodes[e.idx];
+			int const mask = hit_mask(n.aabb, e.mask);
+			if (!mask)
+				continue;
+			if (n.num_objects == 0) {
+				stack[stack_size++] = Entry { n.offset, mask };
+				stack[stack_size++] = Entry { e.idx + 1, mask };
+				cg_assert(stack_size <= TRAVERSAL_STACK_SIZE);
+				continue;
+			}
+
+			for (int l = n.offset; l < n.offset + n.num_objects; l++) {
+				int const o = leaf_objects[l];
+				int const object_mask = hit_mask(object_bounds[o], mask);
+				if (!object_mask)
+					continue;
+				if (object_kinds[o] != OBJECT_MESH) {
+					for (int i = 0; i < num_rays; i++) {
+						if (object_mask & (1 << i))
+							intersect_object(o, rays[i], &hits[i]);
+					}
+					continue;
+				}
+				static_cast<BVH const*>(scene_objects[o])->intersect_packet(rays, num_rays, hits_temp, found);
+				for (int i = 0; i < num_rays; i++) {
+					if (found[i])
+						keep_nearer(o, hits_temp[i], &hits[i]);
+				}
+			}
+		}
+	}
+
+	if (BVH::traversal_counters) {
+		BVH::traversal_counters->rays += num_rays;
+		for (int i = 0; i < num_rays; i++)
+			BVH::traversal_counters->hits += hits[i].object >= 0;
+	}
+}
+
+Object* TopLevelBVH::
+get_object(HitRecord const& hit) const
+{
+	return hit.object >= 0 ? scene_objects[hit.object] : nullptr;
+}
@@ -1,16 +1,6 @@
 #include <cglib/rt/transform.h>
 #include <cglib/core/assert.h>
 
-glm::vec3 transform_direction(glm::mat4 const& transform, glm::vec3 const& d)
-{
-	return glm::normalize(glm::vec3(transform*glm::vec4(d, 0.f)));
-}
-
-glm::vec3 transform_position(glm::mat4 const& transform, glm::vec3 const& p)
-{
-	return glm::vec3(transform*glm::vec4(p, 1.f));
-}
-
 glm::vec3 transform_direction_to_object_space(
 	glm::vec3 const& d, 
 	glm::vec3 const& normal, 
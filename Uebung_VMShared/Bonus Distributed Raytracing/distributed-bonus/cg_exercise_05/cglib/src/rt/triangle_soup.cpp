@@ -2,7 +2,9 @@
 
 #include <cglib/rt/interpolate.h>
 #include <cglib/rt/intersection.h>
+#include <cglib/rt/intersection_tests.h>
 #include <cglib/rt/material.h>
+#include <cglib/rt/ray.h>
 #include <cglib/rt/texture_mapping.h>
 
 #include <cglib/core/obj_mesh.h>
@@ -57,47 +59,22 @@ TriangleSoup(const std::string &obj_path, TextureContainer *textures)
 			s[j]->appendToNormalList(*m, normals);
 			s[j]->appendToTexcoordList(*m, tex_coordinates);
 
-			materials.emplace_back();
-			auto &mat = materials.back();
+			material_infos.emplace_back();
+			auto &info = material_infos.back();
 			auto &obj_mat = *(s[j]->material);
 
-			// --- diffuse
 			auto it = obj_mat.additionalInfo.find("map_Kd");
-			if(textures && it != obj_mat.additionalInfo.end()) {
-				std::string texturePath = it->second;
-
-                if (textures->find(texturePath) == textures->end()) {
-                    if (verbose) std::cout << "create texture: " << texturePath << std::endl;
-                    textures->insert({texturePath, std::make_shared<ImageTexture>(texturePath, NEAREST, REPEAT)});
-					(*textures)[texturePath]->create_mipmap();
-                }
-
-				mat.k_d = (*textures)[texturePath];
-			}
-			else {
-				mat.k_d = std::make_shared<ConstTexture>(obj_mat.diffuse);
-			}
-			
-			// --- specular
+			if(it != obj_mat.additionalInfo.end())
+				info.map_kd = it->second;
 			it = obj_mat.additionalInfo.find("map_Ks");
-			if(textures && it != obj_mat.additionalInfo.end()) {
-				std::string texturePath = it->second;
-
-                if (textures->find(texturePath) == textures->end()) {
-                    if (verbose) std::cout << "create texture: " << texturePath << std::endl;
-                    textures->insert({texturePath, std::make_shared<ImageTexture>(texturePath, NEAREST, REPEAT)});
-                }
-
-				mat.k_s = (*textures)[texturePath];
-			}
-			else {
-				mat.k_s = std::make_shared<ConstTexture>(obj_mat.specular);
-			}
-
-			mat.n = obj_mat.shininess;
+			if(it != obj_mat.additionalInfo.end())
+				info.map_ks = it->second;
+			info.diffuse   = obj_mat.diffuse;
+			info.specular  = obj_mat.specular;
+			info.shininess = obj_mat.shininess;
 
 			for(uint k = 0; k < s[j]->getFaceCount(); k++)
-				material_ids.push_back(materials.size() - 1);
+				material_ids.push_back(material_infos.size() - 1);
 			/* no texture coordinates in OBJ, fall back to zero mapping */
 			if(tex_coordinates.size() < vertices.size()) {
 				for(uint k = 0; k < s[j]->getFaceCount() * 3; k++)
@@ -119,6 +96,52 @@ TriangleSoup(const std::string &obj_path, TextureContainer *textures)
 	num_triangles = vertices.size() / 3;
 	
     cg_assert(material_ids.size() == uint32_t(num_triangles));
+
+	create_materials(textures);
+}
+
+void TriangleSoup::
+create_materials(TextureContainer *textures)
+{
+	bool verbose = false;
+	materials.clear();
+	for(auto const& info : material_infos) {
+		materials.emplace_back();
+		auto &mat = materials.back();
+
+		// --- diffuse
+		if(textures && !info.map_kd.empty()) {
+			std::string const& texturePath = info.map_kd;
+
+			if (textures->find(texturePath) == textures->end()) {
+				if (verbose) std::cout << "create texture: " << texturePath << std::endl;
+				textures->insert({texturePath, std::make_shared<ImageTexture>(texturePath, NEAREST, REPEAT)});
+				(*textures)[texturePath]->create_mipmap();
+			}
+
+			mat.k_d = (*textures)[texturePath];
+		}
+		else {
+			mat.k_d = std::make_shared<ConstTexture>(info.diffuse);
+		}
+
+		// --- specular
+		if(textures && !info.map_ks.empty()) {
+			std::string const& texturePath = info.map_ks;
+
+			if (textures->find(texturePath) == textures->end()) {
+				if (verbose) std::cout << "create texture: " << texturePath << std::endl;
+				textures->insert({texturePath, std::make_shared<ImageTexture>(texturePath, NEAREST, REPEAT)});
+			}
+
+			mat.k_s = (*textures)[texturePath];
+		}
+		else {
+			mat.k_s = std::make_shared<ConstTexture>(info.specular);
+		}
+
+		mat.n = info.shininess;
+	}
 }
 
 void TriangleSoup::
@@ -157,3 +180,31 @@ fill_intersection(
 
     cg_assert(uint32_t(material_ids[triangle_id]) < materials.size());
 }
+
+glm::vec2 TriangleSoup::
+compute_uv_footprint(const Ray rays[4], int triangle_id) const
+{
+	glm::vec2 uv_min = glm::vec2( std::numeric_limits<float>::max());
+	glm::vec2 uv_max = glm::vec2(-std::numeric_limits<float>::max());
+	cg_assert(triangle_id >= 0);
+	cg_assert(triangle_id < num_triangles);
+	for(int i = 0; i < 4; i++) {
+		glm::vec3 b = glm::vec3(0.0f);
+		float d;
+		intersect_triangle<false>(rays[i].origin, rays[i].direction,
+				vertices[triangle_id * 3 + 0],
+				vertices[triangle_id * 3 + 1],
+				vertices[triangle_id * 3 + 2],
+				b, d);
+
+		glm::vec2 uv = interpolate_barycentric(
+				tex_coordinates[triangle_id * 3 + 0],
+				tex_coordinates[triangle_id * 3 + 1],
+				tex_coordinates[triangle_id * 3 + 2], b);
+
+		uv_min = glm::min(uv_min, uv);
+		uv_max = glm::max(uv_max, uv);
+	}
+
+	return glm::abs(uv_max - uv_min);
+}
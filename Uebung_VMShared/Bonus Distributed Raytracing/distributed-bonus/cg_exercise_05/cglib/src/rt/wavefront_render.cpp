@@ -0,0 +1,232 @@
+#include <cglib/rt/wavefront_render.h>
+#include <cglib/rt/bvh.h>
+#include <cglib/rt/intersection.h>
+#include <cglib/rt/material.h>
+#include <cglib/rt/object.h>
+#include <cglib/rt/ray.h>
+#include <cglib/rt/raytracing_context.h>
+#include <cglib/rt/render_data.h>
+#include <cglib/rt/renderer.h>
+#include <cglib/rt/sampling_patterns.h>
+#include <cglib/rt/scene.h>
+
+#include <cglib/core/thread_local_data.h>
+
+#include <cglib/core/assert.h>
+#include <cmath>
+
+void WavefrontRender::RayQueue::
+clear()
+{
+	origins.clear();
+	directions.clear();
+	weights.clear();
+	samples.clear();
+	pixels.clear();
+}
+
+void WavefrontRender::RayQueue::
+push(glm::vec3 const& origin, glm::vec3 const& direction,
+		glm::vec3 const& weight, glm::vec2 const& sample, int pixel)
+{
+	origins.push_back(origin);
+	directions.push_back(direction);
+	weights.push_back(weight);
+	samples.push_back(sample);
+	pixels.push_back(pixel);
+}
+
+bool WavefrontRender::
+supports(RaytracingParameters const& params)
+{
+	return !params.dof && !params.stereo;
+}
+
+void WavefrontRender::
+spawn(RayQueue* next, RaytracingParameters const& params, int depth,
+		glm::vec3 const& P, glm::vec3 const& dir, glm::vec3 const& weight,
+		glm::vec2 const& sample, int pixel)
+{
+	if (depth + 1 > params.max_depth || weight == glm::vec3(0.f))
+		return;
+	next->push(P + params.ray_epsilon * dir, dir, weight, sample, pixel);
+}
+
+void WavefrontRender::
+spawn_transmission(RayQueue* next, RaytracingParameters const& params, int depth,
+		glm::vec3 const& P, glm::vec3 const& N, glm::vec3 const& V, float eta,
+		glm::vec3 const& weight, glm::vec2 const& sample, int pixel)
+{
+	float F = 0.f;
+	if (params.fresnel) {
+		F = fresnel(V, N, eta);
+		cg_assert(F >= 0.f);
+		cg_assert(F <= 1.f);
+		spawn(next, params, depth, P, reflect(V, N), F * weight, sample, pixel);
+	}
+
+	glm::vec3 T(0.f);
+	if (refract(V, N, eta, &T))
+		spawn(next, params, depth, P, T, (1.f - F) * weight, sample, pixel);
+}
+
+bool WavefrontRender::
+render_tile(RaytracingContext const& context, ThreadLocalData* tld,
+		int x0, int y0, int x1, int y1, PixelStore const& store, std::atomic<bool> const& terminate)
+{
+	RaytracingParameters const& params = context.params;
+	TopLevelBVH const& tlas = context.get_active_scene()->tlas;
+	int const width      = x1 - x0;
+	int const num_pixels = width * (y1 - y0);
+
+	RenderData data(context, tld);
+	std::vector<glm::vec3> colors(num_pixels, glm::vec3(0.f));
+
+	// The primary rays, with the pixel samples of render_pixel.
+	RayQueue queue, next;
+	std::vector<glm::vec2> samples;
+	for (int i = 0; i < num_pixels; i++) {
+		int const x = x0 + i % width;
+		int const y = y0 + i / width;
+		if (params.spp > 1) {
+			int const grid_size = int(sqrtf(static_cast<float>(params.spp)));
+			if (params.stratified)
+				generate_stratified_samples(&samples, grid_size, grid_size, tld);
+			else
+				generate_random_samples(&samples, grid_size, grid_size, tld);
+		}
+		else if (params.progressive) {
+			samples.assign(1, glm::vec2(tld->rand(), tld->rand()));
+		}
+		else {
+			samples.assign(1, glm::vec2(0.5f));
+		}
+
+		glm::vec3 const weight(1.f / float(samples.size()));
+		for (glm::vec2 const& s : samples) {
+			glm::vec2 const sample(float(x) + s.x, float(y) + s.y);
+			Ray const ray = createPrimaryRay(data, sample.x, sample.y);
+			queue.push(ray.origin, ray.direction, weight, sample, i);
+		}
+	}
+
+	bool const footprint = params.tex_filter_mode == TextureFilterMode::TRILINEAR
+	                    || params.tex_filter_mode == TextureFilterMode::DEBUG_MIP;
+	bool const packets = params.get_packet_block_size() > 1;
+
+	std::vector<HitRecord> hits;
+	std::vector<int> order, first;
+	for (int depth = 0; depth <= params.max_depth && queue.size() > 0; depth++) {
+		int const num_rays = queue.size();
+		if (terminate.load())
+			return false;
+
+		// Intersect the whole generation, primary rays as packets.
+		std::vector<Ray> rays(num_rays);
+		for (int i = 0; i < num_rays; i++)
+			rays[i] = Ray(queue.origins[i] + params.ray_epsilon * queue.directions[i], queue.directions[i]);
+		hits.assign(num_rays, HitRecord());
+		if (depth == 0 && packets) {
+			for (int i = 0; i < num_rays; i += BVH::MAX_PACKET_SIZE)
+				tlas.intersect_packet(&rays[i], std::min(num_rays - i, int(BVH::MAX_PACKET_SIZE)), &hits[i]);
+		}
+		else {
+			for (int i = 0; i < num_rays; i++)
+				tlas.intersect(rays[i], &hits[i]);
+		}
+
+		// Sort the hits by object with a counting sort, so that each
+		// object is shaded in one batch. Misses see the environment.
+		first.assign(tlas.num_objects() + 1, 0);
+		for (int i = 0; i < num_rays; i++) {
+			if (hits[i].object >= 0)
+				first[hits[i].object + 1]++;
+			else
+				colors[queue.pixels[i]] += queue.weights[i] * env_map_lookup(data, queue.directions[i]);
+		}
+		for (size_t o = 1; o < first.size(); o++)
+			first[o] += first[o - 1];
+		order.resize(first.back());
+		for (int i = 0; i < num_rays; i++) {
+			if (hits[i].object >= 0)
+				order[first[hits[i].object]++] = i;
+		}
+
+		// Shade like trace_recursive and queue the next generation.
+		next.clear();
+		for (int i : order) {
+			if (terminate.load())
+				return false;
+
+			glm::vec3 const& weight = queue.weights[i];
+			glm::vec2 const& sample = queue.samples[i];
+			int const pixel = queue.pixels[i];
+			data.x = sample.x;
+			data.y = sample.y;
+
+			Intersection isect;
+			tlas.fill_intersection(rays[i], hits[i], &isect);
+			Object* object = tlas.get_object(hits[i]);
+			if (depth == 0 && footprint) {
+				Ray const corner_rays[] = {
+					createPrimaryRay(data, sample.x - 0.5f, sample.y - 0.5f),
+					createPrimaryRay(data, sample.x + 0.5f, sample.y + 0.5f),
+					createPrimaryRay(data, sample.x - 0.5f, sample.y + 0.5f),
+					createPrimaryRay(data, sample.x + 0.5f, sample.y - 0.5f) };
+				object->compute_shading_info(corner_rays, &isect);
+			}
+			else {
+				object->compute_shading_info(&isect);
+			}
+
+			MaterialSample mat = isect.material;
+			if (params.diffuse_white_mode) {
+				mat.k_a = glm::vec3(0.1f);
+				mat.k_d = glm::vec3(1.0f);
+				mat.k_s = glm::vec3(0.0f);
+				mat.k_r = glm::vec3(0.0f);
+				mat.k_t = glm::vec3(0.0f);
+			}
+			glm::vec3 const N = params.normal_mapping ? isect.shading_normal : isect.normal;
+			glm::vec3 const V = -queue.directions[i];
+			glm::vec3 const& P = isect.position;
+			bool const hit_backside = glm::dot(isect.geometric_normal, V) < 0.f;
+
+			if (params.ao) {
+				colors[pixel] += weight * evaluate_ambient_occlusion(data, P, N);
+				continue;
+			}
+
+			if (!hit_backside) {
+				bool const distributed_recursion = tld->distributed_recursion;
+				tld->distributed_recursion = true;
+				colors[pixel] += weight * evaluate_illumination(data, mat, P, N, V, depth);
+				tld->distributed_recursion = distributed_recursion;
+			}
+
+			if (!hit_backside && params.reflection && glm::length(mat.k_r) > 0.f)
+				spawn(&next, params, depth, P, reflect(V, N), weight * mat.k_r, sample, pixel);
+
+			if (params.transmission && glm::length(mat.k_t) > 0.f) {
+				glm::vec3 const& eta = mat.eta;
+				if (params.dispersion && !(eta[0] == eta[1] && eta[0] == eta[2])) {
+					for (int c = 0; c < 3; c++) {
+						glm::vec3 channel(0.f);
+						channel[c] = 1.f;
+						spawn_transmission(&next, params, depth, P, N, V, eta[c],
+								weight * mat.k_t * channel, sample, pixel);
+					}
+				}
+				else {
+					spawn_transmission(&next, params, depth, P, N, V, 1.f/3.f*(eta[0]+eta[1]+eta[2]),
+							weight * mat.k_t, sample, pixel);
+				}
+			}
+		}
+		std::swap(queue, next);
+	}
+
+	for (int i = 0; i < num_pixels; i++)
+		store(x0 + i % width, y0 + i / width, colors[i]);
+	return true;
+}